@@ -0,0 +1,130 @@
+// Память для больших буферов блоков (см. arena.h).
+//
+#include "arena.h"
+#include "numa.h"
+#include "util.h"
+#include <cstdlib>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <map>
+#include <vector>
+using namespace std;
+
+// Размер большой страницы
+static const size_t kHugePage = 2 << 20;
+
+enum { PAGES_4K, PAGES_THP, PAGES_HUGETLB };
+
+struct ArenaBlock {
+    size_t len;    // длина отображения
+    int node;      // запрошенный узел NUMA (-1 - любой)
+    bool huge;     // были ли разрешены большие страницы
+    int pages;     // какие страницы получены
+};
+
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static map<void *, ArenaBlock> live;
+static vector<pair<void *, ArenaBlock> > cache;
+static bool useHuge = true;
+static const char *lastKind = "-";
+
+static size_t RoundUp(size_t n, size_t page) {
+    return (n + page - 1) / page * page;
+}
+
+// Длина отображения для буфера из n байтов. Буфер, которому до целого
+// числа больших страниц не хватает не больше четверти размера, целиком
+// размещается на больших страницах; иначе ими покрывается только его
+// часть, кратная 2Мб, а остаток лежит на обычных страницах.
+size_t ArenaSize(size_t n) {
+    size_t huge = RoundUp(n, kHugePage);
+    return useHuge && huge - n <= n / 4 ? huge : RoundUp(n, sysconf(_SC_PAGESIZE));
+}
+
+// Новое отображение длины b->len; заполняет b->pages
+static void *Map(ArenaBlock *b) {
+    const int prot = PROT_READ | PROT_WRITE, flags = MAP_PRIVATE | MAP_ANONYMOUS;
+    void *p = MAP_FAILED;
+    b->pages = PAGES_4K;
+#ifdef MAP_HUGETLB
+    if (b->huge && b->len % kHugePage == 0) {
+        p = mmap(NULL, b->len, prot, flags | MAP_HUGETLB, -1, 0);
+        if (p != MAP_FAILED) b->pages = PAGES_HUGETLB;
+    }
+#endif
+#ifdef MADV_HUGEPAGE
+    if (p == MAP_FAILED && b->huge && b->len >= kHugePage) {
+        // прозрачные большие страницы требуют выравнивания на 2Мб:
+        // берём отображение с запасом и обрезаем края
+        char *q = (char *)mmap(NULL, b->len + kHugePage, prot, flags, -1, 0);
+        if (q != MAP_FAILED) {
+            size_t head = (kHugePage - (uintptr_t)q % kHugePage) % kHugePage;
+            if (head != 0) munmap(q, head);
+            munmap(q + head + b->len, kHugePage - head);
+            p = q + head;
+            if (madvise(p, b->len, MADV_HUGEPAGE) == 0) b->pages = PAGES_THP;
+        }
+    }
+#endif
+    if (p == MAP_FAILED) p = mmap(NULL, b->len, prot, flags, -1, 0);
+    if (p == MAP_FAILED) die("Out of memory\n");
+    // до первого обращения к страницам
+    NumaBindMemory(p, b->len, b->node);
+    return p;
+}
+
+unsigned char *ArenaAlloc(size_t n, int node) {
+    static const char *kinds[] = { "4k", "thp", "hugetlb" };
+    ArenaBlock b;
+    b.huge = useHuge;
+    b.len = ArenaSize(n);
+    b.node = NumaNodes() > 1 ? node : -1;  // иначе узел не важен
+
+    pthread_mutex_lock(&mutex);
+    void *p = NULL;
+    for (size_t i = 0; i < cache.size(); i++) {
+        const ArenaBlock &c = cache[i].second;
+        if (c.len == b.len && c.node == b.node && c.huge == b.huge) {
+            p = cache[i].first;
+            b = c;
+            cache[i] = cache.back();
+            cache.pop_back();
+            break;
+        }
+    }
+    pthread_mutex_unlock(&mutex);
+
+    bool fresh = p == NULL;
+    if (fresh) p = Map(&b);
+    pthread_mutex_lock(&mutex);
+    if (fresh && b.len >= kHugePage) lastKind = kinds[b.pages];
+    live[p] = b;
+    pthread_mutex_unlock(&mutex);
+    return (unsigned char *)p;
+}
+
+void ArenaFree(void *p) {
+    if (p == NULL) return;
+    pthread_mutex_lock(&mutex);
+    map<void *, ArenaBlock>::iterator it = live.find(p);
+    if (it == live.end()) die("ArenaFree: unknown buffer\n");
+    cache.push_back(*it);
+    live.erase(it);
+    pthread_mutex_unlock(&mutex);
+}
+
+void ArenaTrim() {
+    pthread_mutex_lock(&mutex);
+    for (size_t i = 0; i < cache.size(); i++) munmap(cache[i].first, cache[i].second.len);
+    cache.clear();
+    pthread_mutex_unlock(&mutex);
+}
+
+void ArenaUseHugePages(bool on) {
+    useHuge = on;
+}
+
+const char *ArenaPageKind() {
+    return lastKind;
+}
@@ -0,0 +1,43 @@
+// Память для больших буферов блоков: массивов компрессоров (arr1, arr2,
+// ftab) и буферов входных блоков.
+//
+// Буферы выделяются через mmap, по возможности на страницах размером 2Мб:
+// сначала из пула hugetlbfs (MAP_HUGETLB), затем обычные страницы с
+// madvise(MADV_HUGEPAGE) для прозрачных больших страниц; если не удаётся
+// и это, остаются обычные страницы. Сортировка блока обращается к памяти
+// в случайном порядке, и на больших страницах промахов TLB намного меньше.
+//
+// Освобождённые буферы не возвращаются системе, а хранятся до следующего
+// запроса того же размера, так что конвейер следующего файла получает
+// буферы предыдущего, а не выделяет их заново. Буферы компрессоров и
+// входных блоков взаимозаменяемы (компрессор обменивается буфером с
+// блоком), поэтому у них общий кэш. Все функции потокобезопасны.
+//
+#ifndef MTBZIP2_ARENA_H
+#define MTBZIP2_ARENA_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Выделяет буфер не меньше n байтов; node - узел NUMA, на котором его
+// желательно разместить (см. numa.h), -1 - там, где к нему обратятся первым
+unsigned char *ArenaAlloc(size_t n, int node = -1);
+
+// Память, которую на самом деле займёт буфер из n байтов (с округлением
+// до размера страницы)
+size_t ArenaSize(size_t n);
+
+// Возвращает буфер, выделенный ArenaAlloc, в кэш
+void ArenaFree(void *p);
+
+// Возвращает системе память всех буферов в кэше
+void ArenaTrim();
+
+// Использовать ли большие страницы для новых буферов (по умолчанию да)
+void ArenaUseHugePages(bool on);
+
+// Страницы, на которых был выделен последний новый буфер размером от 2Мб:
+// "hugetlb", "thp" (madvise принят ядром), "4k" или "-" (таких не было)
+const char *ArenaPageKind();
+
+#endif
@@ -0,0 +1,438 @@
+// bench: измерение скорости mtbzip2 и сравнение результата с libbz2.
+//
+// Для набора воспроизводимых тестовых данных (корпусов) и каждого уровня
+// сжатия печатаются:
+//   ref.compress, ref.decompress - однопоточные сжатие и распаковка libbz2;
+//   stage.input  - чтение с RLE-сжатием и подсчётом CRC (InputThread);
+//   stage.block  - сжатие блоков (BWT, MTF, Хаффман) в одном потоке;
+//   stage.block.4k - то же с массивами компрессора на обычных страницах;
+//                  ускорение stage.block считается по отношению к нему,
+//                  то есть это выигрыш от больших страниц (arena.h);
+//   stage.output - запись битового потока (BitStreamWriter);
+//   compress, decompress - весь конвейер mtbzip2 для каждого числа потоков.
+// Скорость везде считается по объёму исходных данных, ускорение - по
+// отношению к libbz2. Результат сжатия (и собранный из отдельных стадий,
+// и полученный конвейером) побайтово сравнивается с результатом libbz2 в
+// режиме программы bzip2, результат распаковки - с исходными данными.
+// При любом расхождении код возврата равен 1.
+//
+// Использование: bench [-s размер корпуса в Мб] [-p 1,2,4] [-l 1,9]
+//                      [-n число замеров] [корпус ...]
+// Корпуса: random, lowent, runs, text, logs (по умолчанию все).
+//
+// Программа включает mtbzip2.cc целиком (без main), чтобы измерять стадии
+// конвейера по отдельности.
+//
+#define MTBZIP2_LIBRARY
+#include "mtbzip2.cc"
+#include <time.h>
+
+typedef vector<unsigned char> Data;
+
+static double Now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Генератор псевдослучайных чисел: корпуса одинаковы на всех машинах
+struct Rng {
+    uint64_t s;
+    Rng(uint64_t seed) : s(seed) {}
+    uint32_t Next() {
+        s = s * 6364136223846793005ULL + 1442695040888963407ULL;
+        return (uint32_t)(s >> 33);
+    }
+    uint32_t Below(uint32_t n) { return Next() % n; }
+    // от 0 до n-1, малые значения намного вероятнее (примерно закон Ципфа)
+    uint32_t Skewed(uint32_t n) {
+        uint64_t x = Below(n);
+        return (uint32_t)(x * x / n * x / n);
+    }
+};
+
+// Равномерно распределённые байты: худший случай для сжатия
+static void GenRandom(Rng &r, Data &d, size_t n) {
+    while (d.size() < n) d.push_back((unsigned char)r.Next());
+}
+
+// Несколько символов с сильно неравномерными частотами
+static void GenLowEntropy(Rng &r, Data &d, size_t n) {
+    static const char alphabet[] = "aaaaaaaabbbbccd\n";
+    while (d.size() < n) d.push_back(alphabet[r.Below(16)]);
+}
+
+// Серии одинаковых байтов: короткие, около границ RLE1 (4 и 255 байтов,
+// add_pair) и длинные
+static void GenRuns(Rng &r, Data &d, size_t n) {
+    static const uint32_t lens[] = { 1, 2, 3, 4, 5, 6, 251, 254, 255, 256, 259, 260, 510, 4000 };
+    while (d.size() < n) {
+        unsigned char c = r.Below(4) == 0 ? (unsigned char)r.Next() : r.Below(3);
+        size_t len = min((size_t)lens[r.Below(14)], n - d.size());
+        d.insert(d.end(), len, c);
+    }
+}
+
+// Текст из слов словаря с частотами по закону Ципфа
+static void GenText(Rng &r, Data &d, size_t n) {
+    static const char letters[] = "etaoinshrdlcumwfgypbvkjxqz";
+    vector<string> words;
+    for (int i = 0; i < 5000; i++) {
+        string w;
+        for (int len = 1 + r.Below(3) + r.Below(7); len > 0; len--)
+            w += letters[r.Skewed(26)];
+        words.push_back(w);
+    }
+
+    size_t col = 0;
+    bool capital = true;
+    while (d.size() < n) {
+        string w = words[r.Skewed(words.size())];
+        if (capital) w[0] = toupper(w[0]);
+        capital = false;
+        uint32_t p = r.Below(20);
+        if (p == 0) { w += "."; capital = true; }
+        else if (p == 1) w += ",";
+
+        if (col + w.size() > 72) {
+            d.push_back('\n');
+            col = 0;
+        } else if (col > 0) {
+            d.push_back(' ');
+            col++;
+        }
+        d.insert(d.end(), w.begin(), w.end());
+        col += w.size();
+    }
+    d.resize(n);
+}
+
+// Журнал веб-сервера: адреса клиентов, время, запросы, коды ответов
+static void GenLogs(Rng &r, Data &d, size_t n) {
+    static const char *methods[] = { "GET", "GET", "GET", "GET", "POST", "HEAD" };
+    static const char *paths[] = {
+        "/", "/index.html", "/static/app.js", "/static/style.css", "/favicon.ico",
+        "/api/v1/items?page=", "/api/v1/users/", "/images/photo_", "/search?q="
+    };
+    static const char *agents[] = {
+        "Mozilla/5.0 (X11; Linux x86_64; rv:109.0) Gecko/20100101 Firefox/115.0",
+        "Mozilla/5.0 (Windows NT 10.0; Win64; x64) AppleWebKit/537.36 Chrome/120.0",
+        "Mozilla/5.0 (iPhone; CPU iPhone OS 17_0 like Mac OS X) Safari/604.1",
+        "curl/7.88.1", "Googlebot/2.1 (+http://www.google.com/bot.html)"
+    };
+    static const int statuses[] = { 200, 200, 200, 200, 200, 304, 304, 404, 301, 500 };
+
+    vector<uint32_t> clients;
+    for (int i = 0; i < 1000; i++) clients.push_back(r.Next());
+
+    time_t t = 1700000000;
+    while (d.size() < n) {
+        t += r.Below(3);
+        struct tm tm;
+        char ts[64], line[512];
+        gmtime_r(&t, &tm);
+        strftime(ts, sizeof(ts), "%d/%b/%Y:%H:%M:%S +0000", &tm);
+
+        uint32_t ip = clients[r.Skewed(clients.size())];
+        int path = r.Skewed(9);
+        int status = statuses[r.Below(10)];
+        snprintf(line, sizeof(line),
+                 "%u.%u.%u.%u - - [%s] \"%s %s%s HTTP/1.1\" %d %u \"-\" \"%s\"\n",
+                 ip >> 24, (ip >> 16) & 255, (ip >> 8) & 255, ip & 255, ts,
+                 methods[r.Below(6)], paths[path],
+                 path >= 5 ? (r.Below(2) ? "42" : "1337") : "",
+                 status, status == 304 ? 0 : 200 + r.Skewed(60000),
+                 agents[r.Skewed(5)]);
+        d.insert(d.end(), line, line + strlen(line));
+    }
+    d.resize(n);
+}
+
+static struct {
+    const char *name;
+    void (*gen)(Rng &, Data &, size_t);
+} corpora[] = {
+    { "random", GenRandom },
+    { "lowent", GenLowEntropy },
+    { "runs", GenRuns },
+    { "text", GenText },
+    { "logs", GenLogs },
+};
+static const int kNumCorpora = sizeof(corpora) / sizeof(corpora[0]);
+
+// Сжатие libbz2 в том же режиме, что и в программе bzip2: все данные
+// передаются с BZ_RUN, и только затем поток завершается BZ_FINISH
+static void RefCompress(const Data &in, int level, Data &out) {
+    bz_stream strm;
+    memset(&strm, 0, sizeof(strm));
+    if (BZ2_bzCompressInit(&strm, level, 0, 30) != BZ_OK) die("BZ2_bzCompressInit failed\n");
+    out.resize(in.size() + in.size() / 50 + 1024);
+    strm.next_in = (char *)&in[0];
+    strm.avail_in = in.size();
+    strm.next_out = (char *)&out[0];
+    strm.avail_out = out.size();
+    while (strm.avail_in != 0) {
+        if (BZ2_bzCompress(&strm, BZ_RUN) != BZ_RUN_OK) die("BZ2_bzCompress failed\n");
+    }
+    int ret;
+    while ((ret = BZ2_bzCompress(&strm, BZ_FINISH)) == BZ_FINISH_OK) {}
+    if (ret != BZ_STREAM_END) die("BZ2_bzCompress failed\n");
+    out.resize(strm.total_out_lo32);
+    BZ2_bzCompressEnd(&strm);
+}
+
+static void RefDecompress(const Data &in, size_t size, Data &out) {
+    out.resize(size);
+    unsigned int n = size;
+    if (BZ2_bzBuffToBuffDecompress((char *)&out[0], &n, (char *)&in[0], in.size(), 0, 0) != BZ_OK ||
+        n != size)
+        die("BZ2_bzBuffToBuffDecompress failed\n");
+}
+
+// Источник, читающий данные из памяти
+class MemorySource : public ByteSource {
+  public:
+    MemorySource(const Data &d) : d(d), pos(0) {}
+    virtual uint32_t Read(unsigned char *buf, uint32_t n) {
+        n = min((size_t)n, d.size() - pos);
+        memcpy(buf, &d[pos], n);
+        pos += n;
+        return n;
+    }
+
+  private:
+    const Data &d;
+    size_t pos;
+};
+
+// Приёмник, собирающий данные в памяти
+class MemorySink : public MtSink {
+  public:
+    Data data;
+    virtual void Write(const unsigned char *p, size_t n) { data.insert(data.end(), p, p + n); }
+};
+
+// Время работы стадий конвейера, выполняемых по очереди в одном потоке.
+// out - bzip2-файл, собранный из результатов стадий.
+static void RunStages(const Data &in, int level, double t[3], Data &out) {
+    // чтение: RLE-сжатие и CRC; блоки копируются для следующей стадии
+    vector<Data> blocks;
+    vector<uint32_t> crcs;
+    MemorySource source(in);
+    BufferPool buffers(4, 1);
+    InputThread reader(&source, level, 1048576, 4);
+    reader.Connect(&buffers, NULL);
+
+    double start = Now();
+    pthread_t handle = StartThread(&reader);
+    InputBlock *b;
+    while ((b = reader.Get()) != NULL) {
+        blocks.push_back(Data(b->data, b->data + b->size));
+        crcs.push_back(b->crc);
+        buffers.Put(b->out);
+        reader.Put(b);
+    }
+    pthread_join(handle, NULL);
+    t[0] = Now() - start;
+
+    // сжатие блоков
+    BzipBlockCompressor compressor(level);
+    vector<Data> packed(blocks.size());
+    vector<uint32_t> bits(blocks.size());
+    t[1] = 0;
+    for (size_t i = 0; i < blocks.size(); i++) {
+        memcpy(compressor.InputBuffer(), &blocks[i][0], blocks[i].size());
+        start = Now();
+        compressor.Compress(blocks[i].size(), crcs[i]);
+        t[1] += Now() - start;
+        bits[i] = compressor.OutputBits();
+        packed[i].assign(compressor.OutputBuffer(),
+                         compressor.OutputBuffer() + (bits[i] + 7) / 8);
+    }
+
+    // запись: заголовок, блоки и маркер конца с общей CRC, как в OutputThread
+    MemorySink sink;
+    sink.data.reserve(in.size() + in.size() / 50 + 1024);
+    start = Now();
+    {
+        BitStreamWriter writer(&sink, 4194304);
+        unsigned char magic[4] = { 'B', 'Z', 'h', (unsigned char)('0' + level) };
+        writer.Write(magic, 32);
+        uint32_t c_crc = 0;
+        for (size_t i = 0; i < packed.size(); i++) {
+            writer.Write(&packed[i][0], bits[i]);
+            c_crc = ((c_crc << 1) | (c_crc >> 31)) ^ crcs[i];
+        }
+        unsigned char a[10] = {
+            0x17, 0x72, 0x45, 0x38, 0x50, 0x90,
+            (unsigned char)(c_crc >> 24), (unsigned char)(c_crc >> 16),
+            (unsigned char)(c_crc >> 8), (unsigned char)c_crc
+        };
+        writer.Write(a, 80);
+    }
+    t[2] = Now() - start;
+    out.swap(sink.data);
+}
+
+// Сжатие (level > 0) или распаковка через интерфейс библиотеки
+static double RunPipeline(MtThreadPool *pool, const Data &in, int level, Data &out) {
+    MemorySink sink;
+    double start = Now();
+    {
+        MtStream *z = level > 0 ? (MtStream *)new MtCompressor(pool, level, &sink)
+                                : (MtStream *)new MtDecompressor(pool, &sink);
+        z->Write(&in[0], in.size());
+        if (!z->Finish()) {
+            fprintf(stderr, "%s\n", z->Error());
+            die("Pipeline failed\n");
+        }
+        delete z;
+    }
+    double t = Now() - start;
+    out.swap(sink.data);
+    return t;
+}
+
+// Разбор списка чисел вида 1,2,4
+static vector<int> ParseList(const char *s) {
+    vector<int> v;
+    while (*s != 0) {
+        char *end;
+        v.push_back(strtol(s, &end, 10));
+        if (end == s || v.back() <= 0) die("Invalid list\n");
+        s = *end == ',' ? end + 1 : end;
+    }
+    return v;
+}
+
+static double Speed(size_t bytes, double t) {
+    return bytes / 1e6 / (t > 0 ? t : 1e-9);
+}
+
+static void Report(const char *corpus, int level, int threads, const char *stage,
+                   double speed, double base, const char *check) {
+    char th[16] = "-", sp[16] = "";
+    if (threads > 0) snprintf(th, sizeof(th), "%d", threads);
+    if (base > 0) snprintf(sp, sizeof(sp), "%.2fx", speed / base);
+    printf("%-7s %5d %7s %-15s %9.1f %8s %s\n", corpus, level, th, stage, speed, sp, check);
+    fflush(stdout);
+}
+
+int main(int argc, char **argv) {
+    size_t size = 8 << 20;
+    int reps = 1;
+    vector<int> threads, levels;
+    vector<int> selected;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+            size = (size_t)(atof(argv[++i]) * 1048576);
+        } else if (strcmp(argv[i], "-p") == 0 && i + 1 < argc) {
+            threads = ParseList(argv[++i]);
+        } else if (strcmp(argv[i], "-l") == 0 && i + 1 < argc) {
+            levels = ParseList(argv[++i]);
+        } else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+            reps = max(1, atoi(argv[++i]));
+        } else {
+            int k = 0;
+            while (k < kNumCorpora && strcmp(argv[i], corpora[k].name) != 0) k++;
+            if (k == kNumCorpora) {
+                fprintf(stderr, "Usage: %s [-s <Mb>] [-p 1,2,4] [-l 1,9] [-n <reps>] "
+                        "[random|lowent|runs|text|logs ...]\n", argv[0]);
+                die();
+            }
+            selected.push_back(k);
+        }
+    }
+    if (size == 0) die("Invalid corpus size\n");
+    if (threads.empty()) {
+        int ncpu = DetectCPUs();
+        for (int p = 1; p < ncpu; p *= 2) threads.push_back(p);
+        threads.push_back(ncpu);
+    }
+    if (levels.empty()) {
+        for (int k = 1; k <= 9; k++) levels.push_back(k);
+    }
+    for (size_t i = 0; i < levels.size(); i++) {
+        if (levels[i] > 9) die("Invalid level\n");
+    }
+    if (selected.empty()) {
+        for (int k = 0; k < kNumCorpora; k++) selected.push_back(k);
+    }
+
+    vector<MtThreadPool *> pools;
+    for (size_t i = 0; i < threads.size(); i++) pools.push_back(new MtThreadPool(threads[i]));
+
+    // какие большие страницы удаётся получить
+    ArenaFree(ArenaAlloc(4 << 20));
+    printf("corpus size %.1f Mb, %d cpus, crc engine %s, pages %s, best of %d\n",
+           size / 1048576.0, DetectCPUs(), CrcEngineName(), ArenaPageKind(), reps);
+    printf("%-7s %5s %7s %-15s %9s %8s %s\n",
+           "corpus", "level", "threads", "stage", "MB/s", "speedup", "check");
+
+    bool failed = false;
+    for (size_t c = 0; c < selected.size(); c++) {
+        const char *name = corpora[selected[c]].name;
+        Rng rng(selected[c] + 1);
+        Data in;
+        in.reserve(size);
+        corpora[selected[c]].gen(rng, in, size);
+
+        for (size_t l = 0; l < levels.size(); l++) {
+            int level = levels[l];
+            Data ref, out;
+            double t_ref = 1e30, t_unref = 1e30, t_stage[3] = { 1e30, 1e30, 1e30 };
+            double t_small = 1e30;
+            bool stages_ok = true;
+            for (int rep = 0; rep < reps; rep++) {
+                double start = Now();
+                RefCompress(in, level, ref);
+                t_ref = min(t_ref, Now() - start);
+
+                start = Now();
+                RefDecompress(ref, in.size(), out);
+                t_unref = min(t_unref, Now() - start);
+
+                double t[3];
+                ArenaUseHugePages(false);
+                RunStages(in, level, t, out);
+                ArenaUseHugePages(true);
+                stages_ok = stages_ok && out == ref;
+                t_small = min(t_small, t[1]);
+                RunStages(in, level, t, out);
+                stages_ok = stages_ok && out == ref;
+                for (int k = 0; k < 3; k++) t_stage[k] = min(t_stage[k], t[k]);
+            }
+            double base = Speed(in.size(), t_ref), unbase = Speed(in.size(), t_unref);
+            Report(name, level, 1, "ref.compress", base, base, "");
+            Report(name, level, 1, "ref.decompress", unbase, unbase, "");
+            Report(name, level, 1, "stage.input", Speed(in.size(), t_stage[0]), 0, "");
+            double small = Speed(in.size(), t_small);
+            Report(name, level, 1, "stage.block.4k", small, 0, "");
+            Report(name, level, 1, "stage.block", Speed(in.size(), t_stage[1]), small, "");
+            Report(name, level, 1, "stage.output", Speed(in.size(), t_stage[2]), 0,
+                   stages_ok ? "ok" : "MISMATCH");
+            failed = failed || !stages_ok;
+
+            for (size_t p = 0; p < pools.size(); p++) {
+                double t_z = 1e30, t_unz = 1e30;
+                bool z_ok = true, unz_ok = true;
+                for (int rep = 0; rep < reps; rep++) {
+                    t_z = min(t_z, RunPipeline(pools[p], in, level, out));
+                    z_ok = z_ok && out == ref;
+                    t_unz = min(t_unz, RunPipeline(pools[p], ref, 0, out));
+                    unz_ok = unz_ok && out == in;
+                }
+                Report(name, level, threads[p], "compress", Speed(in.size(), t_z), base,
+                       z_ok ? "ok" : "MISMATCH");
+                Report(name, level, threads[p], "decompress", Speed(in.size(), t_unz), unbase,
+                       unz_ok ? "ok" : "MISMATCH");
+                failed = failed || !z_ok || !unz_ok;
+            }
+        }
+    }
+
+    for (size_t i = 0; i < pools.size(); i++) delete pools[i];
+    if (failed) printf("FAILED: output differs from libbz2\n");
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,202 @@
+// Реализация BitStreamWriter.
+//
+#include "bitstream.h"
+#include "util.h"
+#include "stats.h"
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <unistd.h>
+#include <sys/uio.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Размер страницы, на границу которой выравнивается буфер
+static const size_t kBufferAlign = 4096;
+
+static inline uint64_t load64_be(const unsigned char *p) {
+#if defined(__GNUC__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    uint64_t x;
+    memcpy(&x, p, 8);
+    return __builtin_bswap64(x);
+#else
+    uint64_t x = 0;
+    for (int i = 0; i < 8; i++) x = (x << 8) | p[i];
+    return x;
+#endif
+}
+
+static inline void store64_be(unsigned char *p, uint64_t x) {
+#if defined(__GNUC__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    x = __builtin_bswap64(x);
+    memcpy(p, &x, 8);
+#else
+    for (int i = 7; i >= 0; i--) { p[i] = x & 0xff; x >>= 8; }
+#endif
+}
+
+// Записывает в dst n байтов src, сдвинутых вправо на sh (1..7) битов;
+// старшие sh битов первого байта берутся из partial. Возвращает младшие
+// sh битов последнего байта src, выровненные по старшему разряду.
+static unsigned char ShiftBytes(unsigned char *dst, const unsigned char *src,
+                                size_t n, unsigned sh, unsigned char partial) {
+    size_t i = 0;
+
+#ifdef __SSE2__
+    // Пары (src[i-1], src[i]) раскладываются в 16-битные слова, которые
+    // сдвигаются на sh битов; младшие байты результата и есть dst[i].
+    if (n >= 64) {
+        const __m128i cnt = _mm_cvtsi32_si128(sh);
+        const __m128i mask = _mm_set1_epi16(0xff);
+        __m128i prev = _mm_cvtsi32_si128(partial >> (8 - sh));
+        for (; i + 16 <= n; i += 16) {
+            __m128i a = _mm_loadu_si128((const __m128i *)(src + i));
+            __m128i b = _mm_or_si128(_mm_slli_si128(a, 1), prev);
+            prev = _mm_srli_si128(a, 15);
+            __m128i lo = _mm_srl_epi16(_mm_unpacklo_epi8(a, b), cnt);
+            __m128i hi = _mm_srl_epi16(_mm_unpackhi_epi8(a, b), cnt);
+            _mm_storeu_si128((__m128i *)(dst + i),
+                             _mm_packus_epi16(_mm_and_si128(lo, mask),
+                                              _mm_and_si128(hi, mask)));
+        }
+        partial = src[i - 1] << (8 - sh);
+    }
+#endif
+
+    uint64_t acc = (uint64_t)partial << 56;
+    for (; i + 8 <= n; i += 8) {
+        uint64_t w = load64_be(src + i);
+        store64_be(dst + i, acc | (w >> sh));
+        acc = w << (64 - sh);
+    }
+    partial = acc >> 56;
+
+    for (; i < n; i++) {
+        dst[i] = partial | (src[i] >> sh);
+        partial = src[i] << (8 - sh);
+    }
+    return partial;
+}
+
+FileSink::FileSink(FILE *fp) {
+    // всё дальнейшее пишется в дескриптор напрямую
+    fflush(fp);
+    this->fp = fp;
+    fd = fileno(fp);
+}
+
+FileSink::~FileSink() {
+    fclose(fp);
+}
+
+void FileSink::Write(const unsigned char *data, size_t n) {
+    struct iovec iov;
+    iov.iov_base = (void *)data;
+    iov.iov_len = n;
+    WriteV(&iov, 1);
+}
+
+void FileSink::WriteV(const struct iovec *iov, int count) {
+    // массив вызывающей стороны не изменяется: после частичной записи
+    // сдвигается его копия, в которую берётся до 8 элементов за раз
+    for (; count > 8; count -= 8, iov += 8) WriteV(iov, 8);
+
+    struct iovec v[8];
+    int cnt = 0;
+    for (int i = 0; i < count; i++)
+        if (iov[i].iov_len != 0) v[cnt++] = iov[i];
+
+    struct iovec *p = v;
+    while (cnt > 0) {
+        ssize_t m = writev(fd, p, cnt);
+        if (m < 0) {
+            if (errno == EINTR) continue;
+            perror("write");
+            die("Failed to write data to output file\n");
+        }
+        while (cnt > 0 && (size_t)m >= p->iov_len) {
+            m -= p->iov_len;
+            p++;
+            cnt--;
+        }
+        if (cnt > 0) {
+            p->iov_base = (char *)p->iov_base + m;
+            p->iov_len -= m;
+        }
+    }
+}
+
+BitStreamWriter::BitStreamWriter(MtSink *sink, int bufferSize) {
+    void *p;
+    if (posix_memalign(&p, kBufferAlign, bufferSize) != 0) die("Out of memory\n");
+    this->sink = sink;
+    tail = buffer = (unsigned char *)p;
+    bufend = buffer + bufferSize;
+    live = 0;
+    partial = 0;
+}
+
+BitStreamWriter::~BitStreamWriter() {
+    if (live > 0) *tail++ = partial;
+    Flush();
+    free(buffer);
+}
+
+void BitStreamWriter::Write(const unsigned char *data, uint32_t bits) {
+    size_t n = bits / 8;
+    bits %= 8;
+
+    if (live == 0) {
+        if (n <= (size_t)(bufend - tail)) {
+            memcpy(tail, data, n);
+            tail += n;
+            if (tail == bufend) Flush();
+        } else {
+            // блок не помещается в буфер: пишем буфер и блок одним вызовом
+            WriteOut(data, n);
+        }
+        data += n;
+    } else {
+        while (n != 0) {
+            size_t k = bufend - tail;
+            if (k > n) k = n;
+            partial = ShiftBytes(tail, data, k, live, partial);
+            tail += k;
+            data += k;
+            n -= k;
+            if (tail == bufend) Flush();
+        }
+    }
+
+    if (bits != 0) {
+        unsigned char b = *data & (0xff00 >> bits);
+        partial |= b >> live;
+        live += bits;
+        if (live >= 8) {
+            live -= 8;
+            *tail = partial;
+            if (++tail == bufend) Flush();
+            partial = b << (bits - live);
+        }
+    }
+}
+
+void BitStreamWriter::Flush() {
+    WriteOut(NULL, 0);
+}
+
+// Передаёт приёмнику содержимое буфера, а за ним n байтов из data
+void BitStreamWriter::WriteOut(const unsigned char *data, size_t n) {
+    struct iovec iov[2];
+    iov[0].iov_base = buffer;
+    iov[0].iov_len = tail - buffer;
+    iov[1].iov_base = (void *)data;
+    iov[1].iov_len = n;
+    if (iov[0].iov_len + n != 0) {
+        StatsWait wait(STAT_IO_WRITE);
+        sink->WriteV(iov, 2);
+    }
+    tail = buffer;
+}
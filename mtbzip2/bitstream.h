@@ -0,0 +1,57 @@
+// Запись битового потока bzip2 в файл.
+//
+#ifndef MTBZIP2_BITSTREAM_H
+#define MTBZIP2_BITSTREAM_H
+
+#include <cstdio>
+#include <stddef.h>
+#include <stdint.h>
+#include "mtbzip2.h"
+
+// Класс FileSink
+// Приёмник, записывающий данные в файл вызовами write(2) и writev(2) в
+// обход stdio. Файл закрывается в деструкторе.
+class FileSink : public MtSink {
+  public:
+    FileSink(FILE *fp);
+    ~FileSink();
+    virtual void Write(const unsigned char *data, size_t n);
+    virtual void WriteV(const struct iovec *iov, int count);
+
+  private:
+    FILE *fp;
+    int fd;
+
+    FileSink(const FileSink &) : MtSink() {}
+    void operator =(const FileSink &) {}
+};
+
+// Класс BitStreamWriter
+// Передаёт приёмнику MtSink данные, записываемые блоками с произвольным
+// числом двоичных битов.
+//
+// Данные сдвигаются на нужное число битов словами по 8 байтов (для
+// больших блоков - SSE2 по 16 байтов) и копятся в выровненном буфере,
+// который передаётся приёмнику целиком. Если поток выровнен на границу
+// байта, большие блоки передаются прямо из памяти вызывающей стороны
+// вместе с буфером, без копирования (для файла - одним вызовом writev(2)).
+class BitStreamWriter {
+  public:
+    BitStreamWriter(MtSink *sink, int bufferSize);
+    ~BitStreamWriter();
+    void Write(const unsigned char *data, uint32_t bits);
+    void Flush();
+
+  private:
+    MtSink *sink;
+    unsigned char *buffer, *tail, *bufend;
+    uint32_t live;          // число незаписанных битов, 0..7
+    unsigned char partial;  // незаписанные биты (в старших разрядах)
+
+    void WriteOut(const unsigned char *data, size_t n);
+
+    BitStreamWriter(const BitStreamWriter &) {}
+    void operator =(const BitStreamWriter &) {}
+};
+
+#endif
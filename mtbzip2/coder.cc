@@ -0,0 +1,459 @@
+// Кодирование отсортированного блока bzip2 (см. coder.h).
+//
+#include "coder.h"
+#include <string.h>
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define HAVE_SIMD_ENGINES 1
+#include <immintrin.h>
+#endif
+
+// Длина кода в неиспользуемых таблицах: больше любой настоящей длины,
+// но 50 таких значений ещё помещаются в 16 битов
+static const uint16_t kNoTable = 1024;
+
+// Длины кодов символа v во всех таблицах: lenv[v][t]
+typedef uint16_t LenVector[8];
+
+// MTF-преобразование и RLE2: записывает в mtfv коды блока (без EOB),
+// считает их частоты в freq и возвращает число кодов
+typedef int32_t (*MtfFn)(const uint32_t *ptr, const unsigned char *block, int32_t n,
+                         const unsigned char *seq, uint16_t *mtfv, int32_t *freq);
+
+// Выбирает для каждой группы из 50 кодов таблицу с наименьшей суммарной
+// длиной кодов (при равенстве - с меньшим номером)
+typedef void (*SelectFn)(const uint16_t *mtfv, int32_t nMTF, const LenVector *lenv,
+                         int nGroups, unsigned char *selector);
+
+// Класс BitWriter
+// Запись битов начиная со старшего, через 64-битный накопитель
+class BitWriter {
+  public:
+    BitWriter(unsigned char *out) : out(out), buf(0), live(0), pos(0) {}
+
+    // n от 1 до 32, v < 2^n
+    void Put(int n, uint32_t v) {
+        if (live + n > 64) {
+            uint32_t w = (uint32_t)(buf >> 32);
+            out[pos] = w >> 24; out[pos + 1] = w >> 16;
+            out[pos + 2] = w >> 8; out[pos + 3] = w;
+            pos += 4;
+            buf <<= 32;
+            live -= 32;
+        }
+        buf |= (uint64_t)v << (64 - live - n);
+        live += n;
+    }
+
+    // Дописывает неполный байт; возвращает число байтов и (через *bits)
+    // значение bsLive в духе libbz2: от -7 до 0
+    int32_t Finish(int32_t *bits) {
+        while (live > 0) {
+            out[pos++] = (unsigned char)(buf >> 56);
+            buf <<= 8;
+            live -= 8;
+        }
+        *bits = live;
+        return pos;
+    }
+
+  private:
+    unsigned char *out;
+    uint64_t buf;
+    int live;
+    int32_t pos;
+};
+
+// Записывает серию из zPend нулевых MTF-кодов символами RUNA/RUNB
+static inline int32_t PutZeroRun(uint16_t *mtfv, int32_t wr, int32_t zPend, int32_t *freq) {
+    zPend--;
+    while (true) {
+        uint16_t c = (zPend & 1) ? BZ_RUNB : BZ_RUNA;
+        mtfv[wr++] = c;
+        freq[c]++;
+        if (zPend < 2) break;
+        zPend = (zPend - 2) / 2;
+    }
+    return wr;
+}
+
+// mtfv занимает ту же память, что и ptr, но запись всегда отстаёт от чтения
+static int32_t MtfScalar(const uint32_t *ptr, const unsigned char *block, int32_t n,
+                         const unsigned char *seq, uint16_t *mtfv, int32_t *freq) {
+    unsigned char yy[256];
+    for (int i = 0; i < 256; i++) yy[i] = (unsigned char)i;
+    int32_t wr = 0, zPend = 0;
+    for (int32_t i = 0; i < n; i++) {
+        int32_t j = (int32_t)ptr[i] - 1;
+        if (j < 0) j += n;
+        unsigned char c = seq[block[j]];
+        if (yy[0] == c) {
+            zPend++;
+            continue;
+        }
+        if (zPend > 0) {
+            wr = PutZeroRun(mtfv, wr, zPend, freq);
+            zPend = 0;
+        }
+        unsigned char tmp = yy[1];
+        yy[1] = yy[0];
+        unsigned char *p = yy + 1;
+        while (c != tmp) {
+            p++;
+            unsigned char tmp2 = tmp;
+            tmp = *p;
+            *p = tmp2;
+        }
+        yy[0] = tmp;
+        int32_t pos = (int32_t)(p - yy);
+        mtfv[wr++] = pos + 1;
+        freq[pos + 1]++;
+    }
+    if (zPend > 0) wr = PutZeroRun(mtfv, wr, zPend, freq);
+    return wr;
+}
+
+static void SelectScalar(const uint16_t *mtfv, int32_t nMTF, const LenVector *lenv,
+                         int nGroups, unsigned char *selector) {
+    for (int32_t gs = 0, g = 0; gs < nMTF; gs += BZ_G_SIZE, g++) {
+        int32_t ge = gs + BZ_G_SIZE < nMTF ? gs + BZ_G_SIZE : nMTF;
+        // все 8 столбцов: так компилятор может развернуть и векторизовать цикл
+        uint16_t cost[8] = { 0 };
+        for (int32_t i = gs; i < ge; i++) {
+            const uint16_t *l = lenv[mtfv[i]];
+            for (int t = 0; t < 8; t++) cost[t] += l[t];
+        }
+        int bt = 0;
+        for (int t = 1; t < nGroups; t++)
+            if (cost[t] < cost[bt]) bt = t;
+        selector[g] = (unsigned char)bt;
+    }
+}
+
+#ifdef HAVE_SIMD_ENGINES
+// Символ c уже найден в первых 16 элементах списка на позиции pos:
+// сдвиг yy[0..pos) на одну позицию вправо одной операцией
+__attribute__((target("sse4.1")))
+static inline void MoveToFront16(unsigned char *yy, __m128i x, unsigned char c, int pos) {
+    const __m128i iota = _mm_setr_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+    __m128i shifted = _mm_insert_epi8(_mm_slli_si128(x, 1), c, 0);
+    __m128i mask = _mm_cmpgt_epi8(_mm_set1_epi8((char)(pos + 1)), iota);
+    _mm_store_si128((__m128i *)yy, _mm_blendv_epi8(x, shifted, mask));
+}
+
+// Список хранится в выровненном массиве; позиция символа ищется сравнением
+// 16 (32 для AVX2) байтов за раз, а короткие сдвиги делаются в регистре
+#define MTF_SIMD_BODY(FIND)                                                 \
+    __attribute__((aligned(32))) unsigned char yy[256];                     \
+    for (int i = 0; i < 256; i++) yy[i] = (unsigned char)i;                 \
+    int32_t wr = 0, zPend = 0;                                              \
+    for (int32_t i = 0; i < n; i++) {                                       \
+        int32_t j = (int32_t)ptr[i] - 1;                                    \
+        if (j < 0) j += n;                                                  \
+        unsigned char c = seq[block[j]];                                    \
+        if (yy[0] == c) {                                                   \
+            zPend++;                                                        \
+            continue;                                                       \
+        }                                                                   \
+        if (zPend > 0) {                                                    \
+            wr = PutZeroRun(mtfv, wr, zPend, freq);                         \
+            zPend = 0;                                                      \
+        }                                                                   \
+        __m128i x = _mm_load_si128((const __m128i *)yy);                    \
+        int m = _mm_movemask_epi8(_mm_cmpeq_epi8(x, _mm_set1_epi8((char)c))); \
+        int pos;                                                            \
+        if (m != 0) {                                                       \
+            pos = __builtin_ctz(m);                                         \
+            MoveToFront16(yy, x, c, pos);                                   \
+        } else {                                                            \
+            FIND;                                                           \
+            memmove(yy + 1, yy, pos);                                       \
+            yy[0] = c;                                                      \
+        }                                                                   \
+        mtfv[wr++] = pos + 1;                                               \
+        freq[pos + 1]++;                                                    \
+    }                                                                       \
+    if (zPend > 0) wr = PutZeroRun(mtfv, wr, zPend, freq);                  \
+    return wr;
+
+__attribute__((target("sse4.1")))
+static int32_t MtfSse41(const uint32_t *ptr, const unsigned char *block, int32_t n,
+                        const unsigned char *seq, uint16_t *mtfv, int32_t *freq) {
+    MTF_SIMD_BODY(
+        for (int k = 16;; k += 16) {
+            int mk = _mm_movemask_epi8(_mm_cmpeq_epi8(
+                _mm_load_si128((const __m128i *)(yy + k)), _mm_set1_epi8((char)c)));
+            if (mk != 0) { pos = k + __builtin_ctz(mk); break; }
+        })
+}
+
+__attribute__((target("avx2")))
+static int32_t MtfAvx2(const uint32_t *ptr, const unsigned char *block, int32_t n,
+                       const unsigned char *seq, uint16_t *mtfv, int32_t *freq) {
+    MTF_SIMD_BODY(
+        int mk = _mm_movemask_epi8(_mm_cmpeq_epi8(
+            _mm_load_si128((const __m128i *)(yy + 16)), _mm_set1_epi8((char)c)));
+        if (mk != 0) {
+            pos = 16 + __builtin_ctz(mk);
+        } else {
+            for (int k = 32;; k += 32) {
+                unsigned mk32 = (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(
+                    _mm256_load_si256((const __m256i *)(yy + k)), _mm256_set1_epi8((char)c)));
+                if (mk32 != 0) { pos = k + __builtin_ctz(mk32); break; }
+            }
+        })
+}
+#undef MTF_SIMD_BODY
+
+// Стоимость группы во всех таблицах - сумма векторов lenv[v]; номер
+// наименьшей (первой из равных) даёт _mm_minpos_epu16
+__attribute__((target("sse4.1")))
+static inline unsigned char BestTable(__m128i cost) {
+    return (unsigned char)((_mm_cvtsi128_si32(_mm_minpos_epu16(cost)) >> 16) & 7);
+}
+
+__attribute__((target("sse4.1")))
+static __m128i GroupCost(const uint16_t *mtfv, int32_t gs, int32_t ge, const LenVector *lenv) {
+    __m128i cost = _mm_setzero_si128();
+    for (int32_t i = gs; i < ge; i++)
+        cost = _mm_add_epi16(cost, _mm_load_si128((const __m128i *)lenv[mtfv[i]]));
+    return cost;
+}
+
+__attribute__((target("sse4.1")))
+static void SelectSse41(const uint16_t *mtfv, int32_t nMTF, const LenVector *lenv,
+                        int, unsigned char *selector) {
+    for (int32_t gs = 0, g = 0; gs < nMTF; gs += BZ_G_SIZE, g++) {
+        int32_t ge = gs + BZ_G_SIZE < nMTF ? gs + BZ_G_SIZE : nMTF;
+        selector[g] = BestTable(GroupCost(mtfv, gs, ge, lenv));
+    }
+}
+
+// Две соседние группы считаются одновременно в половинах 256-битного регистра
+__attribute__((target("avx2")))
+static void SelectAvx2(const uint16_t *mtfv, int32_t nMTF, const LenVector *lenv,
+                       int, unsigned char *selector) {
+    int32_t gs = 0, g = 0;
+    for (; gs + 2 * BZ_G_SIZE <= nMTF; gs += 2 * BZ_G_SIZE, g += 2) {
+        const uint16_t *a = mtfv + gs, *b = mtfv + gs + BZ_G_SIZE;
+        __m256i cost = _mm256_setzero_si256();
+        for (int i = 0; i < BZ_G_SIZE; i++) {
+            __m256i l = _mm256_inserti128_si256(
+                _mm256_castsi128_si256(_mm_load_si128((const __m128i *)lenv[a[i]])),
+                _mm_load_si128((const __m128i *)lenv[b[i]]), 1);
+            cost = _mm256_add_epi16(cost, l);
+        }
+        selector[g] = BestTable(_mm256_castsi256_si128(cost));
+        selector[g + 1] = BestTable(_mm256_extracti128_si256(cost, 1));
+    }
+    for (; gs < nMTF; gs += BZ_G_SIZE, g++) {
+        int32_t ge = gs + BZ_G_SIZE < nMTF ? gs + BZ_G_SIZE : nMTF;
+        selector[g] = BestTable(GroupCost(mtfv, gs, ge, lenv));
+    }
+}
+
+bool CoderHaveSse41() {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("sse4.1");
+}
+
+bool CoderHaveAvx2() {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+}
+#else
+bool CoderHaveSse41() { return false; }
+bool CoderHaveAvx2() { return false; }
+#endif
+
+#define BZ_LESSER_ICOST  0
+#define BZ_GREATER_ICOST 15
+
+// sendMTFValues из compress.c с заменёнными циклами
+static void CodeBlockWith(EState *s, MtfFn mtf, SelectFn select) {
+    // makeMaps_e
+    unsigned char seq[256];
+    s->nInUse = 0;
+    for (int i = 0; i < 256; i++)
+        if (s->inUse[i]) seq[i] = (unsigned char)s->nInUse++;
+
+    int32_t EOB = s->nInUse + 1;
+    for (int32_t i = 0; i <= EOB; i++) s->mtfFreq[i] = 0;
+    uint16_t *mtfv = s->mtfv;
+    int32_t nMTF = mtf(s->ptr, s->block, s->nblock, seq, mtfv, s->mtfFreq);
+    mtfv[nMTF++] = EOB;
+    s->mtfFreq[EOB]++;
+    s->nMTF = nMTF;
+
+    int32_t alphaSize = s->nInUse + 2;
+    for (int t = 0; t < BZ_N_GROUPS; t++)
+        for (int32_t v = 0; v < alphaSize; v++)
+            s->len[t][v] = BZ_GREATER_ICOST;
+
+    int nGroups;
+    if (nMTF < 200) nGroups = 2; else
+    if (nMTF < 600) nGroups = 3; else
+    if (nMTF < 1200) nGroups = 4; else
+    if (nMTF < 2400) nGroups = 5; else
+                     nGroups = 6;
+
+    // начальные таблицы: диапазоны символов с примерно равной частотой
+    {
+        int32_t nPart = nGroups, remF = nMTF, gs = 0;
+        while (nPart > 0) {
+            int32_t tFreq = remF / nPart, ge = gs - 1, aFreq = 0;
+            while (aFreq < tFreq && ge < alphaSize - 1) {
+                ge++;
+                aFreq += s->mtfFreq[ge];
+            }
+            if (ge > gs && nPart != nGroups && nPart != 1 && ((nGroups - nPart) % 2 == 1)) {
+                aFreq -= s->mtfFreq[ge];
+                ge--;
+            }
+            for (int32_t v = 0; v < alphaSize; v++)
+                s->len[nPart - 1][v] = (v >= gs && v <= ge) ? BZ_LESSER_ICOST : BZ_GREATER_ICOST;
+            nPart--;
+            gs = ge + 1;
+            remF -= aFreq;
+        }
+    }
+
+    int32_t nSelectors = (nMTF + BZ_G_SIZE - 1) / BZ_G_SIZE;
+    AssertH(nSelectors < 32768 && nSelectors <= BZ_MAX_SELECTORS, 3003);
+    __attribute__((aligned(32))) LenVector lenv[BZ_MAX_ALPHA_SIZE];
+    for (int iter = 0; iter < BZ_N_ITERS; iter++) {
+        for (int32_t v = 0; v < alphaSize; v++)
+            for (int t = 0; t < 8; t++)
+                lenv[v][t] = t < nGroups ? s->len[t][v] : kNoTable;
+        select(mtfv, nMTF, lenv, nGroups, s->selector);
+
+        for (int t = 0; t < nGroups; t++)
+            for (int32_t v = 0; v < alphaSize; v++)
+                s->rfreq[t][v] = 0;
+        for (int32_t gs = 0, g = 0; gs < nMTF; gs += BZ_G_SIZE, g++) {
+            int32_t ge = gs + BZ_G_SIZE < nMTF ? gs + BZ_G_SIZE : nMTF;
+            Int32 *rfreq = s->rfreq[s->selector[g]];
+            for (int32_t i = gs; i < ge; i++) rfreq[mtfv[i]]++;
+        }
+        for (int t = 0; t < nGroups; t++)
+            BZ2_hbMakeCodeLengths(&(s->len[t][0]), &(s->rfreq[t][0]), alphaSize, 17);
+    }
+
+    // MTF-коды номеров таблиц
+    {
+        unsigned char pos[BZ_N_GROUPS];
+        for (int i = 0; i < nGroups; i++) pos[i] = (unsigned char)i;
+        for (int32_t i = 0; i < nSelectors; i++) {
+            unsigned char ll_i = s->selector[i], tmp = pos[0];
+            int j = 0;
+            while (ll_i != tmp) {
+                j++;
+                unsigned char tmp2 = tmp;
+                tmp = pos[j];
+                pos[j] = tmp2;
+            }
+            pos[0] = tmp;
+            s->selectorMtf[i] = (unsigned char)j;
+        }
+    }
+
+    for (int t = 0; t < nGroups; t++) {
+        int32_t minLen = 32, maxLen = 0;
+        for (int32_t i = 0; i < alphaSize; i++) {
+            if (s->len[t][i] > maxLen) maxLen = s->len[t][i];
+            if (s->len[t][i] < minLen) minLen = s->len[t][i];
+        }
+        AssertH(!(maxLen > 17), 3004);
+        AssertH(!(minLen < 1), 3005);
+        BZ2_hbAssignCodes(&(s->code[t][0]), &(s->len[t][0]), minLen, maxLen, alphaSize);
+    }
+
+    BitWriter w(s->zbits);
+    w.Put(24, 0x314159);
+    w.Put(24, 0x265359);
+    w.Put(32, s->blockCRC);
+    w.Put(1, 0);
+    w.Put(24, s->origPtr);
+
+    // какие из 256 байтов встречаются в блоке
+    bool inUse16[16];
+    for (int i = 0; i < 16; i++) {
+        inUse16[i] = false;
+        for (int j = 0; j < 16; j++)
+            if (s->inUse[i * 16 + j]) inUse16[i] = true;
+    }
+    for (int i = 0; i < 16; i++) w.Put(1, inUse16[i]);
+    for (int i = 0; i < 16; i++)
+        if (inUse16[i])
+            for (int j = 0; j < 16; j++) w.Put(1, s->inUse[i * 16 + j] ? 1 : 0);
+
+    w.Put(3, nGroups);
+    w.Put(15, nSelectors);
+    for (int32_t i = 0; i < nSelectors; i++) {
+        for (int j = 0; j < s->selectorMtf[i]; j++) w.Put(1, 1);
+        w.Put(1, 0);
+    }
+
+    // длины кодов - разностями
+    for (int t = 0; t < nGroups; t++) {
+        int32_t curr = s->len[t][0];
+        w.Put(5, curr);
+        for (int32_t i = 0; i < alphaSize; i++) {
+            while (curr < s->len[t][i]) { w.Put(2, 2); curr++; }
+            while (curr > s->len[t][i]) { w.Put(2, 3); curr--; }
+            w.Put(1, 0);
+        }
+    }
+
+    for (int32_t gs = 0, g = 0; gs < nMTF; gs += BZ_G_SIZE, g++) {
+        int32_t ge = gs + BZ_G_SIZE < nMTF ? gs + BZ_G_SIZE : nMTF;
+        const UChar *len = s->len[s->selector[g]];
+        const Int32 *code = s->code[s->selector[g]];
+        for (int32_t i = gs; i < ge; i++) w.Put(len[mtfv[i]], code[mtfv[i]]);
+    }
+
+    s->numZ = w.Finish(&s->bsLive);
+}
+
+void CodeBlockScalar(EState *s) {
+    CodeBlockWith(s, MtfScalar, SelectScalar);
+}
+
+#ifdef HAVE_SIMD_ENGINES
+void CodeBlockSse41(EState *s) {
+    CodeBlockWith(s, MtfSse41, SelectSse41);
+}
+
+void CodeBlockAvx2(EState *s) {
+    CodeBlockWith(s, MtfAvx2, SelectAvx2);
+}
+#else
+void CodeBlockSse41(EState *s) { CodeBlockScalar(s); }
+void CodeBlockAvx2(EState *s) { CodeBlockScalar(s); }
+#endif
+
+static void (*code_fn)(EState *);
+static const char *engine_name;
+
+static struct CoderInit {
+    CoderInit() {
+        if (CoderHaveAvx2()) {
+            code_fn = CodeBlockAvx2;
+            engine_name = "avx2";
+        } else if (CoderHaveSse41()) {
+            code_fn = CodeBlockSse41;
+            engine_name = "sse4.1";
+        } else {
+            code_fn = CodeBlockScalar;
+            engine_name = "scalar";
+        }
+    }
+} coder_init;
+
+void CodeBlock(EState *s) {
+    code_fn(s);
+}
+
+const char *CoderEngineName() {
+    return engine_name;
+}
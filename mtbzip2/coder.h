@@ -0,0 +1,40 @@
+// Кодирование блока bzip2 после сортировки: MTF-преобразование с
+// кодированием серий нулей (RLE2), выбор таблиц Хаффмана для групп по 50
+// символов и запись битового потока.
+//
+// Повторяет generateMTFValues и sendMTFValues из compress.c libbz2 бит в
+// бит. Два самых затратных цикла - MTF-преобразование и подсчёт стоимости
+// каждой группы в каждой из таблиц - имеют векторные реализации (SSE4.1 и
+// AVX2), которые выбираются при запуске программы в зависимости от
+// возможностей процессора.
+//
+#ifndef MTBZIP2_CODER_H
+#define MTBZIP2_CODER_H
+
+#include <stdint.h>
+
+extern "C" {
+    #include "bzlib_private.h"
+};
+
+// Записывает блок в s->zbits начиная с нулевого бита: сигнатуру, CRC
+// s->blockCRC, номер исходной строки s->origPtr и закодированные данные.
+// На входе заполнены s->block, s->nblock, s->inUse и отсортированные
+// сдвиги s->ptr; s->zbits должен указывать на буфер достаточного размера
+// (в libbz2 - за концом блока в s->arr2). На выходе s->numZ * 8 + s->bsLive
+// - длина блока в битах.
+void CodeBlock(EState *s);
+
+// Отдельные реализации CodeBlock (для тестов и измерения скорости).
+// CodeBlockSse41 и CodeBlockAvx2 можно вызывать, только если
+// соответствующая функция CoderHave...() вернула true.
+void CodeBlockScalar(EState *s);
+void CodeBlockSse41(EState *s);
+void CodeBlockAvx2(EState *s);
+bool CoderHaveSse41();
+bool CoderHaveAvx2();
+
+// Название реализации, используемой CodeBlock
+const char *CoderEngineName();
+
+#endif
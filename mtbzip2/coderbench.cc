@@ -0,0 +1,203 @@
+// coderbench: проверка и измерение скорости реализаций CodeBlock из coder.cc.
+//
+// Каждый файл делится на блоки уровня сжатия 9, каждый блок сортируется
+// BZ2_blockSort и кодируется всеми доступными реализациями. Результат
+// побитово сравнивается с блоком, который записывает BZ2_compressBlock из
+// libbz2. Печатается время кодирования блоков (MTF, выбор таблиц, запись
+// битов) и ускорение относительно libbz2, для которой из времени
+// BZ2_compressBlock вычитается время сортировки.
+//
+// Использование: coderbench [число проходов] [файл ...]
+// Без файлов используются псевдослучайные данные: равномерные байты и
+// байты с неравномерными частотами.
+//
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <time.h>
+#include "coder.h"
+using namespace std;
+
+typedef vector<unsigned char> Data;
+
+static double Now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static const int32_t kBlockSize = 900000 - 19;
+
+// Состояние libbz2 для одного блока, как в BzipBlockCompressor
+struct Block {
+    EState s;
+    vector<uint32_t> sorted;
+
+    Block() {
+        memset(&s, 0, sizeof(EState));
+        s.arr1 = (UInt32 *)malloc(900000 * sizeof(UInt32));
+        s.arr2 = (UInt32 *)malloc((900000 + BZ_N_OVERSHOOT) * sizeof(UInt32));
+        s.ftab = (UInt32 *)malloc(65537 * sizeof(UInt32));
+        s.blockSize100k = 9;
+        s.nblockMAX = kBlockSize;
+        s.workFactor = 30;
+        s.block = (UChar *)s.arr2;
+        s.mtfv = (UInt16 *)s.arr1;
+        s.ptr = (UInt32 *)s.arr1;
+    }
+    ~Block() { free(s.arr1); free(s.arr2); free(s.ftab); }
+
+    void Load(const unsigned char *data, int32_t n) {
+        memcpy(s.block, data, n);
+        s.nblock = n;
+        memset(s.inUse, 0, sizeof(s.inUse));
+        for (int32_t i = 0; i < n; i++) s.inUse[data[i]] = 1;
+    }
+
+    // Блок в формате libbz2; возвращает время BZ2_compressBlock
+    double Reference(uint32_t crc, Data &out, uint32_t *bits) {
+        s.numZ = s.bsLive = s.bsBuff = s.combinedCRC = 0;
+        s.blockNo = 2;
+        s.blockCRC = crc ^ 0xffffffffUL;
+        double t = Now();
+        BZ2_compressBlock(&s, 1);
+        t = Now() - t;
+        *bits = s.numZ * 8 + s.bsLive - 80;
+        out.assign(s.zbits, s.zbits + s.numZ);
+        return t;
+    }
+
+    // Сортирует блок и запоминает результат для повторного кодирования
+    double Sort() {
+        double t = Now();
+        BZ2_blockSort(&s);
+        t = Now() - t;
+        sorted.assign(s.ptr, s.ptr + s.nblock);
+        return t;
+    }
+
+    // Кодирует отсортированный блок; MTF затирает s.ptr, поэтому перед
+    // каждым вызовом он восстанавливается
+    double Code(void (*fn)(EState *), uint32_t crc, Data &out, uint32_t *bits) {
+        memcpy(s.ptr, &sorted[0], s.nblock * sizeof(uint32_t));
+        s.numZ = s.bsLive = 0;
+        s.blockCRC = crc;
+        s.zbits = s.block + s.nblock;
+        double t = Now();
+        fn(&s);
+        t = Now() - t;
+        *bits = s.numZ * 8 + s.bsLive;
+        out.assign(s.zbits, s.zbits + s.numZ);
+        return t;
+    }
+};
+
+// Совпадают ли первые bits битов
+static bool SameBits(const Data &a, const Data &b, uint32_t bits) {
+    uint32_t bytes = bits / 8, rest = bits % 8;
+    if (a.size() < bytes + (rest > 0) || b.size() < bytes + (rest > 0)) return false;
+    if (memcmp(&a[0], &b[0], bytes) != 0) return false;
+    unsigned char mask = (unsigned char)(0xff00 >> rest);
+    return rest == 0 || ((a[bytes] ^ b[bytes]) & mask) == 0;
+}
+
+static bool ReadFile(const char *name, Data &d) {
+    FILE *f = fopen(name, "rb");
+    if (f == NULL) return false;
+    unsigned char buf[65536];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), f)) > 0) d.insert(d.end(), buf, buf + n);
+    fclose(f);
+    return true;
+}
+
+int main(int argc, char **argv) {
+    int passes = argc > 1 ? atoi(argv[1]) : 3;
+    if (passes < 1) passes = 1;
+
+    vector<string> names;
+    vector<Data> inputs;
+    for (int i = 2; i < argc; i++) {
+        Data d;
+        if (!ReadFile(argv[i], d) || d.empty()) {
+            fprintf(stderr, "coderbench: can't read %s\n", argv[i]);
+            return 1;
+        }
+        names.push_back(argv[i]);
+        inputs.push_back(d);
+    }
+    if (inputs.empty()) {
+        static const char alphabet[] = "aaaaaaaabbbbccd\n";
+        Data random, lowent;
+        uint32_t seed = 12345;
+        for (int i = 0; i < 4 * kBlockSize; i++) {
+            seed = seed * 1103515245 + 12345;
+            random.push_back(seed >> 24);
+            lowent.push_back(alphabet[(seed >> 16) & 15]);
+        }
+        names.push_back("random");
+        inputs.push_back(random);
+        names.push_back("lowent");
+        inputs.push_back(lowent);
+    }
+
+    struct { const char *name; void (*fn)(EState *); bool ok; } engines[] = {
+        { "scalar", CodeBlockScalar, true },
+        { "sse4.1", CodeBlockSse41, CoderHaveSse41() },
+        { "avx2", CodeBlockAvx2, CoderHaveAvx2() },
+    };
+    const int num_engines = sizeof(engines) / sizeof(engines[0]);
+
+    printf("%d passes, default engine: %s\n", passes, CoderEngineName());
+    printf("%-16s %-8s %10s %9s\n", "input", "engine", "MB/s", "speedup");
+
+    Block b;
+    bool failed = false;
+    for (size_t f = 0; f < inputs.size(); f++) {
+        const Data &in = inputs[f];
+        double ref_time = 0, time[num_engines] = { 0 };
+        for (size_t pos = 0; pos < in.size(); pos += kBlockSize) {
+            int32_t n = (int32_t)min(in.size() - pos, (size_t)kBlockSize);
+            uint32_t crc = 0x12345678 ^ (uint32_t)pos;
+            Data ref, out;
+            uint32_t ref_bits, bits;
+
+            // лучший из нескольких замеров
+            double best_ref = 1e9, best_sort = 1e9;
+            for (int p = 0; p < passes; p++) {
+                b.Load(&in[pos], n);
+                best_ref = min(best_ref, b.Reference(crc, ref, &ref_bits));
+                b.Load(&in[pos], n);
+                best_sort = min(best_sort, b.Sort());
+            }
+            ref_time += max(best_ref - best_sort, 0.0);
+
+            for (int e = 0; e < num_engines; e++) {
+                if (!engines[e].ok) continue;
+                double best = 1e9;
+                for (int p = 0; p < passes; p++)
+                    best = min(best, b.Code(engines[e].fn, crc, out, &bits));
+                time[e] += best;
+                if (bits != ref_bits || !SameBits(out, ref, bits)) {
+                    printf("%s: block at %lu: %s output differs from libbz2\n",
+                           names[f].c_str(), (unsigned long)pos, engines[e].name);
+                    failed = true;
+                }
+            }
+        }
+
+        double mb = in.size() / 1e6;
+        printf("%-16s %-8s %10.1f %8.2fx\n", names[f].c_str(), "libbz2", mb / ref_time, 1.0);
+        for (int e = 0; e < num_engines; e++) {
+            if (!engines[e].ok) {
+                printf("%-16s %-8s %10s\n", names[f].c_str(), engines[e].name, "n/a");
+                continue;
+            }
+            printf("%-16s %-8s %10.1f %8.2fx\n", names[f].c_str(), engines[e].name,
+                   mb / time[e], ref_time / time[e]);
+        }
+    }
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,202 @@
+// Реализации CRC-32 для bzip2: побайтовая табличная, slice-by-8/16 и
+// свёртка с помощью инструкции PCLMULQDQ (carry-less умножение).
+//
+#include "crc32.h"
+#include <string.h>
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define HAVE_PCLMUL_ENGINE 1
+#include <immintrin.h>
+#endif
+
+static const uint32_t kPoly = 0x04c11db7UL;
+
+// table[k][b] - вклад байта b, за которым следует ещё k байтов
+static uint32_t table[16][256];
+
+// Константы x^n mod P для свёртки на 512 и на 128 бит
+static uint64_t k_fold4_hi, k_fold4_lo, k_fold1_hi, k_fold1_lo;
+
+static uint32_t (*update_fn)(uint32_t, const unsigned char *, size_t);
+static const char *engine_name;
+
+// x^n mod P
+static uint32_t xpow_mod(uint32_t n) {
+    uint32_t v = 1;
+    while (n-- != 0) v = (v & 0x80000000UL) ? (v << 1) ^ kPoly : (v << 1);
+    return v;
+}
+
+static inline uint32_t load32_be(const unsigned char *p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+           ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+// Заполнение таблиц и выбор реализации при запуске программы
+static struct CrcInit {
+    CrcInit() {
+        for (uint32_t b = 0; b < 256; b++) {
+            uint32_t c = b << 24;
+            for (int i = 0; i < 8; i++)
+                c = (c & 0x80000000UL) ? (c << 1) ^ kPoly : (c << 1);
+            table[0][b] = c;
+        }
+        for (int k = 1; k < 16; k++) {
+            for (int b = 0; b < 256; b++) {
+                uint32_t c = table[k - 1][b];
+                table[k][b] = (c << 8) ^ table[0][c >> 24];
+            }
+        }
+
+        k_fold4_hi = xpow_mod(512 + 64);
+        k_fold4_lo = xpow_mod(512);
+        k_fold1_hi = xpow_mod(128 + 64);
+        k_fold1_lo = xpow_mod(128);
+
+        if (CrcHavePclmul()) {
+            update_fn = CrcUpdatePclmul;
+            engine_name = "pclmul";
+        } else {
+            update_fn = CrcUpdateSlice16;
+            engine_name = "slice-by-16";
+        }
+    }
+} crc_init;
+
+uint32_t CrcUpdate(uint32_t crc, const unsigned char *data, size_t n) {
+    return update_fn(crc, data, n);
+}
+
+const char *CrcEngineName() {
+    return engine_name;
+}
+
+uint32_t CrcUpdateBytewise(uint32_t crc, const unsigned char *data, size_t n) {
+    for (; n != 0; n--)
+        crc = (crc << 8) ^ table[0][(crc >> 24) ^ *data++];
+    return crc;
+}
+
+uint32_t CrcUpdateSlice8(uint32_t crc, const unsigned char *p, size_t n) {
+    for (; n >= 8; n -= 8, p += 8) {
+        crc ^= load32_be(p);
+        crc = table[7][crc >> 24] ^ table[6][(crc >> 16) & 0xff] ^
+              table[5][(crc >> 8) & 0xff] ^ table[4][crc & 0xff] ^
+              table[3][p[4]] ^ table[2][p[5]] ^ table[1][p[6]] ^ table[0][p[7]];
+    }
+    return CrcUpdateBytewise(crc, p, n);
+}
+
+uint32_t CrcUpdateSlice16(uint32_t crc, const unsigned char *p, size_t n) {
+    for (; n >= 16; n -= 16, p += 16) {
+        crc ^= load32_be(p);
+        crc = table[15][crc >> 24] ^ table[14][(crc >> 16) & 0xff] ^
+              table[13][(crc >> 8) & 0xff] ^ table[12][crc & 0xff] ^
+              table[11][p[4]] ^ table[10][p[5]] ^ table[9][p[6]] ^
+              table[8][p[7]] ^ table[7][p[8]] ^ table[6][p[9]] ^
+              table[5][p[10]] ^ table[4][p[11]] ^ table[3][p[12]] ^
+              table[2][p[13]] ^ table[1][p[14]] ^ table[0][p[15]];
+    }
+    return CrcUpdateSlice8(crc, p, n);
+}
+
+#ifdef HAVE_PCLMUL_ENGINE
+bool CrcHavePclmul() {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("pclmul") && __builtin_cpu_supports("ssse3");
+}
+
+// Сообщение рассматривается как многочлен над GF(2), первый бит которого
+// соответствует старшей степени; CRC равна M(x) * x^32 mod P. 16 байтов
+// данных загружаются в регистр в обратном порядке, так что бит i регистра
+// соответствует x^i. Если за блоком X следуют ещё 16*k байтов Y, то
+//   X * x^(128k) + Y = Xhi * x^(128k+64) + Xlo * x^(128k) + Y,
+// и, заменив степени x их остатками по модулю P (32-битные константы),
+// получаем 128-битное число, сравнимое с исходным по модулю P.
+// Начальное состояние CRC эквивалентно xor с первыми 4 байтами данных.
+__attribute__((target("pclmul,ssse3")))
+static inline __m128i fold(__m128i x, __m128i k, __m128i y) {
+    return _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x, k, 0x11),
+                                       _mm_clmulepi64_si128(x, k, 0x00)), y);
+}
+
+__attribute__((target("pclmul,ssse3")))
+uint32_t CrcUpdatePclmul(uint32_t crc, const unsigned char *data, size_t n) {
+    if (n < 128) return CrcUpdateSlice16(crc, data, n);
+
+    const __m128i bswap = _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11,
+                                       12, 13, 14, 15);
+    const __m128i *p = (const __m128i *)data;
+    __m128i x0 = _mm_shuffle_epi8(_mm_loadu_si128(p + 0), bswap);
+    __m128i x1 = _mm_shuffle_epi8(_mm_loadu_si128(p + 1), bswap);
+    __m128i x2 = _mm_shuffle_epi8(_mm_loadu_si128(p + 2), bswap);
+    __m128i x3 = _mm_shuffle_epi8(_mm_loadu_si128(p + 3), bswap);
+    x0 = _mm_xor_si128(x0, _mm_set_epi32((int)crc, 0, 0, 0));
+    p += 4;
+    n -= 64;
+
+    // четыре независимых аккумулятора, чтобы скрыть задержку умножения
+    const __m128i k4 = _mm_set_epi64x((long long)k_fold4_hi, (long long)k_fold4_lo);
+    for (; n >= 64; n -= 64, p += 4) {
+        x0 = fold(x0, k4, _mm_shuffle_epi8(_mm_loadu_si128(p + 0), bswap));
+        x1 = fold(x1, k4, _mm_shuffle_epi8(_mm_loadu_si128(p + 1), bswap));
+        x2 = fold(x2, k4, _mm_shuffle_epi8(_mm_loadu_si128(p + 2), bswap));
+        x3 = fold(x3, k4, _mm_shuffle_epi8(_mm_loadu_si128(p + 3), bswap));
+    }
+
+    const __m128i k1 = _mm_set_epi64x((long long)k_fold1_hi, (long long)k_fold1_lo);
+    x0 = fold(x0, k1, x1);
+    x0 = fold(x0, k1, x2);
+    x0 = fold(x0, k1, x3);
+    for (; n >= 16; n -= 16, p++)
+        x0 = fold(x0, k1, _mm_shuffle_epi8(_mm_loadu_si128(p), bswap));
+
+    // оставшиеся 16 байтов аккумулятора и хвост обрабатываются таблицами
+    unsigned char tmp[16];
+    _mm_storeu_si128((__m128i *)tmp, _mm_shuffle_epi8(x0, bswap));
+    crc = CrcUpdateSlice16(0, tmp, 16);
+    return CrcUpdateSlice16(crc, (const unsigned char *)p, n);
+}
+#else
+bool CrcHavePclmul() {
+    return false;
+}
+
+uint32_t CrcUpdatePclmul(uint32_t crc, const unsigned char *data, size_t n) {
+    return CrcUpdateSlice16(crc, data, n);
+}
+#endif
+
+// Умножение 32x32 матрицы над GF(2) на вектор
+static uint32_t gf2_matrix_times(const uint32_t *mat, uint32_t vec) {
+    uint32_t sum = 0;
+    for (; vec != 0; vec >>= 1, mat++)
+        if (vec & 1) sum ^= *mat;
+    return sum;
+}
+
+static void gf2_matrix_square(uint32_t *square, const uint32_t *mat) {
+    for (int n = 0; n < 32; n++)
+        square[n] = gf2_matrix_times(mat, mat[n]);
+}
+
+uint32_t CrcShift(uint32_t crc, uint64_t n) {
+    uint32_t even[32], odd[32];
+    if (n == 0) return crc;
+
+    odd[31] = kPoly;  // оператор для одного нулевого бита
+    for (int i = 0; i < 31; i++) odd[i] = 1UL << (i + 1);
+    gf2_matrix_square(even, odd);  // два бита
+    gf2_matrix_square(odd, even);  // четыре бита
+
+    do {
+        gf2_matrix_square(even, odd);
+        if (n & 1) crc = gf2_matrix_times(even, crc);
+        n >>= 1;
+        if (n == 0) break;
+        gf2_matrix_square(odd, even);
+        if (n & 1) crc = gf2_matrix_times(odd, crc);
+        n >>= 1;
+    } while (n != 0);
+    return crc;
+}
@@ -0,0 +1,36 @@
+// Вычисление CRC-32 в том виде, в котором она используется в bzip2:
+// полином 0x04c11db7, биты обрабатываются начиная со старшего.
+//
+// Все функции работают с "состоянием" CRC так же, как макрос BZ_UPDATE_CRC:
+// начальное значение 0xffffffff и финальное инвертирование выполняются
+// вызывающей стороной.
+//
+#ifndef MTBZIP2_CRC32_H
+#define MTBZIP2_CRC32_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Обновляет состояние CRC по n байтам данных. Реализация выбирается при
+// запуске программы в зависимости от возможностей процессора.
+uint32_t CrcUpdate(uint32_t crc, const unsigned char *data, size_t n);
+
+// Возвращает состояние CRC после обработки n нулевых байтов, начиная с
+// состояния crc. Так как CRC линейна, состояние после обработки конкатенации
+// A и B равно
+//   CrcShift(состояние после A, |B|) ^ (CRC от B с нулевым начальным состоянием),
+// что позволяет считать CRC частей данных независимо.
+uint32_t CrcShift(uint32_t crc, uint64_t n);
+
+// Отдельные реализации CrcUpdate (для тестов и измерения скорости).
+// CrcUpdatePclmul можно вызывать, только если CrcHavePclmul() вернула true.
+uint32_t CrcUpdateBytewise(uint32_t crc, const unsigned char *data, size_t n);
+uint32_t CrcUpdateSlice8(uint32_t crc, const unsigned char *data, size_t n);
+uint32_t CrcUpdateSlice16(uint32_t crc, const unsigned char *data, size_t n);
+uint32_t CrcUpdatePclmul(uint32_t crc, const unsigned char *data, size_t n);
+bool CrcHavePclmul();
+
+// Название реализации, используемой CrcUpdate
+const char *CrcEngineName();
+
+#endif
@@ -0,0 +1,82 @@
+// crcbench: измерение скорости реализаций CRC-32 из crc32.cc.
+//
+// Для каждой реализации печатается число байтов, обрабатываемых за такт
+// процессора (по счётчику rdtsc), и ускорение относительно побайтового
+// табличного варианта, которым раньше пользовался mtbzip2 (BZ_UPDATE_CRC).
+//
+// Использование: crcbench [размер буфера в Кб] [число проходов]
+//
+#include <cstdio>
+#include <cstdlib>
+#include <stdint.h>
+#include <time.h>
+#include "crc32.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+static uint64_t Ticks() { return __rdtsc(); }
+static const char *kUnit = "bytes/cycle";
+#else
+static uint64_t Ticks() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+static const char *kUnit = "bytes/ns";
+#endif
+
+typedef uint32_t (*CrcFn)(uint32_t, const unsigned char *, size_t);
+
+int main(int argc, char **argv) {
+    size_t size = (argc > 1 ? atoi(argv[1]) : 1024) * 1024;
+    int passes = argc > 2 ? atoi(argv[2]) : 200;
+
+    unsigned char *buf = (unsigned char *)malloc(size);
+    uint32_t seed = 12345;
+    for (size_t i = 0; i < size; i++) {
+        seed = seed * 1103515245 + 12345;
+        buf[i] = seed >> 24;
+    }
+
+    struct { const char *name; CrcFn fn; bool ok; } engines[] = {
+        { "bytewise", CrcUpdateBytewise, true },
+        { "slice-by-8", CrcUpdateSlice8, true },
+        { "slice-by-16", CrcUpdateSlice16, true },
+        { "pclmul", CrcUpdatePclmul, CrcHavePclmul() },
+    };
+    const int n = sizeof(engines) / sizeof(engines[0]);
+
+    printf("buffer %lu Kb, %d passes, default engine: %s\n",
+           (unsigned long)(size / 1024), passes, CrcEngineName());
+    printf("%-14s %12s %10s\n", "engine", kUnit, "speedup");
+
+    uint32_t expected = CrcUpdateBytewise(0xffffffffUL, buf, size);
+    double base = 0;
+    for (int e = 0; e < n; e++) {
+        if (!engines[e].ok) {
+            printf("%-14s %12s\n", engines[e].name, "n/a");
+            continue;
+        }
+        if (engines[e].fn(0xffffffffUL, buf, size) != expected) {
+            printf("%-14s wrong result\n", engines[e].name);
+            return 1;
+        }
+
+        // лучший из нескольких замеров
+        double best = 0;
+        for (int rep = 0; rep < 5; rep++) {
+            uint32_t crc = 0xffffffffUL;
+            uint64_t t = Ticks();
+            for (int i = 0; i < passes; i++) crc = engines[e].fn(crc, buf, size);
+            t = Ticks() - t;
+            if (crc == 0x12345678) printf(" ");  // не даём выбросить вычисления
+            double speed = (double)size * passes / (t ? t : 1);
+            if (speed > best) best = speed;
+        }
+        if (e == 0) base = best;
+        printf("%-14s %12.3f %9.2fx\n", engines[e].name, best, best / base);
+    }
+
+    free(buf);
+    return 0;
+}
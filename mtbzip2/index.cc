@@ -0,0 +1,88 @@
+// Индекс блоков bzip2-файла (см. index.h).
+//
+#include "index.h"
+#include <cstdio>
+#include <cstring>
+using namespace std;
+
+static const char kIndexMagic[8] = { 'M', 'T', 'B', 'Z', 'I', 'D', 'X', '2' };
+static const char kIndexMagic1[8] = { 'M', 'T', 'B', 'Z', 'I', 'D', 'X', '1' };
+
+static void Put64(unsigned char *p, uint64_t x) {
+    for (int i = 0; i < 8; i++) { p[i] = x & 0xff; x >>= 8; }
+}
+
+static uint64_t Get64(const unsigned char *p) {
+    uint64_t x = 0;
+    for (int i = 7; i >= 0; i--) x = (x << 8) | p[i];
+    return x;
+}
+
+void BlockIndex::Add(uint64_t bit_offset, uint64_t offset) {
+    Entry e = { bit_offset, offset };
+    entries.push_back(e);
+}
+
+void BlockIndex::SetEnd(uint64_t bit_offset, uint64_t size) {
+    Add(bit_offset, size);
+}
+
+size_t BlockIndex::Find(uint64_t offset) const {
+    // первая запись с началом больше offset, блок - предыдущий
+    size_t lo = 0, hi = Blocks();
+    while (lo + 1 < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (entries[mid].offset <= offset)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+bool BlockIndex::Save(const char *path) const {
+    FILE *f = fopen(path, "wb");
+    if (f == NULL) return false;
+    unsigned char buf[16];
+    Put64(buf, entries.size());
+    Put64(buf + 8, blockSize100k);
+    bool ok = fwrite(kIndexMagic, 1, 8, f) == 8 && fwrite(buf, 1, 16, f) == 16;
+    for (size_t i = 0; ok && i < entries.size(); i++) {
+        Put64(buf, entries[i].bit_offset);
+        Put64(buf + 8, entries[i].offset);
+        ok = fwrite(buf, 1, 16, f) == 16;
+    }
+    return fclose(f) == 0 && ok;
+}
+
+bool BlockIndex::Load(const char *path) {
+    FILE *f = fopen(path, "rb");
+    if (f == NULL) return false;
+    unsigned char head[24], buf[16];
+    entries.clear();
+    blockSize100k = 0;
+    bool ok = fread(head, 1, 16, f) == 16;
+    bool v1 = ok && memcmp(head, kIndexMagic1, 8) == 0;
+    ok = ok && (v1 || memcmp(head, kIndexMagic, 8) == 0);
+    if (ok && !v1) {
+        ok = fread(head + 16, 1, 8, f) == 8 && Get64(head + 16) >= 1 && Get64(head + 16) <= 9;
+        if (ok) blockSize100k = (int)Get64(head + 16);
+    }
+    uint64_t n = ok ? Get64(head + 8) : 0;
+    // хотя бы завершающая запись; смещения не убывают
+    ok = ok && n >= 1 && n < (1ULL << 40);
+    for (uint64_t i = 0; ok && i < n; i++) {
+        ok = fread(buf, 1, 16, f) == 16;
+        Entry e = { Get64(buf), Get64(buf + 8) };
+        if (ok && !entries.empty())
+            ok = e.bit_offset > entries.back().bit_offset && e.offset >= entries.back().offset;
+        if (ok) entries.push_back(e);
+    }
+    ok = ok && fgetc(f) == EOF;
+    fclose(f);
+    if (!ok) {
+        entries.clear();
+        blockSize100k = 0;
+    }
+    return ok;
+}
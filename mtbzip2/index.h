@@ -0,0 +1,63 @@
+// Индекс блоков bzip2-файла для распаковки произвольного участка
+// (параметры --index и --range).
+//
+// Для каждого блока хранятся смещение его начала в сжатом файле (в битах)
+// и смещение его первого байта в исходных данных; последняя запись -
+// начало маркера конца потока и размер исходных данных. Индекс пишется
+// рядом со сжатым файлом (file.bz2.idx): заголовок "MTBZIDX2", число
+// записей (8 байтов), размер блока потока (1..9, 8 байтов) и записи по 16
+// байтов, все числа little-endian. Индексы прежнего формата "MTBZIDX1"
+// (без размера блока) тоже читаются.
+//
+#ifndef MTBZIP2_INDEX_H
+#define MTBZIP2_INDEX_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+class BlockIndex {
+  public:
+    BlockIndex() : blockSize100k(0) {}
+
+    struct Entry {
+        uint64_t bit_offset;  // начало блока в сжатом файле, биты
+        uint64_t offset;      // начало блока в исходных данных, байты
+    };
+
+    // Добавляет очередной блок
+    void Add(uint64_t bit_offset, uint64_t offset);
+
+    // Добавляет завершающую запись: начало маркера конца потока и
+    // размер исходных данных
+    void SetEnd(uint64_t bit_offset, uint64_t size);
+
+    // Убирает завершающую запись, чтобы продолжить индекс новыми блоками
+    void RemoveEnd() { if (!entries.empty()) entries.pop_back(); }
+
+    // Число блоков (без завершающей записи)
+    size_t Blocks() const { return entries.empty() ? 0 : entries.size() - 1; }
+
+    // Запись i, 0 <= i <= Blocks()
+    const Entry &operator[](size_t i) const { return entries[i]; }
+
+    // Номер блока, содержащего байт offset исходных данных (offset меньше
+    // размера данных)
+    size_t Find(uint64_t offset) const;
+
+    // Размер блока потока из заголовка: по нему -a дописывает блоки, не
+    // читая сжатый файл; 0 - неизвестен (индекс формата MTBZIDX1)
+    int BlockSize() const { return blockSize100k; }
+    void SetBlockSize(int n) { blockSize100k = n; }
+
+    // Запись и чтение файла индекса; false - ошибка ввода-вывода или файл
+    // не является индексом
+    bool Save(const char *path) const;
+    bool Load(const char *path);
+
+  private:
+    std::vector<Entry> entries;
+    int blockSize100k;
+};
+
+#endif
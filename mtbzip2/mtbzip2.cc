@@ -6,8 +6,73 @@
 // Поддерживаемые флаги, которые могут быть указаны в командной строке:
 //  -1 .. -9   выбор размера блока для метода bzip2 (100Кб..900Кб)
 //  -p <n>     задает число параллельных потоков, испольщующихся для сжатия
-//             на локальной машине
+//             на локальной машине (в mpibzip2 - в каждом MPI-процессе)
+//  -R <n>     задает число потоков, выполняющих RLE-сжатие входных данных;
+//             по умолчанию один поток на каждые 8 потоков сжатия
+//  -m <size>  ограничение памяти, например 512M: размеры очередей, число
+//             буферов и потоков выбираются так, чтобы уложиться в него
 //  -k         не удалять входные файлы после сжатия
+//  -d         распаковка вместо сжатия
+//  -t         проверка целостности сжатых файлов: блоки распаковываются
+//             параллельно, сверяются CRC каждого блока и каждого потока;
+//             об ошибках сообщается со смещением блока в битах, код
+//             завершения при ошибках - 2
+//  -r         обрабатывать файлы в указанных каталогах и их подкаталогах
+//  -a <file>  сжать входные файлы (или стандартный вход) и дописать блоки
+//             в конец bzip2-потока file, не перечитывая его блоки; размер
+//             блока берётся из file. Входные файлы не удаляются. Вместе
+//             с --index продолжается индекс file.idx.
+//  --stats    по окончании напечатать в stderr сводку: долю времени, которую
+//             потоки каждой роли работали и ждали в каждом из мест ожидания,
+//             задержку обработки блока и глубину очередей
+//  --stats-json <file>  то же в формате JSON ("-" - в stderr)
+//  --progress раз в секунду печатать в stderr объём обработанных данных
+//  --numa     размещение с учётом NUMA: рабочие потоки поровну распределяются
+//             по узлам и привязываются к процессорам, буферы блоков
+//             размещаются на узлах, и блок по возможности сжимает поток
+//             того узла, где лежит его буфер (см. numa.h)
+//  --io-uring входные файлы читаются через io_uring на несколько буферов
+//             вперёд, а запись в выходные файлы выполняется асинхронно, так
+//             что задержки устройства не останавливают конвейер; если
+//             io_uring недоступен, а также для каналов используется обычный
+//             ввод-вывод (см. uring.h)
+//  --direct   то же, и большие файлы читаются и пишутся с O_DIRECT, в обход
+//             страничного кэша
+//  --mpi-io   (mpibzip2) каждый MPI-процесс сам читает свои участки входных
+//             файлов через MPI-IO и сжимает их; мастеру передаются только
+//             сжатые блоки. Границы блоков на границах участков не совпадают
+//             с bzip2, так что результат может от него отличаться.
+//  --index    при сжатии файлов записывать рядом с file.bz2 индекс блоков
+//             file.bz2.idx: смещения начала каждого блока в сжатом файле
+//             и в исходных данных (см. index.h)
+//  --range <from>-[<to>]  распаковать на стандартный выход только байты
+//             [from, to) исходных данных файла, для которого есть индекс;
+//             читаются и распаковываются только нужные для этого блоки
+//  --serve <addr>  работать процессом сжатия для --workers: принимать
+//             блоки по адресу unix:/path (Unix-сокет) или [host]:port (TCP)
+//             и сжимать их -p потоками; процесс работает, пока его не
+//             остановят. Проверки подлинности нет: TCP-адрес - только
+//             для доверенной сети.
+//  --workers <addr,...>  сжимать блоки также в процессах --serve по
+//             указанным адресам; блоки процесса, соединение с которым
+//             потеряно или который не вернул блок за минуту, сжимаются
+//             заново в остальных. Результат тот же, что без этого
+//             параметра.
+//  --sort <alg> сортировка блока: bzip2 (как в libbz2), sais (SA-IS, линейное
+//             время) или auto (по умолчанию: SA-IS для блоков с длинными
+//             повторами; остальные блоки, пока в пуле есть свободные потоки,
+//             сортируются несколькими потоками). Результат сжатия от выбора
+//             не зависит.
+//  --verify   при сжатии распаковывать каждый блок в рабочем потоке сразу
+//             после сжатия и сверять CRC, прежде чем блок будет записан
+//             (процессы --serve проверяют блоки, если запущены с --verify)
+//
+// Если задано несколько файлов, одновременно обрабатываются до четырёх из
+// них: у каждого свой конвейер чтения и записи, а рабочие потоки общие.
+//
+// Тот же конвейер доступен программам через библиотеку libmtbzip2
+// (интерфейс описан в mtbzip2.h); при сборке библиотеки определяется
+// MTBZIP2_LIBRARY, и функция main не компилируется.
 //
 #include <cstdio>
 #include <cstdlib>
@@ -16,20 +81,41 @@
 #include <stdint.h>
 #include <pthread.h>
 #include <unistd.h>
-#include <map>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <poll.h>
+#include <errno.h>
+#if defined(_POSIX_MAPPED_FILES) && _POSIX_MAPPED_FILES > 0
+#include <sys/mman.h>
+#define HAVE_MMAP 1
+#endif
 #include <vector>
-#include <queue>
 #include <string>
+#include <algorithm>
+#include <set>
+#include <map>
+#include <deque>
 using namespace std;
 
 #ifdef MPIBZIP2
 #include <mpi.h>
 #endif
 
-extern "C" {
-    #include "bzlib_private.h"
-    void BZ2_compressBlock(EState* s, Bool is_last_block);
-};
+#include "mtbzip2.h"
+#include "crc32.h"
+#include "util.h"
+#include "bitstream.h"
+#include "sync.h"
+#include "stats.h"
+#include "sais.h"
+#include "psort.h"
+#include "coder.h"
+#include "net.h"
+#include "index.h"
+#include "numa.h"
+#include "arena.h"
+#include "uring.h"
 
 // Базовый класс объектов, представляющих потоки выполнения
 class Runnable {
@@ -51,20 +137,6 @@ pthread_t StartThread(Runnable *runnable) {
     return id;
 }
 
-void die(const char *msg = NULL) {
-    if (msg != NULL) fprintf(stderr, "Fatal error: %s", msg);
-#ifdef MPIBZIP2
-    MPI_Finalize();
-#endif
-    exit(1);
-}
-
-unsigned char *xmalloc(uint32_t n) {
-    void *p = malloc(n);
-    if (p == NULL) die("Out of memory\n");
-    return (unsigned char *)p;
-}
-
 // упаковка 32-битного целого в память
 void pack32(unsigned char *p, uint32_t x) {
     for (int i = 0; i < 4; i++) { *p++ = x & 0xff; x >>= 8; }
@@ -77,6 +149,45 @@ uint32_t unpack32(unsigned char *p) {
     return x;
 }
 
+// Сигнатуры начала блока и конца потока в формате bzip2 (48 бит)
+const uint64_t kBlockMagic = 0x314159265359ULL;
+const uint64_t kEndMagic = 0x177245385090ULL;
+
+// Нумерация битов в буферах везде идёт от старшего бита первого байта,
+// как в самом формате bzip2.
+
+// чтение n (n <= 57) битов, начиная с бита pos
+uint64_t GetBits(const unsigned char *p, uint64_t pos, int n) {
+    uint64_t x = 0;
+    p += pos >> 3;
+    for (int i = 0; i < 8; i++) x = (x << 8) | p[i];
+    return (x << (pos & 7)) >> (64 - n);
+}
+
+// запись n младших битов value начиная с бита pos; биты буфера
+// в этом месте должны быть нулевыми
+void PutBits(unsigned char *p, uint64_t pos, uint64_t value, int n) {
+    for (int i = n - 1; i >= 0; i--, pos++)
+        if ((value >> i) & 1) p[pos >> 3] |= 0x80 >> (pos & 7);
+}
+
+// Копирует nbits битов из src, начиная с бита pos, в начало dst.
+// Неиспользуемые биты последнего байта dst обнуляются.
+// Из src может быть прочитан один байт сверх указанного диапазона.
+void CopyBits(unsigned char *dst, const unsigned char *src,
+              uint64_t pos, uint64_t nbits) {
+    uint64_t n = (nbits + 7) / 8;
+    int shift = pos & 7;
+    src += pos >> 3;
+    if (shift == 0) {
+        memcpy(dst, src, n);
+    } else {
+        for (uint64_t i = 0; i < n; i++)
+            dst[i] = (src[i] << shift) | (src[i + 1] >> (8 - shift));
+    }
+    if (nbits & 7) dst[n - 1] &= 0xff << (8 - (nbits & 7));
+}
+
 // Определяет число доступных процессорных ядер в системе
 int DetectCPUs() {
 #ifdef _SC_NPROCESSORS_ONLN
@@ -88,13 +199,41 @@ int DetectCPUs() {
     return 1;
 }
 
+// Алгоритм сортировки циклических сдвигов блока (параметр --sort)
+enum BlockSorter {
+    SORT_AUTO,   // выбирается для каждого блока по RepeatFraction
+    SORT_BZIP2,  // сортировка libbz2
+    SORT_SAIS    // SA-IS (sais.h)
+};
+
+// Потоки, которые могут помочь отсортировать блок (ParallelSort):
+// Available() - сколько их свободно сейчас, Post() - передать задание
+// count из них.
+class SortHelpers {
+  public:
+    virtual int Available() = 0;
+    virtual void Post(ParallelSort *job, int count) = 0;
+    virtual ~SortHelpers() {}
+};
+
 // Класс BzipBlockCompressor. Взаимодействует с библиотекой bzip2 1.0.4/1.0.5,
 // предоставляет интерфейс для сжатия отдельного блока данных.
+class BzipBlockDecompressor;
+
 class BzipBlockCompressor {
   public:
-    BzipBlockCompressor(int blockSize100k);
+    // helpers: потоки, с которыми можно разделить сортировку блока, или NULL
+    // node: узел NUMA для массивов компрессора (-1 - узел потока, который
+    // первым к ним обратится)
+    BzipBlockCompressor(int blockSize100k, SortHelpers *helpers = NULL, int node = -1);
     ~BzipBlockCompressor();
 
+    // Алгоритм сортировки, общий для всех компрессоров
+    static BlockSorter sorter;
+
+    // Проверять каждый сжатый блок распаковкой (--verify)
+    static bool verify;
+
     // Процедура для сжатия одного блока.
     // size: размер входного блока в байтах
     // crc: CRC-сумма исходных данных блока (до применения RLE-сжатия)
@@ -103,22 +242,56 @@ class BzipBlockCompressor {
     // Возвращает указатель на буфер для входных данных
     unsigned char *InputBuffer() const { return s.block; }
 
+    // Размер буфера для входных данных. Он больше самого блока, так как
+    // во время сжатия в нём же хранятся вспомогательные массивы сортировки
+    // и сжатые данные.
+    static uint32_t BufferSize(int blockSize100k) {
+        return (100000 * blockSize100k + BZ_N_OVERSHOOT) * sizeof(UInt32);
+    }
+
+    // Память, занимаемая одним компрессором, включая временные массивы
+    // SA-IS (не больше 6 байтов на символ блока)
+    static uint64_t MemoryUsage(int blockSize100k) {
+        return ArenaSize(100000 * blockSize100k * sizeof(UInt32)) +
+               ArenaSize(BufferSize(blockSize100k)) + ArenaSize(65537 * sizeof(UInt32)) +
+               sizeof(EState) + 6 * 100000 * blockSize100k;
+    }
+
+    // Отдаёт компрессору буфер размером BufferSize(), заполненный входными
+    // данными, и возвращает взамен прежний буфер компрессора. Так блок
+    // сжимается прямо там, куда его записал поток RLE-сжатия.
+    unsigned char *SwapInputBuffer(unsigned char *buf) {
+        unsigned char *old = (unsigned char *)s.arr2;
+        s.arr2 = (UInt32 *)buf;
+        s.block = buf;
+        return old;
+    }
+
     // Возвращает указатель на буфер с выходными данными и их размер в битах
     const unsigned char *OutputBuffer() const { return s.zbits; }
-    uint32_t OutputBits() const { return s.numZ * 8 + s.bsLive - 80; }
+    uint32_t OutputBits() const { return s.numZ * 8 + s.bsLive; }
 
   private:
     EState s;
+    SortHelpers *helpers;
+    BzipBlockDecompressor *checker;  // для verify, создаётся при первом блоке
+
+    void Verify();
+
     BzipBlockCompressor(const BzipBlockCompressor &) {};
     void operator =(const BzipBlockCompressor &) {};
 };
 
-BzipBlockCompressor::BzipBlockCompressor(int blockSize100k) {
+// Массивы берутся из ArenaAlloc (arena.h): они переходят к следующим
+// файлам и по возможности лежат на больших страницах
+BzipBlockCompressor::BzipBlockCompressor(int blockSize100k, SortHelpers *helpers, int node) {
+    this->helpers = helpers;
+    checker = NULL;
     uint32_t n = 100000 * blockSize100k;
     memset(&s, 0, sizeof(EState));
-    s.arr1 = (UInt32 *)xmalloc(n * sizeof(UInt32));
-    s.arr2 = (UInt32 *)xmalloc((n+BZ_N_OVERSHOOT) * sizeof(UInt32));
-    s.ftab = (UInt32 *)xmalloc(65537 * sizeof(UInt32));
+    s.arr1 = (UInt32 *)ArenaAlloc(n * sizeof(UInt32), node);
+    s.arr2 = (UInt32 *)ArenaAlloc(BufferSize(blockSize100k), node);
+    s.ftab = (UInt32 *)ArenaAlloc(65537 * sizeof(UInt32), node);
     s.blockSize100k = blockSize100k;
     s.nblockMAX = 100000 * blockSize100k - 19;
     s.workFactor = 30;
@@ -127,161 +300,647 @@ BzipBlockCompressor::BzipBlockCompressor(int blockSize100k) {
     s.ptr = (UInt32*)s.arr1;
 }
 
+static void SortBlock(EState *s, SortHelpers *helpers);
+
+// Блок сортируется (SortBlock) и кодируется (CodeBlock) так же, как это
+// делает BZ2_compressBlock, но без заголовка и конца потока
 void BzipBlockCompressor::Compress(uint32_t input_size, uint32_t crc) {
-    s.numZ = s.bsLive = s.bsBuff = s.combinedCRC = 0;
-    s.blockNo = 2;
-    s.blockCRC = crc ^ 0xffffffffL;
+    s.numZ = s.bsLive = 0;
+    s.blockCRC = crc;
     s.nblock = input_size;
     memset(s.inUse, 0, sizeof(s.inUse));
     for (unsigned char *p = s.block, *q = p + input_size; p < q;)
         s.inUse[*p++] = 1;
-    BZ2_compressBlock(&s, 1);
+    SortBlock(&s, helpers);
+    s.zbits = s.block + s.nblock;
+    CodeBlock(&s);
+    if (verify) Verify();
 }
 
-BzipBlockCompressor::~BzipBlockCompressor() {
-    free(s.arr1); free(s.arr2); free(s.ftab);
+BlockSorter BzipBlockCompressor::sorter = SORT_AUTO;
+bool BzipBlockCompressor::verify = false;
+
+// Блоки меньше этого размера сортируются одним потоком
+const int32_t kParallelSortMin = 100000;
+
+// Сортирует блок вместе со свободными потоками пула. Возвращает false, если
+// помочь некому или если сортировка прервана из-за длинных повторов
+// (тогда *aborted = true).
+static bool ParallelBlockSort(EState *s, SortHelpers *helpers, bool *aborted) {
+    *aborted = false;
+    if (helpers == NULL || s->nblock < kParallelSortMin) return false;
+    int count = helpers->Available();
+    if (count <= 0) return false;
+
+    ParallelSort *job = new ParallelSort(s->block, s->nblock, s->ptr, 16 * (count + 1));
+    job->AddRef(count);
+    helpers->Post(job, count);
+    job->Work();
+    bool ok = job->Wait(&s->origPtr);
+    job->Release();
+    *aborted = !ok;
+    return ok;
+}
+
+// Сортирует сдвиги блока выбранным алгоритмом. Все алгоритмы упорядочивают
+// неравные сдвиги одинаково, так что сжатые данные не зависят от выбора.
+// Периодические блоки всегда сортирует libbz2 (BZ2_blockSort): только у неё
+// определён порядок равных сдвигов, а от него зависит origPtr.
+//
+// В режиме auto блоки без длинных повторов, если в пуле есть свободные
+// потоки (например, на последних блоках файла), сортируются вместе с ними
+// (ParallelSort), иначе - сортировкой libbz2.
+static void SortBlock(EState *s, SortHelpers *helpers) {
+    BlockSorter sorter = BzipBlockCompressor::sorter;
+    if (sorter == SORT_AUTO) {
+        bool aborted;
+        if (RepeatFraction(s->block, s->nblock) >= 0.2)
+            sorter = SORT_SAIS;
+        else if (ParallelBlockSort(s, helpers, &aborted))
+            return;
+        else
+            sorter = aborted ? SORT_SAIS : SORT_BZIP2;
+    }
+    if (sorter == SORT_SAIS && SortRotations(s->block, s->nblock, s->ptr, &s->origPtr))
+        return;
+    BZ2_blockSort(s);
 }
 
-// Класс BitStreamWriter
-// Оборачивает объект типа FILE*, позволяя записывать в него
-// данные блоками с произвольным числом двоичных битов.
-class BitStreamWriter {
+// Класс BzipBlockDecompressor. Распаковывает отдельные блоки bzip2-потока
+// через публичный интерфейс libbz2: блок оборачивается в минимальный поток
+// из заголовка, самого блока, маркера конца потока и CRC этого блока.
+class BzipBlockDecompressor {
   public:
-    BitStreamWriter(FILE *fp, int bufferSize);
-    ~BitStreamWriter();
-    void Write(const unsigned char *data, uint32_t bits);
-    void Flush();
+    BzipBlockDecompressor();
+    ~BzipBlockDecompressor();
+
+    // Процедура для распаковки одного блока.
+    // data: блок, выровненный по началу буфера (начиная с его сигнатуры)
+    // bits: длина блока в битах
+    // Возвращает false, если блок повреждён (в том числе при несовпадении
+    // CRC распакованных данных с записанной в заголовке блока).
+    bool Decompress(const unsigned char *data, uint32_t bits);
+
+    // Возвращает буфер с распакованными данными, их размер и CRC блока
+    const unsigned char *OutputBuffer() const { return out; }
+    uint32_t OutputSize() const { return out_size; }
+    uint32_t BlockCRC() const { return crc; }
+
+    // Память, занимаемая одним декомпрессором: состояние libbz2 (около
+    // 64Кб плюс 4 байта на символ блока размером до 900Кб) и буферы блока,
+    // если распакованный блок не больше 1Мб
+    static uint64_t MemoryUsage() {
+        return 65536 + 900000 * sizeof(UInt32) + 2 * 1048576;
+    }
 
   private:
-    FILE *fp;
-    unsigned char *buffer, *tail, *bufend;
-    uint32_t reg, live;
+    unsigned char *stream, *out;
+    uint32_t stream_cap, out_cap, out_size, crc;
 
-    BitStreamWriter(const BitStreamWriter &) {}
-    void operator =(const BitStreamWriter &) {}
+    // Память, запрашиваемая libbz2 (около 3.6Мб на каждый блок),
+    // не освобождается, а переиспользуется для следующих блоков.
+    vector<pair<void *, int> > live, cache;
+    static void *Alloc(void *opaque, int items, int size);
+    static void Free(void *opaque, void *ptr);
+
+    BzipBlockDecompressor(const BzipBlockDecompressor &) {};
+    void operator =(const BzipBlockDecompressor &) {};
 };
 
-BitStreamWriter::BitStreamWriter(FILE *fp, int bufferSize) {
-    this->fp = fp;
-    tail = buffer = xmalloc(bufferSize);
-    bufend = buffer + bufferSize;
-    live = reg = 0;
+BzipBlockDecompressor::BzipBlockDecompressor() {
+    stream_cap = out_cap = 1048576;
+    stream = xmalloc(stream_cap);
+    out = xmalloc(out_cap);
+    out_size = crc = 0;
 }
 
-BitStreamWriter::~BitStreamWriter() {
-    if (live > 0) Write((const unsigned char *)"\0", 8 - live);
-    Flush();
-    free(buffer);
-    fclose(fp);
+BzipBlockDecompressor::~BzipBlockDecompressor() {
+    for (size_t i = 0; i < cache.size(); i++) free(cache[i].first);
+    free(stream); free(out);
 }
 
-void BitStreamWriter::Write(const unsigned char *data, uint32_t bits) {
-    uint32_t r = reg;
-    for (; bits >= 8; bits -= 8) {
-        r <<= 8;
-        r |= ((uint32_t)(*data++)) << (8 - live);
-        *tail = (r >> 8) & 0xffL;
-        if (++tail == bufend) Flush();
-    }
-    if (bits != 0) {
-        r <<= 8;
-        r |= ((uint32_t)(*data++)) << (8 - live);
-        live += bits;
-        if (live >= 8) {
-            live -= 8;
-            *tail = (r >> 8) & 0xffL;
-            if (++tail == bufend) Flush();
-        } else {
-            r >>= 8;
+void *BzipBlockDecompressor::Alloc(void *opaque, int items, int size) {
+    BzipBlockDecompressor *d = (BzipBlockDecompressor *)opaque;
+    int n = items * size;
+    void *p = NULL;
+    for (size_t i = 0; i < d->cache.size(); i++) {
+        if (d->cache[i].second == n) {
+            p = d->cache[i].first;
+            d->cache.erase(d->cache.begin() + i);
+            break;
+        }
+    }
+    if (p == NULL) p = xmalloc(n);
+    d->live.push_back(make_pair(p, n));
+    return p;
+}
+
+void BzipBlockDecompressor::Free(void *opaque, void *ptr) {
+    BzipBlockDecompressor *d = (BzipBlockDecompressor *)opaque;
+    for (size_t i = 0; i < d->live.size(); i++) {
+        if (d->live[i].first == ptr) {
+            d->cache.push_back(d->live[i]);
+            d->live.erase(d->live.begin() + i);
+            return;
+        }
+    }
+}
+
+bool BzipBlockDecompressor::Decompress(const unsigned char *data, uint32_t bits) {
+    uint32_t n = (bits + 7) / 8;
+    if (bits < 80) return false;
+    crc = GetBits(data, 48, 32);
+
+    // сборка потока: "BZh9", блок, маркер конца потока и CRC потока,
+    // которая для потока из одного блока равна CRC этого блока
+    if (stream_cap < n + 32) {
+        free(stream);
+        stream_cap = n + 32;
+        stream = xmalloc(stream_cap);
+    }
+    memcpy(stream, "BZh9", 4);
+    CopyBits(stream + 4, data, 0, bits);
+    memset(stream + 4 + n, 0, 16);
+    PutBits(stream, 32 + bits, kEndMagic, 48);
+    PutBits(stream, 32 + bits + 48, crc, 32);
+
+    bz_stream strm;
+    memset(&strm, 0, sizeof(strm));
+    strm.bzalloc = Alloc;
+    strm.bzfree = Free;
+    strm.opaque = this;
+    if (BZ2_bzDecompressInit(&strm, 0, 0) != BZ_OK) die("Out of memory\n");
+    strm.next_in = (char *)stream;
+    strm.avail_in = (32 + bits + 80 + 7) / 8;
+
+    int ret;
+    out_size = 0;
+    do {
+        if (out_size == out_cap) {
+            unsigned char *p = xmalloc(out_cap * 2);
+            memcpy(p, out, out_size);
+            free(out);
+            out = p;
+            out_cap *= 2;
+        }
+        strm.next_out = (char *)out + out_size;
+        strm.avail_out = out_cap - out_size;
+        ret = BZ2_bzDecompress(&strm);
+        out_size = out_cap - strm.avail_out;
+    } while (ret == BZ_OK && strm.avail_out == 0);
+    BZ2_bzDecompressEnd(&strm);
+
+    return ret == BZ_STREAM_END;
+}
+
+BzipBlockCompressor::~BzipBlockCompressor() {
+    ArenaFree(s.arr1); ArenaFree(s.arr2); ArenaFree(s.ftab);
+    delete checker;
+}
+
+// Распаковка только что сжатого блока. libbz2 при этом сверяет CRC
+// распакованных данных с записанной в заголовке блока, то есть с CRC
+// исходных данных, подсчитанной при чтении, так что проверяется весь путь
+// от чтения до кодирования.
+void BzipBlockCompressor::Verify() {
+    if (checker == NULL) checker = new BzipBlockDecompressor();
+    if (!checker->Decompress(s.zbits, OutputBits()))
+        die("Compressed block failed verification\n");
+}
+
+// Буфер для готового (сжатого или распакованного) блока
+struct OutputBuffer {
+    unsigned char *data;
+    uint32_t capacity;
+
+    // Увеличивает буфер до n байтов; прежнее содержимое не сохраняется
+    unsigned char *Reserve(uint32_t n) {
+        if (n > capacity) {
+            free(data);
+            data = xmalloc(n);
+            capacity = n;
         }
-        r >>= 8 - live; r <<= 8 - live;
+        return data;
+    }
+};
+
+// Класс BufferPool
+// Ограниченный набор буферов для готовых блоков. Рабочие потоки берут буфер
+// до того, как взять входной блок, а OutputThread возвращает его после
+// записи блока в файл, так что каждый обрабатываемый блок уже имеет буфер и
+// нехватка буферов не может привести к взаимной блокировке. Буферы
+// выделяются при первом использовании и затем переиспользуются; их размер
+// растёт, только если блок не поместился.
+class BufferPool {
+  public:
+    BufferPool(int count, uint32_t size);
+    ~BufferPool();
+    int Count() const { return (int)all.size(); }
+
+    // Возвращает свободный буфер, при необходимости ожидая его освобождения
+    OutputBuffer *Get() {
+        OutputBuffer *b = NULL;
+        free_list.Pop(&b);  // список не закрывается, так что буфер будет
+        b->Reserve(size);
+        return b;
+    }
+
+    // То же, что Get, но без ожидания: если свободных буферов нет, возвращает NULL
+    OutputBuffer *TryGet() {
+        OutputBuffer *b;
+        if (!free_list.TryPop(&b)) return NULL;
+        b->Reserve(size);
+        return b;
+    }
+
+    void Put(OutputBuffer *b) { free_list.Push(b); }
+
+  private:
+    uint32_t size;
+    vector<OutputBuffer *> all;
+    BoundedQueue<OutputBuffer *> free_list;
+
+    BufferPool(const BufferPool &) : free_list(0) {}
+    void operator =(const BufferPool &) {}
+};
+
+BufferPool::BufferPool(int count, uint32_t size) : free_list(count) {
+    this->size = size;
+    for (int i = 0; i < count; i++) {
+        OutputBuffer *b = new OutputBuffer();
+        b->data = NULL;
+        b->capacity = 0;
+        all.push_back(b);
+        free_list.Push(b);
     }
-    reg = r;
 }
 
-void BitStreamWriter::Flush() {
-    size_t n = tail - buffer;
-    if (n != 0) {
-        size_t m = fwrite(buffer, 1, n, fp);
-        if (n != m) die("Failed to write data to output file\n");
-        tail = buffer;
+BufferPool::~BufferPool() {
+    for (size_t i = 0; i < all.size(); i++) {
+        free(all[i]->data);
+        delete all[i];
     }
 }
 
+// Конец существующего bzip2-потока, к которому дописываются новые блоки
+// (параметр -a)
+struct StreamTail {
+    int blockSize100k;     // размер блока из заголовка потока
+    uint64_t bit_offset;   // начало маркера конца потока
+    unsigned char last;    // биты байта, в котором начинается маркер,
+                           // стоящие перед маркером (в старших разрядах)
+    uint32_t crc;          // CRC потока, записанная после маркера
+    uint64_t input_size;   // размер исходных данных потока (для индекса)
+};
+
 // Класс OutputThread
 // Представляет собой поток, который получает от рабочих потоков
 // сжатые блоки, упорядочивает их по номеру и записывает в выходной файл.
 class OutputThread : public Runnable {
+  public:
+    // Типы записей, передаваемых в поток вывода
+    enum {
+        REC_BLOCK,       // сжатый (или распакованный) блок данных
+        REC_FAILED,      // блок, который не удалось распаковать;
+                         // data содержит исходные сжатые биты блока
+        REC_STREAM_END   // конец bzip2-потока, crc - записанная в нём CRC
+    };
+
+  private:
     BitStreamWriter *writer;
-    uint64_t next_id, last_id;
-    pthread_mutex_t mutex;
-    pthread_cond_t condvar;
+    BufferPool *pool;
+    bool decompress;
+    uint64_t next_id, last_id, input_size;
+    BlockIndex *index;
+    uint32_t start_crc;    // CRC потока до первого записываемого блока
+    uint64_t start_bit;    // смещение первого блока в файле, биты
+    uint64_t input_base;   // смещение исходных данных первого блока
+    const char *test_name; // имя проверяемого файла (-t) или NULL
+    uint64_t errors;       // число ошибок, найденных при проверке
+    bool keep_errors;      // режим библиотеки (см. KeepErrors)
+    int error_state;       // 0 - ошибок нет, 1 - текст записывается, 2 - записан
+    char error[128];       // текст первой ошибки в режиме библиотеки
 
-    struct Rec { unsigned char *data; uint32_t bits, crc; };
-    map<uint64_t, Rec> completed;
+    struct Rec { OutputBuffer *buf; uint32_t bits, crc; int type; uint64_t offset; };
 
-  public:
-    OutputThread(BitStreamWriter *writer, int blockSize100k)  {
-        unsigned char magic[4] = { 'B', 'Z', 'h', '0' + blockSize100k };
-        writer->Write(magic, 32);  // запись заголовка bz2-файла
+    // Окно упорядочивания: блок с номером id ожидает записи в ячейке
+    // id % window. Блок, не попадающий в окно, ждёт в Add, пока
+    // OutputThread не запишет предшествующие блоки; блок next_id всегда
+    // попадает в окно, так что это ожидание не может быть взаимным.
+    struct Slot { Rec rec; bool ready; };
+    Slot *slots;
+    uint64_t window;
+    EventCount ready_ec;  // OutputThread ждёт блок next_id
+    EventCount space_ec;  // Add ждёт освобождения ячейки
+
+    void Init(BitStreamWriter *writer, int numBuffers, uint32_t bufferSize) {
         this->writer = writer;
+        pool = new BufferPool(numBuffers, bufferSize);
         next_id = 1;
         last_id = (uint64_t)(-1);
-        pthread_mutex_init(&mutex, NULL);
-        pthread_cond_init(&condvar, NULL);
+        input_size = 0;
+        index = NULL;
+        start_crc = 0;
+        start_bit = 32;
+        input_base = 0;
+        test_name = NULL;
+        errors = 0;
+        keep_errors = false;
+        error_state = 0;
+
+        window = WindowSize(numBuffers);
+        slots = new Slot[window];
+        for (uint64_t i = 0; i < window; i++) slots[i].ready = false;
+    }
+
+  public:
+    // Конструктор для режима сжатия. numBuffers - число буферов для
+    // сжатых блоков, т.е. максимальное число блоков, которые одновременно
+    // сжимаются или ожидают записи.
+    OutputThread(BitStreamWriter *writer, int blockSize100k, int numBuffers)  {
+        unsigned char magic[4] = { 'B', 'Z', 'h', (unsigned char)('0' + blockSize100k) };
+        writer->Write(magic, 32);  // запись заголовка bz2-файла
+        decompress = false;
+        Init(writer, numBuffers, BlockBufferSize(blockSize100k));
+    }
+
+    // Конструктор для дописывания блоков в конец существующего потока.
+    // writer пишет в файл начиная с байта, в котором начинается маркер
+    // конца потока: вместо заголовка туда записываются предшествующие
+    // маркеру биты этого байта, а CRC потока продолжает записанную после
+    // маркера.
+    OutputThread(BitStreamWriter *writer, const StreamTail &tail, int numBuffers) {
+        writer->Write(&tail.last, tail.bit_offset % 8);
+        decompress = false;
+        Init(writer, numBuffers, BlockBufferSize(tail.blockSize100k));
+        start_crc = tail.crc;
+        start_bit = tail.bit_offset;
+        input_base = tail.input_size;
+    }
+
+    // Конструктор для режима распаковки: в файл пишутся только данные
+    // блоков, а CRC каждого bzip2-потока сверяется с записанной в нём.
+    OutputThread(BitStreamWriter *writer, int numBuffers) {
+        decompress = true;
+        Init(writer, numBuffers, BlockBufferSize(0));
     }
 
     ~OutputThread() {
-        pthread_cond_destroy(&condvar);
-        pthread_mutex_destroy(&mutex);
+        delete[] slots;
         delete writer;
+        delete pool;
+    }
+
+    // Пул буферов, в которых рабочие потоки передают готовые блоки
+    BufferPool *Pool() { return pool; }
+
+    // При сжатии заполнять индекс блоков (до запуска потока). Смещение
+    // блока в исходных данных передаётся в Add в параметре offset.
+    void SetIndex(BlockIndex *index) { this->index = index; }
+
+    // Начальный размер буфера для сжатого блока или, при blockSize100k = 0,
+    // для распакованного. Несжимаемые данные увеличиваются bzip2 не более
+    // чем на несколько процентов, так что буферы для сжатых блоков
+    // практически никогда не придётся увеличивать.
+    static uint32_t BlockBufferSize(int blockSize100k) {
+        return blockSize100k > 0 ? blockSize100k * 112500 + 1024 : 1048576;
+    }
+
+    // Число ячеек окна упорядочивания. Блоков, занимающих буферы, не больше
+    // numBuffers, так что обычно окно ограничивает только записи о концах
+    // потоков.
+    static uint64_t WindowSize(int numBuffers) {
+        uint64_t n = 64;
+        while (n < 2 * (uint64_t)numBuffers) n *= 2;
+        return n;
+    }
+
+    // Память, занимаемая буферами блоков и окном упорядочивания
+    static uint64_t MemoryUsage(int numBuffers, int blockSize100k) {
+        return (uint64_t)numBuffers * BlockBufferSize(blockSize100k) +
+               WindowSize(numBuffers) * sizeof(Slot);
     }
 
     virtual void Run() {
-        uint32_t c_crc = 0;
-        pthread_mutex_lock(&mutex);
-        while (true) {
-            if (next_id > last_id) break;
-            if (completed.size() == 0 || completed.begin()->first != next_id) {
-                pthread_cond_wait(&condvar, &mutex);
+        StatsThread stats("output");
+        uint32_t c_crc = start_crc;
+        uint64_t bit_pos = start_bit;  // смещение следующего блока в сжатом файле
+        bool damaged = false;  // в потоке есть нераспакованный блок (-t)
+        Rec *next;
+        while ((next = WaitNext()) != NULL) {
+            Rec rec = *next;
+            Release();
+            if (rec.type == REC_FAILED && !Recover(rec)) {
+                damaged = true;
                 continue;
             }
 
-            Rec rec = completed.begin()->second;
-            completed.erase(next_id++);
-
-            pthread_mutex_unlock(&mutex);
-            writer->Write(rec.data, rec.bits);
-            free(rec.data);
-            c_crc = ((c_crc << 1) | (c_crc >> 31)) ^ rec.crc;
-            pthread_mutex_lock(&mutex);
+            if (rec.type == REC_STREAM_END) {
+                // CRC потока с повреждённым блоком не сойдётся заведомо
+                if (rec.crc != c_crc && !damaged && keep_errors) {
+                    Fail("Stream CRC mismatch", rec.offset);
+                } else if (rec.crc != c_crc && !damaged) {
+                    fprintf(stderr, "%s%sStream CRC mismatch at bit offset %llu: "
+                            "stored 0x%08x, computed 0x%08x\n",
+                            test_name != NULL ? test_name : "", test_name != NULL ? ": " : "",
+                            (unsigned long long)rec.offset, rec.crc, c_crc);
+                    if (test_name == NULL) die("Data integrity error\n");
+                    __atomic_add_fetch(&errors, 1, __ATOMIC_RELAXED);
+                }
+                c_crc = 0;
+                damaged = false;
+            } else {
+                if (index != NULL) index->Add(bit_pos, input_base + rec.offset);
+                bit_pos += rec.bits;
+                // после ошибки (в режиме библиотеки) данные не записываются
+                if (test_name == NULL && FirstError() == NULL)
+                    writer->Write(rec.buf->data, rec.bits);
+                StatsOutput(rec.bits / 8);
+                pool->Put(rec.buf);
+                c_crc = ((c_crc << 1) | (c_crc >> 31)) ^ rec.crc;
+            }
         }
-        pthread_mutex_unlock(&mutex);
 
-        // запись маркера конца файла и CRC-суммы всего входного файла
-        unsigned char a[10] = {
-            0x17, 0x72, 0x45, 0x38, 0x50, 0x90, (c_crc >> 24) & 0xff,
-            (c_crc >> 16) & 0xff, (c_crc >> 8) & 0xff, c_crc & 0xff
-        };
-        writer->Write(a, 80);
+        if (!decompress) {
+            if (index != NULL) index->SetEnd(bit_pos, input_base + input_size);
+            // запись маркера конца файла и CRC-суммы всего входного файла
+            unsigned char a[10] = {
+                0x17, 0x72, 0x45, 0x38, 0x50, 0x90,
+                (unsigned char)(c_crc >> 24), (unsigned char)(c_crc >> 16),
+                (unsigned char)(c_crc >> 8), (unsigned char)c_crc
+            };
+            writer->Write(a, 80);
+        }
 
         delete writer;
         writer = NULL;
     }
 
-    void Add(uint64_t block_id, unsigned char *data, uint32_t bits, uint32_t crc) {
-        pthread_mutex_lock(&mutex);
-        Rec rec = { data, bits, crc };
-        completed[block_id] = rec;
-        pthread_cond_signal(&condvar);
-        pthread_mutex_unlock(&mutex);
+    // Передаёт готовый блок на запись. Буфер buf, полученный из Pool(),
+    // возвращается в пул после записи блока.
+    void Add(uint64_t block_id, OutputBuffer *buf, uint32_t bits, uint32_t crc,
+             int type = REC_BLOCK, uint64_t offset = 0) {
+        StatsWait wait(STAT_WAIT_WINDOW);
+        for (int i = 0; block_id - __atomic_load_n(&next_id, __ATOMIC_ACQUIRE) >= window; i++) {
+            if (i < kSpinCount) { CpuRelax(); continue; }
+            uint32_t key = space_ec.PrepareWait();
+            if (block_id - __atomic_load_n(&next_id, __ATOMIC_SEQ_CST) < window) {
+                space_ec.CancelWait();
+                break;
+            }
+            space_ec.Wait(key);
+        }
+
+        Slot *slot = &slots[block_id & (window - 1)];
+        Rec rec = { buf, bits, crc, type, offset };
+        slot->rec = rec;
+        __atomic_store_n(&slot->ready, true, __ATOMIC_SEQ_CST);
+
+        // OutputThread нужно будить, только если он ждёт именно этот блок
+        if (block_id == __atomic_load_n(&next_id, __ATOMIC_SEQ_CST))
+            ready_ec.Notify();
     }
 
-    void SetLastBlock(uint64_t id) {
-        pthread_mutex_lock(&mutex);
-        last_id = id;
-        pthread_cond_signal(&condvar);
-        pthread_mutex_unlock(&mutex);
+    // Режим проверки (-t): распакованные данные не записываются, а об
+    // ошибках в сжатых данных сообщается (name - имя файла) без завершения
+    // программы
+    void SetTest(const char *name) { test_name = name; }
+
+    // Число ошибок, найденных при проверке
+    uint64_t Errors() const { return __atomic_load_n(&errors, __ATOMIC_ACQUIRE); }
+
+    // Режим библиотеки: ошибка в сжатых данных не завершает программу и не
+    // печатается, а запоминается (FirstError), и всё после неё
+    // не записывается. Устанавливается до запуска потока.
+    void KeepErrors() { keep_errors = true; }
+
+    // Текст первой ошибки в режиме библиотеки или NULL
+    const char *FirstError() const {
+        return __atomic_load_n(&error_state, __ATOMIC_ACQUIRE) == 2 ? error : NULL;
+    }
+
+    // Ошибка в структуре сжатых данных по смещению offset (в битах): при
+    // проверке о ней сообщается, иначе программа завершается с сообщением msg
+    void Error(const char *msg, uint64_t offset) {
+        if (keep_errors) {
+            Fail(msg, offset);
+            return;
+        }
+        if (test_name == NULL) die((string(msg) + "\n").c_str());
+        fprintf(stderr, "%s: %s at bit offset %llu\n", test_name, msg,
+                (unsigned long long)offset);
+        __atomic_add_fetch(&errors, 1, __ATOMIC_RELAXED);
+    }
+
+    // Сообщает номер последнего блока и число байтов входных данных
+    void SetLastBlock(uint64_t id, uint64_t input_size) {
+        this->input_size = input_size;
+        __atomic_store_n(&last_id, id, __ATOMIC_SEQ_CST);
+        ready_ec.Notify(true);
+    }
+
+  private:
+    // Запоминает ошибку, если она первая. Ошибки находят и поток
+    // распаковки, и поток вывода, так что текст записывает тот, кто
+    // первым изменил error_state.
+    void Fail(const char *msg, uint64_t offset) {
+        int expected = 0;
+        if (!__atomic_compare_exchange_n(&error_state, &expected, 1, false,
+                                         __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            return;
+        snprintf(error, sizeof(error), "%s at bit offset %llu", msg,
+                 (unsigned long long)offset);
+        __atomic_store_n(&error_state, 2, __ATOMIC_RELEASE);
+    }
+
+    // Ожидает готовности блока next_id и возвращает запись о нём, не
+    // освобождая ячейку. Возвращает NULL, если все блоки уже записаны.
+    Rec *WaitNext() {
+        StatsWait wait(STAT_WAIT_NEXT);
+        Slot *slot = &slots[next_id & (window - 1)];
+        for (int i = 0; ; i++) {
+            if (__atomic_load_n(&slot->ready, __ATOMIC_ACQUIRE)) return &slot->rec;
+            if (next_id > __atomic_load_n(&last_id, __ATOMIC_ACQUIRE)) return NULL;
+            if (i < kSpinCount) { CpuRelax(); continue; }
+
+            uint32_t key = ready_ec.PrepareWait();
+            if (__atomic_load_n(&slot->ready, __ATOMIC_SEQ_CST) ||
+                next_id > __atomic_load_n(&last_id, __ATOMIC_SEQ_CST)) {
+                ready_ec.CancelWait();
+                continue;
+            }
+            ready_ec.Wait(key);
+        }
+    }
+
+    // Освобождает ячейку блока next_id и переходит к следующему блоку
+    void Release() {
+        __atomic_store_n(&slots[next_id & (window - 1)].ready, false, __ATOMIC_RELAXED);
+        __atomic_store_n(&next_id, next_id + 1, __ATOMIC_SEQ_CST);
+        space_ec.Notify(true);
+    }
+
+    // Восстановление после ошибки распаковки блока. Сигнатура блока может
+    // случайно встретиться внутри сжатых данных, и тогда настоящий блок
+    // оказывается разрезан на несколько фрагментов, каждый из которых
+    // распаковать не удаётся. Такие идущие подряд фрагменты склеиваются и
+    // распаковываются заново. Возвращает false, если блок повреждён (только
+    // при проверке и в режиме библиотеки: иначе программа завершается).
+    bool Recover(Rec &rec) {
+        vector<Rec> parts(1, rec);
+        BzipBlockDecompressor dec;
+
+        while (true) {
+            Rec *next = WaitNext();
+            if (next == NULL || next->type != REC_FAILED) break;
+            parts.push_back(*next);
+            Release();
+            uint64_t bits = 0;
+            for (size_t i = 0; i < parts.size(); i++) bits += parts[i].bits;
+            if (bits > 0xffffffffULL - 64) break;
+            unsigned char *buf = xmalloc(bits / 8 + 16);
+            memset(buf, 0, bits / 8 + 16);
+            uint64_t pos = 0;
+            for (size_t i = 0; i < parts.size(); i++) {
+                for (uint32_t j = 0; j < parts[i].bits; j += 8) {
+                    int k = min(8, (int)(parts[i].bits - j));
+                    PutBits(buf, pos, parts[i].buf->data[j / 8] >> (8 - k), k);
+                    pos += k;
+                }
+            }
+
+            bool ok = dec.Decompress(buf, bits);
+            free(buf);
+            if (ok) {
+                // результат записывается в буфер первого фрагмента
+                for (size_t i = 1; i < parts.size(); i++) pool->Put(parts[i].buf);
+                rec.type = REC_BLOCK;
+                rec.bits = dec.OutputSize() * 8;
+                rec.crc = dec.BlockCRC();
+                memcpy(rec.buf->Reserve(dec.OutputSize() + 1), dec.OutputBuffer(),
+                       dec.OutputSize());
+                return true;
+            }
+        }
+
+        if (keep_errors) {
+            Fail("Failed to decompress block", rec.offset);
+        } else if (test_name == NULL) {
+            fprintf(stderr, "Failed to decompress block at bit offset %llu\n",
+                    (unsigned long long)rec.offset);
+            die("Data integrity error\n");
+        }
+        // фрагменты не склеились: скорее всего, повреждены несколько блоков
+        // подряд, и о каждом сообщается отдельно
+        for (size_t i = 0; i < parts.size(); i++) {
+            if (test_name != NULL) {
+                fprintf(stderr, "%s: bad block at bit offset %llu (data or CRC error)\n",
+                        test_name, (unsigned long long)parts[i].offset);
+                __atomic_add_fetch(&errors, 1, __ATOMIC_RELAXED);
+            }
+            pool->Put(parts[i].buf);
+        }
+        return false;
     }
 };
 
@@ -289,433 +948,3780 @@ struct InputBlock {
     unsigned char *data;
     uint32_t size, crc;
     uint64_t id;
+    uint64_t offset;  // смещение блока во входном файле: в байтах исходных
+                      // данных при сжатии, в битах при распаковке
+    OutputBuffer *out;  // буфер для результата обработки блока
+    int node;           // узел NUMA, на котором размещён буфер data
 };
 
-// Класс InputThread
-// Представляет собой поток, осуществляющий чтение входного файла,
-// сжатие его методом RLE и разбиением на блоки.
-class InputThread : public Runnable {
+// Получатель уведомлений о том, что очередной блок прочитан
+class BlockListener {
   public:
-    InputThread(FILE *fp, int blockSize100k, int bufferSize, int queueSize);
-    ~InputThread();
-    virtual void Run();
+    virtual ~BlockListener() {}
+    virtual void BlockReady() = 0;
+};
+
+// Класс BlockReader
+// Базовый класс потоков, читающих входной файл и нарезающих его на блоки
+// для рабочих потоков. Управляет очередями свободных и заполненных блоков.
+// При размещении с учётом NUMA (--numa) буферы блоков распределены по
+// узлам, и у каждого узла своя очередь заполненных блоков: рабочий поток
+// берёт блоки сначала из очереди своего узла.
+class BlockReader : public Runnable {
+  public:
+    BlockReader(uint32_t blockBytes, int queueSize);
+    virtual ~BlockReader();
     uint64_t GetBlocksCount() const { return block_id; }
+    // Число прочитанных байтов входных данных (после окончания чтения)
+    uint64_t GetInputSize() const { return input_size; }
+    void Connect(BufferPool *buffers, BlockListener *listener);
     InputBlock *Get();
+    InputBlock *TryGet(int node = 0);
     void Put(InputBlock *b);
 
-  private:
-    FILE *fp;
-    uint32_t rle_ch, rle_len, crc, nblock, nblockMAX, bufferSize;
-    uint64_t block_id;
-    unsigned char *block, *buffer;
-    pthread_mutex_t mutex;
-    pthread_cond_t free_cv, busy_cv;
-    vector<InputBlock *> free_queue;
-    queue<InputBlock *> busy_queue;
+  protected:
+    uint64_t block_id, input_size;
     InputBlock *blk;
 
     void PrepareBlock();
-    void DispatchBlock();
+    void DispatchBlock(uint32_t size, uint32_t crc, uint64_t offset = 0);
+    void Finish();
 
-    // вспомогательная процедура для RLE-сжатия
-    inline void add_pair() {
-        switch (rle_len) {
-          case 1:
-            block[nblock++] = (unsigned char)rle_ch;
-            break;
-          case 2:
-            block[nblock++] = (unsigned char)rle_ch;
-            block[nblock++] = (unsigned char)rle_ch;
-            break;
-          case 3:
-            block[nblock++] = (unsigned char)rle_ch;
-            block[nblock++] = (unsigned char)rle_ch;
-            block[nblock++] = (unsigned char)rle_ch;
-            break;
-          default:
-            block[nblock++] = (unsigned char)rle_ch;
-            block[nblock++] = (unsigned char)rle_ch;
-            block[nblock++] = (unsigned char)rle_ch;
-            block[nblock++] = (unsigned char)rle_ch;
-            block[nblock++] = (unsigned char)(rle_len - 4);
-            break;
-        }
-        while (rle_len-- != 0) BZ_UPDATE_CRC(crc, rle_ch);
-    }
+  private:
+    BoundedQueue<InputBlock *> free_queue;
+    vector<BoundedQueue<InputBlock *> *> busy_queues;  // по одной на узел
+    BufferPool *buffers;
+    BlockListener *listener;
+    EventCount ready_ec;  // Get ждёт блок в одной из очередей
+    bool finished;
 
-    InputThread(const InputThread &) : Runnable() {}
-    void operator =(const InputThread &) {}
+    BlockReader(const BlockReader &) : Runnable(), free_queue(0) {}
+    void operator =(const BlockReader &) {}
 };
 
-InputThread::InputThread(FILE *fp, int blockSize100k, int bufferSize, int queueSize) {
-    this->fp = fp;
-    this->bufferSize = bufferSize;
-    buffer = xmalloc(bufferSize);
-    nblockMAX = 100000 * blockSize100k - 19;
-    block_id = 0;
-    pthread_mutex_init(&mutex, NULL);
-    pthread_cond_init(&free_cv, NULL);
-    pthread_cond_init(&busy_cv, NULL);
+BlockReader::BlockReader(uint32_t blockBytes, int queueSize)
+    : free_queue(queueSize) {
+    block_id = input_size = 0;
+    blk = NULL;
+    buffers = NULL;
+    listener = NULL;
+    finished = false;
+    int nodes = NumaNodes();
+    for (int i = 0; i < nodes; i++)
+        busy_queues.push_back(new BoundedQueue<InputBlock *>(queueSize));
     for (int i = 0; i < queueSize; i++) {
-        free_queue.push_back(new InputBlock());
-        free_queue.back()->data = xmalloc(100000 * blockSize100k);
+        InputBlock *b = new InputBlock();
+        b->node = i % nodes;
+        b->data = ArenaAlloc(blockBytes, b->node);
+        free_queue.Push(b);
     }
 }
 
-InputThread::~InputThread() {
-    pthread_cond_destroy(&busy_cv);
-    pthread_cond_destroy(&free_cv);
-    pthread_mutex_destroy(&mutex);
-    free(buffer);
-    for (size_t i = 0; i < free_queue.size(); i++) {
-        free(free_queue[i]->data);
-        delete free_queue[i];
+BlockReader::~BlockReader() {
+    InputBlock *b;
+    while (free_queue.TryPop(&b)) {
+        ArenaFree(b->data);
+        delete b;
     }
+    for (size_t i = 0; i < busy_queues.size(); i++) delete busy_queues[i];
 }
 
-// Главный цикл, осуществляющий чтение и RLE-сжатие входного файла
-void InputThread::Run() {
-    unsigned char *ptr = NULL;
-    uint32_t avail = 0, ch;
+// Задаёт пул, из которого каждому прочитанному блоку выдаётся буфер для
+// результата, и получателя уведомлений о готовых блоках (может быть NULL).
+// Вызывается до запуска потока.
+void BlockReader::Connect(BufferPool *buffers, BlockListener *listener) {
+    this->buffers = buffers;
+    this->listener = listener;
+}
 
-    nblock = nblockMAX;
-    block = NULL;
-    rle_ch = 256;
-    rle_len = 0;
+void BlockReader::PrepareBlock() {
+    StatsWait wait(STAT_WAIT_FREE);
+    free_queue.Pop(&blk);
+    blk->id = ++block_id;
+}
 
-    while (true) {
-        if (avail == 0) {
-            avail = fread(buffer, 1, bufferSize, fp);
-            if (avail == 0) break;
-            ptr = buffer;
-        }
+void BlockReader::DispatchBlock(uint32_t size, uint32_t crc, uint64_t offset) {
+    blk->size = size;
+    blk->crc = crc;
+    blk->offset = offset;
 
-        if (nblock >= nblockMAX) {
-            if (block != NULL) {
-                BZ_FINALISE_CRC(crc);
-                DispatchBlock();
-            }
-            PrepareBlock();
-            nblock = 0;
-            BZ_INITIALISE_CRC(crc);
-        }
+    // Буфер выдаётся здесь, в порядке номеров блоков: все занятые буферы
+    // принадлежат предшествующим блокам, которые будут записаны, так что
+    // блок, которого ждёт OutputThread, не может остаться без буфера.
+    {
+        StatsWait wait(STAT_WAIT_BUFFER);
+        blk->out = buffers->Get();
+    }
+    BoundedQueue<InputBlock *> *queue = busy_queues[blk->node];
+    ThreadStats *stats = CurrentStats();
+    if (stats != NULL) {
+        stats->blocks++;
+        stats->depth.Add(queue->Size());
+    }
+    queue->Push(blk);
+    if (busy_queues.size() > 1) ready_ec.Notify();
+    if (listener != NULL) listener->BlockReady();
+}
 
-        ch = *ptr++;
-        avail--;
+// Сообщает рабочим потокам, что новых блоков больше не будет
+void BlockReader::Finish() {
+    for (size_t i = 0; i < busy_queues.size(); i++) busy_queues[i]->Close();
+    __atomic_store_n(&finished, true, __ATOMIC_SEQ_CST);
+    ready_ec.Notify(true);
+}
 
-        if (ch != rle_ch && rle_len == 1) {
-            BZ_UPDATE_CRC(crc, rle_ch);
-            block[nblock++] = rle_ch;
-            rle_ch = ch;
-        } else if (ch == rle_ch && rle_len != 255) {
-            ++rle_len;
-        } else {
-            if (rle_ch != 256) add_pair();
-            rle_ch = ch;
-            rle_len = 1;
+// Эта процедура вызывается рабочими потоками для получения очередного блока
+// для сжатия. Если требуется, процедура блокирует выполнения потока пока
+// очередной блок не будет прочтён. При достижении конца файла возвращает NULL.
+InputBlock *BlockReader::Get() {
+    InputBlock *b;
+    if (busy_queues.size() == 1) return busy_queues[0]->Pop(&b) ? b : NULL;
+    while (true) {
+        uint32_t key = ready_ec.PrepareWait();
+        // если чтение закончено до проверки очередей, все блоки уже в них
+        bool done = __atomic_load_n(&finished, __ATOMIC_SEQ_CST);
+        if ((b = TryGet()) != NULL || done) {
+            ready_ec.CancelWait();
+            return b;
         }
+        ready_ec.Wait(key);
     }
+}
 
-    if (ferror(fp)) {
-        perror("fread");
-        die("Failed to read data from input file\n");
+// То же без ожидания: возвращает NULL, если готовых блоков нет. Блоки
+// берутся сначала из очереди узла node.
+InputBlock *BlockReader::TryGet(int node) {
+    InputBlock *b;
+    size_t n = busy_queues.size();
+    for (size_t i = 0; i < n; i++)
+        if (busy_queues[(node + i) % n]->TryPop(&b)) return b;
+    return NULL;
+}
+
+// Вызывается рабочими потоками, чтобы "вернуть" блок, ранее
+// полученный ими от процедуры Get()
+void BlockReader::Put(InputBlock *b) {
+    free_queue.Push(b);
+}
+
+// Класс ByteSource
+// Источник входных байтов для потоков чтения: файл или данные, которые
+// передаёт вызывающая сторона через интерфейс библиотеки.
+class ByteSource {
+  public:
+    virtual ~ByteSource() {}
+
+    // Читает до n байтов, ожидая, если данных пока нет; 0 - конец данных
+    virtual uint32_t Read(unsigned char *buf, uint32_t n) = 0;
+
+    // Вызывается потоком чтения, когда все данные прочитаны
+    virtual void Close() {}
+
+    // Файл, который можно отобразить в память, или NULL
+    virtual FILE *File() { return NULL; }
+};
+
+// Класс FileSource: чтение из файла через stdio. Файл закрывается по Close().
+class FileSource : public ByteSource {
+  public:
+    FileSource(FILE *fp) { this->fp = fp; }
+    ~FileSource() { if (fp != NULL) fclose(fp); }
+
+    virtual uint32_t Read(unsigned char *buf, uint32_t n) {
+        n = fread(buf, 1, n, fp);
+        if (n == 0 && ferror(fp)) {
+            perror("fread");
+            die("Failed to read data from input file\n");
+        }
+        return n;
+    }
+
+    virtual void Close() { fclose(fp); fp = NULL; }
+    virtual FILE *File() { return fp; }
+
+  private:
+    FILE *fp;
+};
+
+// Класс UringSource: чтение из файла через io_uring с упреждением (см.
+// uring.h). Файл не отображается в память: чтение страниц отображения
+// блокировало бы поток так же, как fread.
+class UringSource : public ByteSource {
+  public:
+    UringSource(UringReader *reader) { this->reader = reader; }
+    ~UringSource() { delete reader; }
+
+    virtual uint32_t Read(unsigned char *buf, uint32_t n) { return reader->Read(buf, n); }
+    virtual void Close() { reader->Close(); }
+
+  private:
+    UringReader *reader;
+
+    UringSource(const UringSource &) : ByteSource() {}
+    void operator =(const UringSource &) {}
+};
+
+// Источник для входного файла: через io_uring, если он включён (--io-uring)
+// и подходит для файла, иначе через stdio
+static ByteSource *OpenFileSource(FILE *fp) {
+    UringReader *reader = UringReader::Open(fp);
+    if (reader != NULL) return new UringSource(reader);
+    return new FileSource(fp);
+}
+
+// Приёмник для выходного файла, выбираемый так же
+static MtSink *OpenFileSink(FILE *fp) {
+    MtSink *sink = UringSink::Open(fp);
+    return sink != NULL ? sink : new FileSink(fp);
+}
+
+// Класс ChannelSource
+// Кольцевой буфер, в который вызывающая сторона пишет данные (Write),
+// а поток чтения их забирает. Write ожидает, пока в буфере не появится
+// место, так что поток чтения задаёт темп вызывающей стороне.
+class ChannelSource : public ByteSource {
+  public:
+    ChannelSource(uint32_t capacity);
+    ~ChannelSource();
+    // Передаёт данные потоку чтения и возвращает, сколько байтов принято:
+    // меньше n, если очередь полна, а конвейер остановлен (Stall). Данные,
+    // переданные после окончания работы потока чтения (например, после
+    // ошибки в сжатых данных), отбрасываются.
+    size_t Write(const unsigned char *data, size_t n);
+    void CloseInput();  // конец данных
+    virtual uint32_t Read(unsigned char *buf, uint32_t n);
+    virtual void Close();
+
+    // Конвейер остановлен (или снова работает): Write не ждёт места в
+    // очереди, которое не освободится
+    void Stall(bool on);
+
+  private:
+    unsigned char *ring;
+    uint32_t capacity, head, size;
+    bool closed;
+    bool discard;  // поток чтения закончил работу
+    bool stalled;
+    pthread_mutex_t mutex;
+    pthread_cond_t cv;
+
+    ChannelSource(const ChannelSource &) : ByteSource() {}
+    void operator =(const ChannelSource &) {}
+};
+
+ChannelSource::ChannelSource(uint32_t capacity) {
+    this->capacity = capacity;
+    ring = xmalloc(capacity);
+    head = size = 0;
+    closed = discard = stalled = false;
+    pthread_mutex_init(&mutex, NULL);
+    pthread_cond_init(&cv, NULL);
+}
+
+ChannelSource::~ChannelSource() {
+    pthread_cond_destroy(&cv);
+    pthread_mutex_destroy(&mutex);
+    free(ring);
+}
+
+size_t ChannelSource::Write(const unsigned char *data, size_t n) {
+    size_t done = 0;
+    pthread_mutex_lock(&mutex);
+    while (done < n) {
+        while (size == capacity && !discard && !stalled) pthread_cond_wait(&cv, &mutex);
+        if (discard) {
+            done = n;
+            break;
+        }
+        if (size == capacity) break;
+        uint32_t tail = (head + size) % capacity;
+        uint32_t k = min((size_t)min(capacity - size, capacity - tail), n - done);
+        memcpy(ring + tail, data + done, k);
+        size += k;
+        done += k;
+        pthread_cond_broadcast(&cv);
+    }
+    pthread_mutex_unlock(&mutex);
+    return done;
+}
+
+void ChannelSource::Stall(bool on) {
+    pthread_mutex_lock(&mutex);
+    stalled = on;
+    pthread_cond_broadcast(&cv);
+    pthread_mutex_unlock(&mutex);
+}
+
+void ChannelSource::CloseInput() {
+    pthread_mutex_lock(&mutex);
+    closed = true;
+    pthread_cond_broadcast(&cv);
+    pthread_mutex_unlock(&mutex);
+}
+
+void ChannelSource::Close() {
+    pthread_mutex_lock(&mutex);
+    discard = true;
+    size = 0;
+    pthread_cond_broadcast(&cv);
+    pthread_mutex_unlock(&mutex);
+}
+
+uint32_t ChannelSource::Read(unsigned char *buf, uint32_t n) {
+    pthread_mutex_lock(&mutex);
+    while (size == 0 && !closed) pthread_cond_wait(&cv, &mutex);
+    uint32_t done = 0;
+    while (done < n && size != 0) {
+        uint32_t k = min(min(n - done, size), capacity - head);
+        memcpy(buf + done, ring + head, k);
+        head = (head + k) % capacity;
+        size -= k;
+        done += k;
+    }
+    pthread_cond_broadcast(&cv);
+    pthread_mutex_unlock(&mutex);
+    return done;
+}
+
+// Класс InputSource
+// Источник входных данных для потоков RLE-сжатия. Обычные файлы целиком
+// отображаются в память, и данные читаются прямо из страничного кэша без
+// копирования; ядру сообщается о последовательном чтении, уже прочитанные
+// страницы освобождаются, а следующие запрашиваются заранее. Для каналов,
+// терминалов, данных от вызывающей стороны и в случае ошибки mmap данные
+// читаются в буфер.
+//
+// Как и при чтении в буфер, данные читаются до настоящего конца файла:
+// перед каждым участком размер файла проверяется заново. Файл, который
+// дописывается во время сжатия, отображается заново с новым размером,
+// а у укороченного данные за новым концом больше не читаются. Если же
+// файл укоротят между проверкой и чтением участка, обращение к странице
+// за концом файла завершит процесс сигналом SIGBUS.
+class InputSource {
+  public:
+    InputSource(ByteSource *src, uint32_t bufferSize);
+    ~InputSource();
+
+    // Возвращает непрерывный участок входных данных длиной не более size
+    // байтов (size не больше bufferSize). consumed - число обработанных
+    // байтов в начале предыдущего участка; необработанный остаток предыдущего
+    // участка оказывается в начале нового. Возвращает 0 в конце файла.
+    uint32_t Window(const unsigned char **data, uint32_t consumed, uint32_t size);
+
+    // Возвращает true, если последний участок доходит до конца файла
+    bool Eof() const { return eof; }
+
+    // Смещение начала последнего участка во входных данных
+    uint64_t Consumed() const { return consumed_total; }
+
+    bool IsMapped() const { return map != NULL; }
+
+  private:
+    static const uint64_t kReadAhead = 16 << 20;
+
+    ByteSource *src;
+    unsigned char *buffer, *map;
+    int fd;            // отображённый файл
+    uint32_t bufferSize, len;
+    uint64_t map_len;  // длина отображения
+    uint64_t map_size, pos, advised, consumed_total;
+    bool eof;
+
+    void Resize(uint64_t keep, uint64_t need);
+
+    InputSource(const InputSource &) {}
+    void operator =(const InputSource &) {}
+};
+
+InputSource::InputSource(ByteSource *src, uint32_t bufferSize) {
+    this->src = src;
+    this->bufferSize = bufferSize;
+    buffer = map = NULL;
+    len = 0;
+    map_len = map_size = pos = advised = consumed_total = 0;
+    eof = false;
+
+#ifdef HAVE_MMAP
+    struct stat st;
+    fd = src->File() != NULL ? fileno(src->File()) : -1;
+    off_t start = fd >= 0 ? lseek(fd, 0, SEEK_CUR) : -1;
+    if (fd >= 0 && fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && start >= 0 &&
+        st.st_size > start && (uint64_t)st.st_size == (size_t)st.st_size) {
+        void *p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p != MAP_FAILED) {
+            map = (unsigned char *)p;
+            map_len = map_size = st.st_size;
+            pos = advised = start;
+            madvise(map, map_size, MADV_SEQUENTIAL);
+            return;
+        }
+    }
+#endif
+    buffer = xmalloc(bufferSize);
+}
+
+InputSource::~InputSource() {
+#ifdef HAVE_MMAP
+    if (map != NULL) munmap(map, map_len);
+#endif
+    free(buffer);
+}
+
+#ifdef HAVE_MMAP
+// Сверяет отображение с текущим размером файла. Данные до keep уже отданы
+// и остаются доступными; если в отображении нет данных до need, а файл
+// вырос, он отображается заново.
+void InputSource::Resize(uint64_t keep, uint64_t need) {
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (uint64_t)st.st_size == map_size) return;
+    uint64_t size = max((uint64_t)st.st_size, keep);
+    if (size < map_size) {
+        map_size = size;
+        advised = min(advised, map_size);
+        return;
+    }
+    if (need <= map_size || size <= map_len || (uint64_t)size != (size_t)size) {
+        map_size = min(size, map_len);
+        return;
+    }
+    void *p = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (p == MAP_FAILED) return;  // тогда дочитывается прежнее отображение
+    munmap(map, map_len);
+    map = (unsigned char *)p;
+    map_len = map_size = size;
+    advised = pos;
+    madvise(map, map_len, MADV_SEQUENTIAL);
+}
+#endif
+
+uint32_t InputSource::Window(const unsigned char **data, uint32_t consumed, uint32_t size) {
+    StatsInput(consumed);
+    consumed_total += consumed;
+#ifdef HAVE_MMAP
+    if (map != NULL) {
+        const uint64_t page = sysconf(_SC_PAGESIZE);
+        uint64_t old = pos;
+        pos += consumed;
+        // после конца файла дескриптор может быть уже закрыт
+        if (!eof) Resize(old + len, pos + size);
+        len = (uint32_t)min((uint64_t)size, map_size - pos);
+        eof = (pos + len == map_size);
+        *data = map + pos;
+
+        // прочитанные страницы больше не нужны (в страничном кэше они
+        // остаются), а следующие стоит начать читать заранее
+        if (pos / page > old / page)
+            madvise(map + old / page * page, (pos / page - old / page) * page,
+                    MADV_DONTNEED);
+        if (advised < pos + len + kReadAhead / 2 && advised < map_size) {
+            uint64_t from = max(advised, pos) / page * page;
+            advised = min(map_size, pos + len + kReadAhead);
+            madvise(map + from, advised - from, MADV_WILLNEED);
+        }
+        return len;
+    }
+#endif
+
+    memmove(buffer, buffer + consumed, len - consumed);
+    len -= consumed;
+    StatsWait wait(STAT_IO_READ);
+    while (len < size && !eof) {
+        uint32_t n = src->Read(buffer + len, size - len);
+        if (n == 0) eof = true;
+        len += n;
+    }
+    *data = buffer;
+    return len;
+}
+
+// Класс InputThread
+// Представляет собой поток, осуществляющий чтение входного файла,
+// сжатие его методом RLE и разбиением на блоки.
+class InputThread : public BlockReader {
+  public:
+    InputThread(ByteSource *src, int blockSize100k, int bufferSize, int queueSize);
+    ~InputThread();
+    virtual void Run();
+
+    // Память, занимаемая буфером чтения и очередью блоков
+    static uint64_t MemoryUsage(int blockSize100k, int bufferSize, int queueSize) {
+        return bufferSize +
+               (uint64_t)queueSize * ArenaSize(BzipBlockCompressor::BufferSize(blockSize100k));
+    }
+
+  private:
+    ByteSource *src;
+    InputSource source;
+    uint32_t rle_ch, rle_len, crc, nblock, nblockMAX, bufferSize;
+    unsigned char *block;
+
+    // вспомогательная процедура для RLE-сжатия
+    inline void add_pair() {
+        switch (rle_len) {
+          case 1:
+            block[nblock++] = (unsigned char)rle_ch;
+            break;
+          case 2:
+            block[nblock++] = (unsigned char)rle_ch;
+            block[nblock++] = (unsigned char)rle_ch;
+            break;
+          case 3:
+            block[nblock++] = (unsigned char)rle_ch;
+            block[nblock++] = (unsigned char)rle_ch;
+            block[nblock++] = (unsigned char)rle_ch;
+            break;
+          default:
+            block[nblock++] = (unsigned char)rle_ch;
+            block[nblock++] = (unsigned char)rle_ch;
+            block[nblock++] = (unsigned char)rle_ch;
+            block[nblock++] = (unsigned char)rle_ch;
+            block[nblock++] = (unsigned char)(rle_len - 4);
+            break;
+        }
+    }
+};
+
+InputThread::InputThread(ByteSource *src, int blockSize100k, int bufferSize, int queueSize)
+        : BlockReader(BzipBlockCompressor::BufferSize(blockSize100k), queueSize),
+          source(src, bufferSize) {
+    this->src = src;
+    this->bufferSize = bufferSize;
+    nblockMAX = 100000 * blockSize100k - 19;
+}
+
+InputThread::~InputThread() {
+}
+
+// Главный цикл, осуществляющий чтение и RLE-сжатие входного файла.
+// CRC считается не побайтно, а сразу по целым кускам буфера: по всему
+// прочитанному буферу перед чтением следующего и по концу блока перед его
+// отправкой. Блок всегда заканчивается перед последним прочитанным байтом:
+// после добавления в блок очередной серии новая серия имеет длину 1, и
+// проверка заполненности блока происходит перед чтением следующего байта.
+void InputThread::Run() {
+    StatsThread stats("input");
+    const unsigned char *ptr = NULL, *crc_from = NULL, *window = NULL;
+    uint32_t avail = 0, len = 0, ch;
+    bool carry = false;  // последний байт прошлого буфера относится к новому блоку
+    uint64_t start = 0;  // смещение начала текущего блока во входных данных
+
+    nblock = nblockMAX;
+    block = NULL;
+    rle_ch = 256;
+    rle_len = 0;
+
+    while (true) {
+        if (avail == 0) {
+            if (block != NULL) {
+                carry = (nblock >= nblockMAX);
+                crc = CrcUpdate(crc, crc_from, ptr - crc_from - (carry ? 1 : 0));
+            }
+            avail = len = source.Window(&ptr, len, bufferSize);
+            if (avail == 0) break;
+            crc_from = window = ptr;
+        }
+
+        if (nblock >= nblockMAX) {
+            bool first = (block == NULL);
+            if (!first) {
+                if (!carry) crc = CrcUpdate(crc, crc_from, ptr - 1 - crc_from);
+                BZ_FINALISE_CRC(crc);
+                DispatchBlock(nblock, crc, start);
+                // последний прочитанный байт относится уже к новому блоку
+                start = source.Consumed() + (ptr - window) - 1;
+            }
+            PrepareBlock();
+            block = blk->data;
+            nblock = 0;
+            BZ_INITIALISE_CRC(crc);
+            if (carry) {
+                BZ_UPDATE_CRC(crc, rle_ch);
+                carry = false;
+            } else if (!first) {
+                crc_from = ptr - 1;
+            }
+        }
+
+        ch = *ptr++;
+        avail--;
+
+        if (ch != rle_ch && rle_len == 1) {
+            block[nblock++] = rle_ch;
+            rle_ch = ch;
+        } else if (ch == rle_ch && rle_len != 255) {
+            ++rle_len;
+        } else {
+            if (rle_ch != 256) add_pair();
+            rle_ch = ch;
+            rle_len = 1;
+        }
     }
 
+    if (carry) {
+        // Блок заполнен, а последний байт входа ещё не записан. Программа
+        // bzip2 завершает блок сразу после заполнения, и этот байт
+        // попадает в отдельный блок.
+        BZ_FINALISE_CRC(crc);
+        DispatchBlock(nblock, crc, start);
+        start = source.Consumed() - 1;
+        PrepareBlock();
+        block = blk->data;
+        nblock = 0;
+        BZ_INITIALISE_CRC(crc);
+        BZ_UPDATE_CRC(crc, rle_ch);
+    }
     if (rle_ch != 256 && rle_len > 0) add_pair();
 
     if (block != NULL && nblock != 0) {
         BZ_FINALISE_CRC(crc);
-        DispatchBlock();
+        DispatchBlock(nblock, crc, start);
     }
 
-    fclose(fp);
-    fp = NULL;
+    input_size = source.Consumed();
+    src->Close();
+    Finish();
+}
+
+// Длина серии одинаковых байтов, начинающейся с p[0]: не более 255 байтов
+// (как и в bzip2, более длинные серии разбиваются на части) и не дальше end.
+static inline uint32_t RunLength(const unsigned char *p, const unsigned char *end) {
+    const unsigned char *q = p + 1, *lim = (end - p > 255) ? p + 255 : end;
+    while (q < lim && *q == *p) q++;
+    return q - p;
+}
+
+// Число байтов, в которые RLE-сжатие превращает серию длины len
+static inline uint32_t RunCode(uint32_t len) { return len < 4 ? len : 5; }
+
+// Класс ParallelInputThread
+// Вариант InputThread, в котором RLE-сжатие и подсчёт CRC выполняются
+// несколькими потоками одновременно. Входные данные читаются пакетами,
+// каждый пакет делится на части по границам серий, и дальше:
+//  1) каждый поток считает длину RLE-представления своей части;
+//  2) главный поток по этим длинам находит границы bzip2-блоков точно там,
+//     где их поставил бы InputThread, и делит части на сегменты;
+//  3) каждый поток кодирует свои сегменты прямо в буферы блоков и считает
+//     CRC каждого сегмента, которые затем объединяются с помощью CrcShift.
+// Результат побайтно совпадает с результатом InputThread.
+class ParallelInputThread : public BlockReader {
+  public:
+    ParallelInputThread(ByteSource *src, int blockSize100k, int numThreads, int queueSize);
+    ~ParallelInputThread();
+    virtual void Run();
+
+    // Память, занимаемая окном чтения и очередью блоков
+    static uint64_t MemoryUsage(int blockSize100k, int numThreads, int queueSize) {
+        return WindowSize(blockSize100k, numThreads) + (uint64_t)(queueSize + 2 * numThreads + 2) *
+               ArenaSize(BzipBlockCompressor::BufferSize(blockSize100k));
+    }
+
+  private:
+    enum { PHASE_MEASURE, PHASE_ENCODE, PHASE_EXIT };
+    static const uint32_t kMarkSpacing = 4096;
+
+    // сегмент части, попадающий в один bzip2-блок
+    struct Segment {
+        uint32_t start, end;   // границы в buffer
+        InputBlock *blk;
+        uint32_t offset, size; // положение RLE-данных сегмента в блоке
+        uint32_t crc;          // CRC сегмента с нулевым начальным состоянием
+        bool last;             // сегмент завершает блок
+    };
+
+    struct Piece {
+        uint32_t start, end;   // границы части в buffer
+        uint32_t size;         // длина RLE-представления части
+        vector<pair<uint32_t, uint32_t> > marks;  // (позиция, длина RLE до неё)
+        vector<Segment> segs;
+    };
+
+    // Вспомогательный поток, обрабатывающий часть с заданным номером
+    class Helper : public Runnable {
+      public:
+        Helper(ParallelInputThread *owner, int index) : owner(owner), index(index) {}
+        virtual void Run() { owner->HelperLoop(index); }
+      private:
+        ParallelInputThread *owner;
+        int index;
+    };
+
+    ByteSource *src;
+    InputSource source;
+    int numThreads;
+    uint32_t nblockMAX, bufferSize, len;
+    const unsigned char *buffer;  // текущий участок входных данных
+    bool eof;
+    vector<Piece> pieces;
+
+    // текущий незаполненный блок, его длина и состояние его CRC
+    InputBlock *cur;
+    uint32_t cur_nblock, cur_crc;
+
+    pthread_mutex_t team_mutex;
+    pthread_cond_t team_cv, done_cv;
+    int phase, pending;
+    uint64_t generation;
+
+    static uint32_t WindowSize(int blockSize100k, int numThreads) {
+        return numThreads * max(100000 * blockSize100k, 262144) + 256;
+    }
+    uint32_t FindLimit() const;
+    uint32_t FindSync(uint32_t pos, uint32_t limit) const;
+    void Split(uint32_t limit);
+    void RunPhase(int phase);
+    void HelperLoop(int index);
+    void Measure(Piece &piece);
+    void Encode(Segment &seg);
+    uint32_t FindCut(const Piece &piece, uint32_t pos, uint32_t size, uint32_t need) const;
+};
+
+ParallelInputThread::ParallelInputThread(ByteSource *src, int blockSize100k,
+                                         int numThreads, int queueSize)
+        : BlockReader(BzipBlockCompressor::BufferSize(blockSize100k),
+                      queueSize + 2 * numThreads + 2),
+          source(src, WindowSize(blockSize100k, numThreads)) {
+    this->src = src;
+    bufferSize = WindowSize(blockSize100k, numThreads);
+    this->numThreads = numThreads;
+    nblockMAX = 100000 * blockSize100k - 19;
+    pthread_mutex_init(&team_mutex, NULL);
+    pthread_cond_init(&team_cv, NULL);
+    pthread_cond_init(&done_cv, NULL);
+    generation = 0;
+    pending = 0;
+}
+
+ParallelInputThread::~ParallelInputThread() {
+    pthread_cond_destroy(&done_cv);
+    pthread_cond_destroy(&team_cv);
+    pthread_mutex_destroy(&team_mutex);
+}
+
+// Находит в буфере наибольшую позицию, про которую уже точно известно, что
+// в ней начинается новая серия. Серия начинается в позиции j, если
+// buffer[j] != buffer[j-1], а также через каждые 255 байтов от начала
+// серии. Если файл не кончился, последние два байта не используются:
+// InputThread не начинает новый блок перед последним байтом файла.
+uint32_t ParallelInputThread::FindLimit() const {
+    if (eof) return len;
+    if (len < 2) return 0;
+    uint32_t e = len - 2, t = e;
+    while (t > 0 && buffer[t] == buffer[t - 1]) t--;
+    return t + (e - t) / 255 * 255;
+}
+
+// Первая граница серий, начиная с позиции pos
+uint32_t ParallelInputThread::FindSync(uint32_t pos, uint32_t limit) const {
+    if (pos == 0) return 0;
+    while (pos < limit && buffer[pos] == buffer[pos - 1]) pos++;
+    return pos;
+}
+
+// Разбиение буфера [0, limit) на части для вспомогательных потоков
+void ParallelInputThread::Split(uint32_t limit) {
+    uint32_t start = 0;
+    for (int i = 0; i < numThreads; i++) {
+        uint32_t end = (i == numThreads - 1) ? limit :
+            FindSync(max(start, (uint32_t)((uint64_t)limit * (i + 1) / numThreads)), limit);
+        pieces[i].start = start;
+        pieces[i].end = end;
+        pieces[i].segs.clear();
+        start = end;
+    }
+}
+
+void ParallelInputThread::RunPhase(int phase) {
+    pthread_mutex_lock(&team_mutex);
+    this->phase = phase;
+    pending = numThreads - 1;
+    generation++;
+    pthread_cond_broadcast(&team_cv);
+    pthread_mutex_unlock(&team_mutex);
+
+    if (phase == PHASE_EXIT) return;
+    if (phase == PHASE_MEASURE) {
+        Measure(pieces[0]);
+    } else {
+        for (size_t j = 0; j < pieces[0].segs.size(); j++) Encode(pieces[0].segs[j]);
+    }
+
+    StatsWait wait(STAT_WAIT_TEAM);
+    pthread_mutex_lock(&team_mutex);
+    while (pending > 0)
+        pthread_cond_wait(&done_cv, &team_mutex);
+    pthread_mutex_unlock(&team_mutex);
+}
+
+void ParallelInputThread::HelperLoop(int index) {
+    StatsThread stats("rle-helper");
+    uint64_t gen = 0;
+    while (true) {
+        pthread_mutex_lock(&team_mutex);
+        {
+            StatsWait wait(STAT_WAIT_TEAM);
+            while (generation == gen)
+                pthread_cond_wait(&team_cv, &team_mutex);
+        }
+        gen = generation;
+        int ph = phase;
+        pthread_mutex_unlock(&team_mutex);
+
+        if (ph == PHASE_EXIT) return;
+        Piece &piece = pieces[index];
+        if (ph == PHASE_MEASURE) {
+            Measure(piece);
+        } else {
+            for (size_t j = 0; j < piece.segs.size(); j++) Encode(piece.segs[j]);
+        }
+
+        pthread_mutex_lock(&team_mutex);
+        if (--pending == 0) pthread_cond_signal(&done_cv);
+        pthread_mutex_unlock(&team_mutex);
+    }
+}
+
+// Этап 1: подсчёт длины RLE-представления части. Попутно запоминаются
+// отметки (позиция, длина) примерно через каждые kMarkSpacing байтов,
+// чтобы потом быстро находить границы блоков внутри части.
+void ParallelInputThread::Measure(Piece &piece) {
+    const unsigned char *p = buffer + piece.start, *end = buffer + piece.end;
+    const unsigned char *mark = p + kMarkSpacing;
+    uint32_t size = 0;
+    piece.marks.clear();
+    while (p < end) {
+        uint32_t n = RunLength(p, end);
+        size += RunCode(n);
+        p += n;
+        if (p >= mark) {
+            piece.marks.push_back(make_pair((uint32_t)(p - buffer), size));
+            mark = p + kMarkSpacing;
+        }
+    }
+    piece.size = size;
+}
+
+// Находит конец первой серии, после которой длина RLE-представления,
+// отсчитываемая от позиции pos (где она равна size), достигает need.
+uint32_t ParallelInputThread::FindCut(const Piece &piece, uint32_t pos,
+                                      uint32_t size, uint32_t need) const {
+    uint32_t target = size + need;
+    for (size_t i = 0; i < piece.marks.size(); i++) {
+        if (piece.marks[i].second >= target) break;
+        if (piece.marks[i].first > pos) {
+            pos = piece.marks[i].first;
+            size = piece.marks[i].second;
+        }
+    }
+    const unsigned char *end = buffer + piece.end;
+    while (size < target) {
+        uint32_t n = RunLength(buffer + pos, end);
+        size += RunCode(n);
+        pos += n;
+    }
+    return pos;
+}
+
+// Этап 3: RLE-кодирование сегмента в буфер блока и подсчёт его CRC
+void ParallelInputThread::Encode(Segment &seg) {
+    const unsigned char *p = buffer + seg.start, *end = buffer + seg.end;
+    unsigned char *out = seg.blk->data + seg.offset;
+    while (p < end) {
+        uint32_t n = RunLength(p, end);
+        unsigned char ch = *p;
+        switch (n) {
+          case 1:
+            *out++ = ch;
+            break;
+          case 2:
+            *out++ = ch; *out++ = ch;
+            break;
+          case 3:
+            *out++ = ch; *out++ = ch; *out++ = ch;
+            break;
+          default:
+            *out++ = ch; *out++ = ch; *out++ = ch; *out++ = ch;
+            *out++ = (unsigned char)(n - 4);
+            break;
+        }
+        p += n;
+    }
+    seg.crc = CrcUpdate(0, buffer + seg.start, seg.end - seg.start);
+}
+
+void ParallelInputThread::Run() {
+    StatsThread stats("input");
+    vector<Helper *> helpers;
+    vector<pthread_t> handles;
+    pieces.resize(numThreads);
+    for (int i = 1; i < numThreads; i++) {
+        helpers.push_back(new Helper(this, i));
+        handles.push_back(StartThread(helpers.back()));
+    }
+
+    cur = NULL;
+    cur_nblock = cur_crc = 0;
+    uint32_t limit = 0;
+
+    while ((len = source.Window(&buffer, limit, bufferSize)) != 0) {
+        eof = source.Eof();
+        limit = FindLimit();
+        Split(limit);
+        RunPhase(PHASE_MEASURE);
+
+        // Этап 2: расстановка границ блоков. Новый блок начинается после
+        // серии, на которой его длина достигла nblockMAX, как в bzip2 -
+        // даже если после неё во входном файле остался один байт.
+        for (int i = 0; i < numThreads; i++) {
+            Piece &piece = pieces[i];
+            uint32_t pos = piece.start, size = 0;
+            while (pos < piece.end) {
+                if (cur == NULL) {
+                    PrepareBlock();
+                    cur = blk;
+                    cur->offset = source.Consumed() + pos;
+                    cur_nblock = 0;
+                }
+
+                Segment seg;
+                seg.start = pos;
+                seg.blk = cur;
+                seg.offset = cur_nblock;
+                seg.last = false;
+
+                uint32_t need = nblockMAX - cur_nblock;
+                if (piece.size - size < need) {
+                    seg.end = piece.end;
+                    seg.size = piece.size - size;
+                } else {
+                    seg.end = FindCut(piece, pos, size, need);
+                    seg.size = 0;
+                    for (uint32_t p = pos; p < seg.end;) {
+                        uint32_t n = RunLength(buffer + p, buffer + seg.end);
+                        seg.size += RunCode(n);
+                        p += n;
+                    }
+                    seg.last = true;
+                }
+
+                piece.segs.push_back(seg);
+                size += seg.size;
+                pos = seg.end;
+                cur_nblock += seg.size;
+                if (seg.last) cur = NULL;
+            }
+        }
+
+        RunPhase(PHASE_ENCODE);
+
+        // объединение CRC сегментов и отправка заполненных блоков
+        for (int i = 0; i < numThreads; i++) {
+            for (size_t j = 0; j < pieces[i].segs.size(); j++) {
+                Segment &seg = pieces[i].segs[j];
+                if (seg.offset == 0) cur_crc = 0xffffffffUL;
+                cur_crc = CrcShift(cur_crc, seg.end - seg.start) ^ seg.crc;
+                if (seg.last) {
+                    blk = seg.blk;
+                    DispatchBlock(seg.offset + seg.size, ~cur_crc, blk->offset);
+                }
+            }
+        }
+    }
+
+    if (cur != NULL) {
+        blk = cur;
+        DispatchBlock(cur_nblock, ~cur_crc, blk->offset);
+    }
+    input_size = source.Consumed();
+
+    RunPhase(PHASE_EXIT);
+    for (size_t i = 0; i < helpers.size(); i++) {
+        pthread_join(handles[i], NULL);
+        delete helpers[i];
+    }
+
+    src->Close();
+    Finish();
+}
+
+// Максимальный размер сжатого блока в байтах: блок из 900000 символов,
+// каждый из которых закодирован кодом длиной до 20 бит, плюс таблицы.
+const uint32_t kMaxCompressedBlock = 900000 / 8 * 20 + 65536;
+
+// Класс ScanThread
+// Поток, читающий сжатый bzip2-файл при распаковке. Находит сигнатуры
+// блоков по произвольным битовым смещениям и нарезает поток на отдельные
+// блоки, выравнивая их по границе байта. Маркеры конца bzip2-потоков
+// передаются напрямую в OutputThread для проверки CRC потока.
+class ScanThread : public BlockReader {
+  public:
+    ScanThread(ByteSource *src, OutputThread *othread, int bufferSize, int queueSize);
+    ~ScanThread();
+    virtual void Run();
+
+    // Память, занимаемая буфером чтения и очередью блоков
+    static uint64_t MemoryUsage(int bufferSize, int queueSize) {
+        return kMaxCompressedBlock + 2 * (uint64_t)bufferSize + 24 +
+               (uint64_t)queueSize * ArenaSize(kMaxCompressedBlock + 16);
+    }
+
+  private:
+    enum { MAGIC_NONE, MAGIC_BLOCK, MAGIC_END, MAGIC_ERROR };
+
+    ByteSource *src;
+    OutputThread *othread;
+    unsigned char *buf;
+    uint32_t buf_len, buf_cap, bufferSize;
+    uint64_t buf_base;  // смещение (в битах) начала buf во входном файле
+    bool eof;
+
+    void Fill(uint32_t need);
+    void Discard(uint32_t nbytes);
+    int FindMagic(uint64_t start, uint64_t from, uint64_t *pos);
+    bool IsStreamHeader(uint32_t i) const;
+    bool ValidEnd(uint64_t pos);
+    void EmitBlock(uint64_t start, uint64_t end);
+};
+
+ScanThread::ScanThread(ByteSource *src, OutputThread *othread, int bufferSize, int queueSize)
+        : BlockReader(kMaxCompressedBlock + 16, queueSize) {
+    this->src = src;
+    this->othread = othread;
+    this->bufferSize = bufferSize;
+    buf_cap = kMaxCompressedBlock + 2 * bufferSize + 16;
+    buf = xmalloc(buf_cap + 8);
+    buf_len = 0;
+    buf_base = 0;
+    eof = false;
+}
+
+ScanThread::~ScanThread() {
+    free(buf);
+}
+
+// Дочитывает входной файл, пока в буфере не окажется need байтов (или
+// пока не кончится файл или место в буфере). За концом данных в буфере всегда 8 нулевых байтов.
+void ScanThread::Fill(uint32_t need) {
+    while (buf_len < need && !eof) {
+        uint32_t n = min(bufferSize, buf_cap - buf_len);
+        if (n == 0) break;
+        {
+            StatsWait wait(STAT_IO_READ);
+            n = src->Read(buf + buf_len, n);
+        }
+        StatsInput(n);
+        if (n == 0) eof = true;
+        buf_len += n;
+    }
+    memset(buf + buf_len, 0, 8);
+}
+
+// Удаляет из начала буфера nbytes уже обработанных байтов
+void ScanThread::Discard(uint32_t nbytes) {
+    memmove(buf, buf + nbytes, buf_len - nbytes + 8);
+    buf_len -= nbytes;
+    buf_base += 8 * (uint64_t)nbytes;
+}
+
+// Ищет ближайшую сигнатуру блока или маркер конца потока, начиная с бита
+// from. Возвращает тип найденной сигнатуры и её позицию в *pos.
+// start - начало текущего блока, данные до него ещё не выброшены из буфера.
+// MAGIC_ERROR - блок слишком длинный (при проверке и в режиме библиотеки,
+// иначе программа завершается).
+int ScanThread::FindMagic(uint64_t start, uint64_t from, uint64_t *pos) {
+    const uint64_t mask = (1ULL << 48) - 1;
+    for (uint32_t i = from / 8;; i++) {
+        if (i + 8 > buf_len) {
+            Fill(i + 8 + bufferSize);
+            if (i + 6 > buf_len && eof) return MAGIC_NONE;
+        }
+        if (i - start / 8 > kMaxCompressedBlock || (i + 8 > buf_len && !eof)) {
+            othread->Error("Data error: compressed block is too large", buf_base + start);
+            return MAGIC_ERROR;
+        }
+
+        uint64_t w = GetBits(buf, 8 * (uint64_t)i, 56) << 8;
+        for (int s = 0; s < 8; s++) {
+            uint64_t v = (w >> (16 - s)) & mask;
+            if (v != kBlockMagic && v != kEndMagic) continue;
+            uint64_t p = 8 * (uint64_t)i + s;
+            if (p < from || p + 48 > 8 * (uint64_t)buf_len) continue;
+            *pos = p;
+            return v == kBlockMagic ? MAGIC_BLOCK : MAGIC_END;
+        }
+    }
+}
+
+bool ScanThread::IsStreamHeader(uint32_t i) const {
+    return i + 4 <= buf_len && buf[i] == 'B' && buf[i+1] == 'Z' &&
+           buf[i+2] == 'h' && buf[i+3] >= '1' && buf[i+3] <= '9';
+}
+
+// Проверяет, что найденный по позиции pos маркер конца потока настоящий:
+// за ним и его CRC должен следовать заголовок нового потока или конец файла.
+bool ScanThread::ValidEnd(uint64_t pos) {
+    uint32_t next = (pos + 80 + 7) / 8;
+    Fill(next + 4);
+    if (8 * (uint64_t)buf_len < pos + 80) return false;
+    return (eof && buf_len == next) || IsStreamHeader(next);
+}
+
+// Передаёт рабочим потокам блок, занимающий биты [start, end) буфера
+void ScanThread::EmitBlock(uint64_t start, uint64_t end) {
+    PrepareBlock();
+    CopyBits(blk->data, buf, start, end - start);
+    DispatchBlock(end - start, 0, buf_base + start);
+}
+
+// Главный цикл, осуществляющий поиск блоков во входном файле. При
+// проверке (-t) после ошибки в структуре файла поиск прекращается, а уже
+// найденные блоки проверяются.
+void ScanThread::Run() {
+    StatsThread stats("scan");
+    uint64_t pos = 0;
+    bool first = true, garbage = false, failed = false;
+
+    while (!garbage) {
+        // начало очередного bzip2-потока, pos выровнен по байту
+        Discard(pos / 8);
+        pos = 0;
+        Fill(14);
+        if (buf_len == 0 && !first) break;
+        if (!IsStreamHeader(0)) {
+            if (first) {
+                othread->Error("Input is not a bzip2 file", buf_base);
+                break;
+            }
+            fprintf(stderr, "Warning: trailing garbage after end of stream ignored\n");
+            break;
+        }
+        first = false;
+        pos = 32;
+
+        uint64_t magic = GetBits(buf, pos, 48);
+        if (magic == kBlockMagic) {
+            uint64_t start = pos, from = pos + 48, fallback = 0, next;
+            while (true) {
+                int type = FindMagic(start, from, &next);
+                if (type == MAGIC_ERROR) {
+                    failed = true;
+                    break;
+                } else if (type == MAGIC_NONE) {
+                    // если после маркера конца потока идёт мусор, он не
+                    // проходит проверку ValidEnd и найден будет только здесь
+                    if (fallback == 0) {
+                        othread->Error("Unexpected end of compressed file", buf_base + start);
+                        failed = true;
+                        break;
+                    }
+                    fprintf(stderr, "Warning: trailing garbage after end of stream ignored\n");
+                    next = fallback;
+                    garbage = true;
+                } else if (type == MAGIC_END && !ValidEnd(next)) {
+                    if (fallback == 0) fallback = next;
+                    from = next + 1;
+                    continue;
+                } else if (type == MAGIC_BLOCK) {
+                    fallback = 0;
+                }
+
+                EmitBlock(start, next);
+                if (type != MAGIC_BLOCK) break;
+
+                // выбрасываем из буфера уже переданные рабочим данные
+                uint32_t n = next / 8;
+                Discard(n);
+                start = from = next - 8 * (uint64_t)n;
+                from += 48;
+            }
+            if (failed) break;
+            pos = next;
+        } else if (magic != kEndMagic) {
+            othread->Error("Data error: bad block header", buf_base + pos);
+            break;
+        }
+
+        // pos указывает на маркер конца потока
+        Fill(pos / 8 + 11);
+        uint32_t crc = GetBits(buf, pos + 48, 32);
+        othread->Add(++block_id, NULL, 0, crc, OutputThread::REC_STREAM_END,
+                     buf_base + pos);
+        pos = (pos + 80 + 7) / 8 * 8;
+    }
+
+    src->Close();
+    Finish();
+}
+
+#ifdef MPIBZIP2
+// Тип сообщения - в младших трёх битах тега, в остальных битах сообщений
+// TAG_WORK и TAG_RESULTS - номер ячейки окна удалённого процесса
+enum { TAG_INIT = 1, TAG_WORK = 2, TAG_RESULTS = 3, TAG_FINISH = 4 };
+
+static inline int MpiTag(int type, int slot) { return type | (slot << 3); }
+
+// Число блоков, которые удалённый процесс принимает сверх числа своих
+// потоков сжатия: пока один сжатый блок отправляется мастеру, а следующий
+// принимается, все потоки остаются заняты
+const int kMpiSpareBlocks = 2;
+
+// Пауза между опросами запросов MPI и потоков сжатия, мкс
+const int kMpiPollInterval = 200;
+
+// Буфер удалённого процесса для одного блока
+struct MpiSlot {
+    unsigned char *buf;  // принятый блок; сжатые данные пишутся в него же
+    unsigned char *out;  // начало сжатых данных в buf
+    int len;             // длина принятого или отправляемого сообщения
+    int slot;            // номер ячейки окна, назначенный мастером
+    bool sending;        // идёт отправка результата
+};
+
+// Класс SlaveCompressor
+// Поток сжатия удалённого MPI-процесса: берёт из очереди work номера
+// буферов с принятыми блоками, сжимает их и возвращает в очередь done.
+// Вызовы MPI делает только главный поток процесса.
+class SlaveCompressor : public Runnable {
+  public:
+    SlaveCompressor(int blockSize100k, vector<MpiSlot> &slots, BoundedQueue<int> &work,
+                    BoundedQueue<int> &done)
+        : compressor(blockSize100k), slots(slots), work(work), done(done) {}
+
+    virtual void Run() {
+        int i;
+        while (work.Pop(&i)) {
+            MpiSlot &s = slots[i];
+            // блок сжимается прямо в буфере, в котором он был принят
+            unsigned char *own = compressor.SwapInputBuffer(s.buf);
+            compressor.Compress(s.len - 4, unpack32(s.buf + s.len - 4));
+            uint32_t bits = compressor.OutputBits();
+            s.out = (unsigned char *)compressor.OutputBuffer();
+            s.len = (bits + 7) / 8 + 4;
+            pack32(s.out + s.len - 4, bits);
+            s.buf = compressor.SwapInputBuffer(own);
+            done.Push(i);
+        }
+    }
+
+  private:
+    BzipBlockCompressor compressor;
+    vector<MpiSlot> &slots;
+    BoundedQueue<int> &work, &done;
+
+    SlaveCompressor(const SlaveCompressor &);
+    void operator =(const SlaveCompressor &);
+};
+
+// Главный цикл каждого MPI-процесса, не являющегося мастером
+// (с не-нулевым рангом). Блоки сжимают numThreads потоков, а главный
+// поток держит принятыми до numThreads + kMpiSpareBlocks блоков: в
+// сообщении TAG_INIT мастеру сообщается размер окна, и мастер посылает
+// следующий блок, не дожидаясь, пока освободится поток. Приём и отправка
+// неблокирующие; так как потоки сжатия не умеют будить вызов MPI, главный
+// поток опрашивает запросы и очередь готовых блоков с паузой
+// kMpiPollInterval.
+void mpi_slave(MPI_Comm comm, int blockSize100k, int numThreads)
+{
+    int window = numThreads + kMpiSpareBlocks;
+    int bufSize = BzipBlockCompressor::BufferSize(blockSize100k);
+    vector<MpiSlot> slots(window);
+    vector<MPI_Request> req(window, MPI_REQUEST_NULL);
+    vector<MPI_Status> status(window);
+    vector<int> index(window);
+    BoundedQueue<int> work(window), done(window);
+
+    for (int i = 0; i < window; i++) {
+        slots[i].buf = (unsigned char *)xmalloc(bufSize);
+        slots[i].sending = false;
+        MPI_Irecv(slots[i].buf, bufSize, MPI_BYTE, 0, MPI_ANY_TAG, comm, &req[i]);
+    }
+    vector<SlaveCompressor *> threads;
+    vector<pthread_t> handles;
+    for (int i = 0; i < numThreads; i++) {
+        threads.push_back(new SlaveCompressor(blockSize100k, slots, work, done));
+        handles.push_back(StartThread(threads.back()));
+    }
+
+    unsigned char init[4];
+    pack32(init, window);
+    MPI_Send(init, 4, MPI_BYTE, 0, TAG_INIT, comm);
+
+    // busy - число блоков, которые сжимаются или отправляются
+    bool finish = false;
+    int busy = 0;
+    while (!finish || busy > 0) {
+        int count, i;
+        MPI_Testsome(window, &req[0], &count, &index[0], &status[0]);
+        if (count == MPI_UNDEFINED) count = 0;
+        for (int k = 0; k < count; k++) {
+            MpiSlot &s = slots[i = index[k]];
+            if (s.sending) {
+                // результат отправлен, буфер снова готов к приёму
+                s.sending = false;
+                busy--;
+                if (!finish)
+                    MPI_Irecv(s.buf, bufSize, MPI_BYTE, 0, MPI_ANY_TAG, comm, &req[i]);
+            } else if ((status[k].MPI_TAG & 7) == TAG_FINISH) {
+                // блоков больше не будет
+                finish = true;
+            } else {
+                assert((status[k].MPI_TAG & 7) == TAG_WORK);
+                MPI_Get_count(&status[k], MPI_BYTE, &s.len);
+                s.slot = status[k].MPI_TAG >> 3;
+                busy++;
+                work.Push(i);
+            }
+        }
+
+        bool progress = count > 0;
+        while (done.TryPop(&i)) {
+            MpiSlot &s = slots[i];
+            s.sending = true;
+            MPI_Isend(s.out, s.len, MPI_BYTE, 0, MpiTag(TAG_RESULTS, s.slot), comm, &req[i]);
+            progress = true;
+        }
+        if (!progress) usleep(kMpiPollInterval);
+    }
+
+    // оставшиеся приёмы отменяются
+    for (int i = 0; i < window; i++) {
+        if (req[i] == MPI_REQUEST_NULL) continue;
+        MPI_Cancel(&req[i]);
+        MPI_Wait(&req[i], MPI_STATUS_IGNORE);
+    }
+    work.Close();
+    for (int i = 0; i < numThreads; i++) {
+        pthread_join(handles[i], NULL);
+        delete threads[i];
+    }
+    for (int i = 0; i < window; i++) free(slots[i].buf);
+}
+
+// Класс MpiMaster
+// Раздача блоков удалённым процессам в процессе-мастере (ранга 0).
+// Каждому процессу посылается столько блоков, сколько ячеек в его окне;
+// свободные ячейки заполняются по порядку номеров, сначала первые ячейки
+// всех процессов, так что и последние блоки файла распределяются между
+// процессами равномерно. Локальные потоки сжатия процесса-мастера тем
+// временем берут блоки из той же очереди. Объект один на всю программу:
+// удалённые процессы обслуживают все сжимаемые файлы по очереди.
+class MpiMaster {
+  public:
+    MpiMaster(MPI_Comm comm) : comm(comm), ready(0) {
+        MPI_Comm_size(comm, &mpisize);
+        slots.resize(mpisize);
+    }
+
+    // Главный цикл: сжимает блоки конвейера вместе с удалёнными
+    // процессами, пока не кончатся входные данные
+    void Run(BlockReader *ithread, OutputThread *othread);
+
+    // Сообщает удалённым процессам, что блоков больше не будет
+    void Finish();
+
+  private:
+    // Ячейка окна удалённого процесса: обрабатываемый в ней блок, время
+    // его отправки и запрос MPI_Isend
+    struct Slot {
+        InputBlock *block;
+        double sent;
+        MPI_Request req;
+    };
+
+    MPI_Comm comm;
+    int mpisize;
+    int ready;  // число процессов, приславших TAG_INIT
+    vector<vector<Slot> > slots;  // slots[i] - окно процесса ранга i
+    set<pair<int, int> > idle;    // свободные ячейки: (номер ячейки, ранг)
+
+    void ReceiveInit(int from);
+
+    MpiMaster(const MpiMaster &);
+    void operator =(const MpiMaster &);
+};
+
+// Принимает TAG_INIT с размером окна процесса from
+void MpiMaster::ReceiveInit(int from) {
+    unsigned char buf[4];
+    MPI_Recv(buf, 4, MPI_BYTE, from, TAG_INIT, comm, MPI_STATUS_IGNORE);
+    int window = unpack32(buf);
+    Slot empty = { NULL, 0, MPI_REQUEST_NULL };
+    slots[from].assign(window, empty);
+    for (int i = 0; i < window; i++) idle.insert(make_pair(i, from));
+    ready++;
+}
+
+void MpiMaster::Run(BlockReader *ithread, OutputThread *othread) {
+    InputBlock *b, *next_block = NULL;
+    int from, len;
+    bool eof = false;
+    MPI_Status status;
+    if (mpisize == 1) return;
+    StatsThread stats_thread("mpi-master");
+    ThreadStats *stats = CurrentStats();
+    int in_flight = 0;  // общее число блоков, обрабатываемых сейчас удаленно
+
+    while (true) {
+        // получение очередного входного блока, если нужно, и
+        // проверка условия остановки. Пока есть блоки в обработке, ждать
+        // следующего блока нельзя: нужно принимать результаты.
+        if (next_block == NULL && !eof) {
+            if (in_flight == 0) {
+                StatsWait wait(STAT_WAIT_WORK);
+                next_block = ithread->Get();
+                if (next_block == NULL) eof = true;
+            } else {
+                next_block = ithread->TryGet();
+            }
+        }
+        if (next_block == NULL && eof && in_flight == 0) break;
+
+        // отправляем очередной блок в свободную ячейку
+        if (next_block != NULL && !idle.empty()) {
+            int slot = idle.begin()->first;
+            from = idle.begin()->second;
+            idle.erase(idle.begin());
+            b = next_block;  next_block = NULL;
+            Slot &s = slots[from][slot];
+            s.block = b;
+            if (stats != NULL) s.sent = StatsNow();
+            pack32(b->data + b->size, b->crc);
+            in_flight++;
+            MPI_Isend(b->data, b->size + 4, MPI_BYTE, from, MpiTag(TAG_WORK, slot), comm,
+                      &s.req);
+            continue;
+        }
+
+        // получение длины очередного сообщения
+        {
+            StatsWait wait(STAT_WAIT_MPI);
+            MPI_Probe(MPI_ANY_SOURCE, MPI_ANY_TAG, comm, &status);
+        }
+        MPI_Get_elements(&status, MPI_BYTE, &len);
+        from = status.MPI_SOURCE;
+        if (status.MPI_TAG == TAG_INIT) {
+            ReceiveInit(from);
+            continue;
+        }
+
+        // сообщение содержит готовый сжатый блок, он принимается прямо в
+        // буфер результата блока и передаётся в поток OutputThread
+        assert((status.MPI_TAG & 7) == TAG_RESULTS);
+        int slot = status.MPI_TAG >> 3;
+        Slot &s = slots[from][slot];
+        b = s.block;  s.block = NULL;
+        assert(b != NULL && len >= 4);
+        OutputBuffer *buf = b->out;
+        {
+            StatsWait wait(STAT_WAIT_MPI);
+            MPI_Recv(buf->Reserve(len), len, MPI_BYTE, from, status.MPI_TAG,
+                     comm, &status);
+            MPI_Wait(&s.req, &status);
+        }
+        if (stats != NULL) {
+            stats->latency.Add((StatsNow() - s.sent) * 1000);
+            stats->blocks++;
+            stats->bytes_in += b->size;
+            stats->bytes_out += len - 4;
+        }
+        othread->Add(b->id, buf, unpack32(buf->data + len - 4), b->crc,
+                     OutputThread::REC_BLOCK, b->offset);
+        ithread->Put(b);
+        in_flight--;
+        idle.insert(make_pair(slot, from));
+    }
+}
+
+void MpiMaster::Finish() {
+    // процессы, от которых ещё не принято TAG_INIT, тоже его посылают
+    while (ready < mpisize - 1) {
+        MPI_Status status;
+        MPI_Probe(MPI_ANY_SOURCE, TAG_INIT, comm, &status);
+        ReceiveInit(status.MPI_SOURCE);
+    }
+    for (int i = 1; i < mpisize; i++)
+        MPI_Send(NULL, 0, MPI_BYTE, i, TAG_FINISH, comm);
+}
+
+// Раздача блоков удалённым процессам при сжатии (NULL, если их нет)
+static MpiMaster *mpiMaster = NULL;
+
+// Параллельное чтение входного файла через MPI-IO (параметр --mpi-io).
+//
+// Файл делится на участки по kMpiIoRangeBlocks блоков исходных данных.
+// Мастер раздаёт номера участков по порядку всем процессам, включая себя;
+// каждый процесс сам читает свои участки через MPI-IO, выполняет RLE-сжатие
+// и сжатие блоков, и возвращает мастеру только сжатые блоки участка одним
+// фрагментом. Мастер записывает фрагменты в порядке участков в один
+// bzip2-поток. На границе участков блок заканчивается раньше, чем у bzip2,
+// так что результат может отличаться от результата bzip2 (но распаковывается
+// им же).
+enum { TAG_RANGE = 5, TAG_FRAGMENT = 6 };
+
+// Размер участка в блоках
+const int kMpiIoRangeBlocks = 8;
+
+// Заголовок фрагмента: номер участка (8 байтов), длина сжатых данных в
+// битах (8), число блоков (4) и их общая CRC (4)
+const int kFragmentHeader = 24;
+
+static void pack64(unsigned char *p, uint64_t x) {
+    pack32(p, (uint32_t)x);
+    pack32(p + 4, (uint32_t)(x >> 32));
+}
+
+static uint64_t unpack64(unsigned char *p) {
+    return unpack32(p) | (uint64_t)unpack32(p + 4) << 32;
+}
+
+// Участок входного файла и результат его сжатия
+struct FileRange {
+    int64_t index;
+    vector<unsigned char> data;  // исходные байты
+    vector<unsigned char> out;   // заголовок фрагмента и сжатые блоки
+    uint64_t bits;               // длина сжатых блоков в битах
+    uint32_t blocks, crc;        // число блоков и их общая CRC
+
+    // Разбирает заголовок фрагмента в out
+    void ParseHeader() {
+        index = (int64_t)unpack64(&out[0]);
+        bits = unpack64(&out[8]);
+        blocks = unpack32(&out[16]);
+        crc = unpack32(&out[20]);
+    }
+};
+
+// Класс MemorySource: чтение из буфера в памяти
+class MemorySource : public ByteSource {
+  public:
+    MemorySource(const unsigned char *data, size_t size) : data(data), left(size) {}
+
+    virtual uint32_t Read(unsigned char *buf, uint32_t n) {
+        n = (uint32_t)min((size_t)n, left);
+        memcpy(buf, data, n);
+        data += n;
+        left -= n;
+        return n;
+    }
+
+  private:
+    const unsigned char *data;
+    size_t left;
+};
+
+// Класс VectorSink: приёмник, дописывающий данные в конец вектора
+class VectorSink : public MtSink {
+  public:
+    VectorSink(vector<unsigned char> &v) : v(v) {}
+    virtual void Write(const unsigned char *data, size_t n) {
+        v.insert(v.end(), data, data + n);
+    }
+
+  private:
+    vector<unsigned char> &v;
+};
+
+// Класс RangeCompressor
+// Поток, сжимающий участки целиком: RLE-сжатие выполняет InputThread над
+// данными участка, блоки сжимаются по очереди, и их биты дописываются
+// подряд во фрагмент участка.
+class RangeCompressor : public Runnable {
+  public:
+    RangeCompressor(int blockSize100k, BoundedQueue<FileRange *> &work,
+                    BoundedQueue<FileRange *> &done)
+        : blockSize100k(blockSize100k), compressor(blockSize100k), work(work), done(done) {}
+
+    virtual void Run() {
+        FileRange *r;
+        while (work.Pop(&r)) {
+            Compress(r);
+            done.Push(r);
+        }
+    }
+
+  private:
+    static const int kQueueSize = 2;
+
+    int blockSize100k;
+    BzipBlockCompressor compressor;
+    BoundedQueue<FileRange *> &work, &done;
+
+    void Compress(FileRange *r) {
+        MemorySource src(r->data.empty() ? NULL : &r->data[0], r->data.size());
+        InputThread reader(&src, blockSize100k, 1048576, kQueueSize);
+        BufferPool buffers(kQueueSize, 0);  // буферы результата не нужны
+        reader.Connect(&buffers, NULL);
+        pthread_t handle = StartThread(&reader);
+
+        r->out.assign(kFragmentHeader, 0);
+        r->bits = 0;
+        r->blocks = r->crc = 0;
+        {
+            VectorSink sink(r->out);
+            BitStreamWriter writer(&sink, 65536);
+            InputBlock *b;
+            while ((b = reader.Get()) != NULL) {
+                buffers.Put(b->out);
+                // блок сжимается прямо в буфере, в который его записал reader
+                unsigned char *own = compressor.SwapInputBuffer(b->data);
+                compressor.Compress(b->size, b->crc);
+                writer.Write(compressor.OutputBuffer(), compressor.OutputBits());
+                r->bits += compressor.OutputBits();
+                b->data = compressor.SwapInputBuffer(own);
+                r->blocks++;
+                r->crc = ((r->crc << 1) | (r->crc >> 31)) ^ b->crc;
+                reader.Put(b);
+            }
+        }
+        pthread_join(handle, NULL);
+
+        pack64(&r->out[0], r->index);
+        pack64(&r->out[8], r->bits);
+        pack32(&r->out[16], r->blocks);
+        pack32(&r->out[20], r->crc);
+        vector<unsigned char>().swap(r->data);
+    }
+
+    RangeCompressor(const RangeCompressor &);
+    void operator =(const RangeCompressor &);
+};
+
+// Класс MpiIoNode
+// Потоки сжатия участков одного MPI-процесса. Участки читает главный
+// поток (Add), так как MPI вызывает только он.
+class MpiIoNode {
+  public:
+    MpiIoNode(int blockSize100k, int numThreads)
+        : blockSize100k(blockSize100k), work(numThreads + 1), done(numThreads + 1) {
+        for (int i = 0; i < numThreads; i++) {
+            threads.push_back(new RangeCompressor(blockSize100k, work, done));
+            handles.push_back(StartThread(threads.back()));
+        }
+    }
+
+    ~MpiIoNode() {
+        work.Close();
+        for (size_t i = 0; i < threads.size(); i++) {
+            pthread_join(handles[i], NULL);
+            delete threads[i];
+        }
+    }
+
+    // Сколько участков процесс принимает одновременно: пока потоки сжимают
+    // участки, следующий уже прочитан
+    int Window() const { return (int)threads.size() + 1; }
+
+    // Размер участка в байтах
+    uint64_t RangeBytes() const {
+        return (uint64_t)kMpiIoRangeBlocks * (100000 * blockSize100k - 19);
+    }
+
+    // Читает участок index файла fh размером fileSize и ставит в очередь
+    void Add(MPI_File fh, uint64_t fileSize, int64_t index) {
+        FileRange *r = new FileRange();
+        r->index = index;
+        uint64_t from = index * RangeBytes();
+        r->data.resize((size_t)min(RangeBytes(), fileSize - from));
+        MPI_Status status;
+        if (MPI_File_read_at(fh, (MPI_Offset)from, &r->data[0], (int)r->data.size(),
+                             MPI_BYTE, &status) != MPI_SUCCESS)
+            die("Failed to read data from input file\n");
+        int count;
+        MPI_Get_count(&status, MPI_BYTE, &count);
+        if (count != (int)r->data.size()) die("Failed to read data from input file\n");
+        work.Push(r);
+    }
+
+    // Возвращает сжатый участок или NULL, если готовых нет
+    FileRange *TryDone() {
+        FileRange *r;
+        return done.TryPop(&r) ? r : NULL;
+    }
+
+  private:
+    int blockSize100k;
+    BoundedQueue<FileRange *> work, done;
+    vector<RangeCompressor *> threads;
+    vector<pthread_t> handles;
+
+    MpiIoNode(const MpiIoNode &);
+    void operator =(const MpiIoNode &);
+};
+
+// Открывает файл для MPI-IO; вызывается всеми процессами одновременно
+static uint64_t MpiIoOpen(const char *path, MPI_File *fh) {
+    if (MPI_File_open(MPI_COMM_WORLD, (char *)path, MPI_MODE_RDONLY, MPI_INFO_NULL,
+                      fh) != MPI_SUCCESS) {
+        fprintf(stderr, "%s: ", path);
+        die("Can't open input file\n");
+    }
+    MPI_Offset size;
+    MPI_File_get_size(*fh, &size);
+    return size;
+}
+
+// Сжатие файла path в процессе-мастере: раздача участков, приём
+// фрагментов и запись их в out по порядку
+void MpiIoCompress(MpiIoNode *node, const char *path, FILE *out, int blockSize100k) {
+    MPI_File fh;
+    uint64_t size = MpiIoOpen(path, &fh);
+    int64_t num_ranges = (size + node->RangeBytes() - 1) / node->RangeBytes();
+    int mpisize;
+    MPI_Comm_size(MPI_COMM_WORLD, &mpisize);
+
+    FileSink sink(out);
+    BitStreamWriter *writer = new BitStreamWriter(&sink, 4194304);
+    unsigned char magic[4] = { 'B', 'Z', 'h', (unsigned char)('0' + blockSize100k) };
+    writer->Write(magic, 32);
+    uint32_t c_crc = 0;
+
+    // credit[i] - сколько ещё участков можно отдать процессу i; окна
+    // удалённых процессов становятся известны из их сообщений TAG_INIT.
+    // Участков, выданных, но ещё не записанных, не больше max_ahead: так
+    // ограничена память для фрагментов, пришедших раньше предыдущих.
+    vector<int> credit(mpisize, 0);
+    credit[0] = node->Window();
+    int max_ahead = 2 * node->Window() * mpisize;
+    int64_t next_range = 0, next_write = 0;
+    map<int64_t, FileRange *> ready;
+
+    while (next_write < num_ranges) {
+        bool progress = false;
+
+        // раздача участков процессам с наибольшим числом свободных мест
+        while (next_range < num_ranges && next_range - next_write < max_ahead) {
+            int best = 0;
+            for (int i = 1; i < mpisize; i++)
+                if (credit[i] > credit[best]) best = i;
+            if (credit[best] == 0) break;
+            credit[best]--;
+            if (best == 0) {
+                node->Add(fh, size, next_range);
+            } else {
+                unsigned char msg[8];
+                pack64(msg, next_range);
+                MPI_Send(msg, 8, MPI_BYTE, best, TAG_RANGE, MPI_COMM_WORLD);
+            }
+            next_range++;
+            progress = true;
+        }
+
+        // сообщения удалённых процессов: размер окна или готовый фрагмент
+        int flag;
+        MPI_Status status;
+        MPI_Iprobe(MPI_ANY_SOURCE, MPI_ANY_TAG, MPI_COMM_WORLD, &flag, &status);
+        if (flag) {
+            int len;
+            MPI_Get_count(&status, MPI_BYTE, &len);
+            FileRange *r = new FileRange();
+            r->out.resize(len);
+            MPI_Recv(&r->out[0], len, MPI_BYTE, status.MPI_SOURCE, status.MPI_TAG,
+                     MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+            if (status.MPI_TAG == TAG_INIT) {
+                credit[status.MPI_SOURCE] += unpack32(&r->out[0]);
+                delete r;
+            } else {
+                assert(status.MPI_TAG == TAG_FRAGMENT && len >= kFragmentHeader);
+                r->ParseHeader();
+                ready[r->index] = r;
+                credit[status.MPI_SOURCE]++;
+            }
+            progress = true;
+        }
+        FileRange *r;
+        while ((r = node->TryDone()) != NULL) {
+            ready[r->index] = r;
+            credit[0]++;
+            progress = true;
+        }
+
+        // запись готовых фрагментов по порядку
+        map<int64_t, FileRange *>::iterator it;
+        while ((it = ready.find(next_write)) != ready.end()) {
+            r = it->second;
+            for (uint64_t pos = 0; pos < r->bits; pos += 0x40000000) {
+                uint32_t bits = (uint32_t)min(r->bits - pos, (uint64_t)0x40000000);
+                writer->Write(&r->out[kFragmentHeader + pos / 8], bits);
+            }
+            StatsOutput((r->bits + 7) / 8);
+            // общая CRC потока: каждый блок сдвигает её на один бит
+            int k = r->blocks % 32;
+            if (k != 0) c_crc = (c_crc << k) | (c_crc >> (32 - k));
+            c_crc ^= r->crc;
+            delete r;
+            ready.erase(it);
+            next_write++;
+            progress = true;
+        }
+
+        if (!progress) usleep(kMpiPollInterval);
+    }
+
+    // удалённые процессы переходят к следующему файлу
+    for (int i = 1; i < mpisize; i++)
+        MPI_Send(NULL, 0, MPI_BYTE, i, TAG_FINISH, MPI_COMM_WORLD);
+    // ответ TAG_FINISH; ещё не принятое TAG_INIT процесса приходит раньше
+    for (int i = 1; i < mpisize; i++) {
+        MPI_Status status;
+        unsigned char buf[8];
+        do {
+            MPI_Recv(buf, 8, MPI_BYTE, i, MPI_ANY_TAG, MPI_COMM_WORLD, &status);
+        } while (status.MPI_TAG != TAG_FINISH);
+    }
+
+    unsigned char a[10] = {
+        0x17, 0x72, 0x45, 0x38, 0x50, 0x90,
+        (unsigned char)(c_crc >> 24), (unsigned char)(c_crc >> 16),
+        (unsigned char)(c_crc >> 8), (unsigned char)c_crc
+    };
+    writer->Write(a, 80);
+    delete writer;
+    MPI_File_close(&fh);
+}
+
+// Участие удалённого процесса в сжатии файла path: чтение и сжатие
+// участков, которые выдаёт мастер, до сообщения TAG_FINISH
+void MpiIoServe(MpiIoNode *node, const char *path) {
+    MPI_File fh;
+    uint64_t size = MpiIoOpen(path, &fh);
+    unsigned char msg[8];
+    pack32(msg, node->Window());
+    MPI_Send(msg, 4, MPI_BYTE, 0, TAG_INIT, MPI_COMM_WORLD);
+
+    while (true) {
+        bool progress = false;
+        int flag;
+        MPI_Status status;
+        MPI_Iprobe(0, MPI_ANY_TAG, MPI_COMM_WORLD, &flag, &status);
+        if (flag) {
+            MPI_Recv(msg, 8, MPI_BYTE, 0, status.MPI_TAG, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+            if (status.MPI_TAG == TAG_FINISH) break;
+            assert(status.MPI_TAG == TAG_RANGE);
+            node->Add(fh, size, (int64_t)unpack64(msg));
+            progress = true;
+        }
+        FileRange *r;
+        while ((r = node->TryDone()) != NULL) {
+            MPI_Send(&r->out[0], (int)r->out.size(), MPI_BYTE, 0, TAG_FRAGMENT, MPI_COMM_WORLD);
+            delete r;
+            progress = true;
+        }
+        if (!progress) usleep(kMpiPollInterval);
+    }
+
+    // все участки уже отправлены: мастер дождался их перед TAG_FINISH
+    MPI_Send(NULL, 0, MPI_BYTE, 0, TAG_FINISH, MPI_COMM_WORLD);
+    MPI_File_close(&fh);
+}
+#endif
+
+// Распределённое сжатие без MPI (параметры --serve и --workers).
+//
+// Процесс "mtbzip2 --serve <адрес>" принимает соединения от мастеров и
+// сжимает присланные блоки своими -p потоками. Мастер ("mtbzip2 --workers
+// <адрес>,<адрес>...") при запуске соединяется со всеми такими процессами
+// и раздаёт им блоки так же, как MpiMaster: каждый процесс сообщает
+// размер своего окна, и мастер держит у него до стольких блоков
+// одновременно. Если соединение с процессом рвётся, его незавершённые
+// блоки посылаются оставшимся процессам, а когда их не остаётся -
+// сжимаются самим мастером. Процесс, не вернувший блок за kNetBlockTimeout
+// (остановленный или зависший), считается потерянным так же.
+//
+// Проверки подлинности нет, так что --serve на TCP-адресе - только для
+// доверенной сети (см. net.h).
+//
+// Сообщение - заголовок из трёх 32-битных чисел (тип, номер ячейки окна,
+// длина данных) и данные:
+//   NET_HELLO   мастер -> процесс: kNetMagic и размер блока; в поле ячейки
+//               - версия протокола
+//   NET_READY   процесс -> мастер: размер окна
+//   NET_WORK    мастер -> процесс: блок и его CRC (как в TAG_WORK)
+//   NET_RESULT  процесс -> мастер: сжатый блок и его длина в битах
+// Мастер закрывает соединение, когда блоков больше не будет.
+enum { NET_HELLO = 1, NET_READY = 2, NET_WORK = 3, NET_RESULT = 4 };
+
+const uint32_t kNetMagic = 0x5a42544d;  // "MTBZ"
+const uint32_t kNetVersion = 1;
+const int kNetHeader = 12;
+
+// Число блоков, которые процесс принимает сверх числа своих потоков
+// сжатия (см. kMpiSpareBlocks)
+const int kNetSpareBlocks = 2;
+
+// Наибольшее окно, которое мастер принимает от процесса
+const uint32_t kNetMaxWindow = 4096;
+
+// Пауза ожидания результатов, когда у процессов есть свободные ячейки,
+// а следующий входной блок ещё не прочитан, мс
+const int kNetPollInterval = 1;
+
+// Наибольшее время от отправки блока процессу до получения результата, с.
+// Блок ждёт у процесса не больше окна блоков, так что при живом процессе
+// это время на порядки меньше.
+const double kNetBlockTimeout = kNetTimeout;
+
+static bool NetSend(int fd, uint32_t type, uint32_t slot, const void *data, uint32_t len) {
+    unsigned char h[kNetHeader];
+    pack32(h, type);
+    pack32(h + 4, slot);
+    pack32(h + 8, len);
+    return NetWriteAll(fd, h, kNetHeader) && (len == 0 || NetWriteAll(fd, data, len));
+}
+
+static bool NetReceiveHeader(int fd, uint32_t *type, uint32_t *slot, uint32_t *len) {
+    unsigned char h[kNetHeader];
+    if (!NetReadAll(fd, h, kNetHeader)) return false;
+    *type = unpack32(h);
+    *slot = unpack32(h + 4);
+    *len = unpack32(h + 8);
+    return true;
+}
+
+// Класс NetServer
+// Процесс, сжимающий блоки для мастеров (--serve). На каждое соединение
+// запускается поток чтения, который принимает блоки в буферы окна
+// соединения и ставит их в общую очередь; numThreads потоков сжатия берут
+// блоки из очереди, сжимают их прямо в буфере, в котором они приняты, и
+// отправляют результат по тому же соединению.
+class NetServer {
+  public:
+    NetServer(int numThreads);
+
+    // Принимает соединения по адресу addr; не возвращается
+    void Serve(const char *addr);
+
+  private:
+    // Соединение с мастером. Ссылки на него держат поток чтения и каждый
+    // принятый блок; с последней ссылкой соединение закрывается.
+    class Connection {
+      public:
+        int fd;
+        int blockSize100k;
+        vector<unsigned char *> bufs;  // буферы ячеек окна
+
+        Connection(int fd) : fd(fd), blockSize100k(0), refs(1) {
+            pthread_mutex_init(&write_mutex, NULL);
+        }
+        void AddRef() { __atomic_add_fetch(&refs, 1, __ATOMIC_RELAXED); }
+        void Release() {
+            if (__atomic_sub_fetch(&refs, 1, __ATOMIC_ACQ_REL) == 0) delete this;
+        }
+
+        // Сообщения пишут несколько потоков; ошибка записи не важна:
+        // поток чтения увидит, что соединение закрыто
+        void Send(uint32_t type, uint32_t slot, const void *data, uint32_t len) {
+            pthread_mutex_lock(&write_mutex);
+            NetSend(fd, type, slot, data, len);
+            pthread_mutex_unlock(&write_mutex);
+        }
+
+      private:
+        int refs;
+        pthread_mutex_t write_mutex;
+
+        ~Connection() {
+            close(fd);
+            for (size_t i = 0; i < bufs.size(); i++) free(bufs[i]);
+            pthread_mutex_destroy(&write_mutex);
+        }
+        Connection(const Connection &);
+        void operator =(const Connection &);
+    };
+
+    struct Task {
+        Connection *conn;
+        uint32_t slot, len;
+    };
+
+    // Поток чтения соединения; удаляет себя по окончании работы
+    class Reader : public Runnable {
+      public:
+        Reader(NetServer *owner, Connection *conn) : owner(owner), conn(conn) {}
+        virtual void Run();
+
+      private:
+        NetServer *owner;
+        Connection *conn;
+        bool Handshake();
+    };
+
+    class Compressor : public Runnable {
+      public:
+        Compressor(NetServer *owner) : owner(owner) {
+            for (int i = 0; i < 10; i++) compressors[i] = NULL;
+        }
+        virtual void Run();
+
+      private:
+        NetServer *owner;
+        BzipBlockCompressor *compressors[10];
+    };
+
+    int window;
+    BoundedQueue<Task> tasks;
+    vector<Compressor *> threads;
+
+    NetServer(const NetServer &) : tasks(0) {}
+    void operator =(const NetServer &) {}
+};
+
+NetServer::NetServer(int numThreads) : tasks(4096) {
+    window = numThreads + kNetSpareBlocks;
+    for (int i = 0; i < numThreads; i++) {
+        threads.push_back(new Compressor(this));
+        pthread_detach(StartThread(threads.back()));
+    }
+}
+
+void NetServer::Serve(const char *addr) {
+    int fd = NetListen(addr);
+    while (true) {
+        int c = NetAccept(fd);
+        if (c < 0) {
+            // например, исчерпаны дескрипторы: ждём закрытия соединений
+            perror("accept");
+            usleep(100000);
+            continue;
+        }
+        // потоки сжатия не должны навсегда зависнуть на записи результата
+        // остановленному мастеру
+        NetSetTimeout(c, false);
+        pthread_detach(StartThread(new Reader(this, new Connection(c))));
+    }
+}
+
+// Принимает NET_HELLO и отвечает NET_READY
+bool NetServer::Reader::Handshake() {
+    uint32_t type, slot, len;
+    unsigned char hello[8];
+    if (!NetReceiveHeader(conn->fd, &type, &slot, &len) || type != NET_HELLO ||
+        slot != kNetVersion || len != 8 || !NetReadAll(conn->fd, hello, 8) ||
+        unpack32(hello) != kNetMagic)
+        return false;
+    int k = unpack32(hello + 4);
+    if (k < 1 || k > 9) return false;
+    conn->blockSize100k = k;
+    for (int i = 0; i < owner->window; i++)
+        conn->bufs.push_back(xmalloc(BzipBlockCompressor::BufferSize(k)));
+    unsigned char ready[4];
+    pack32(ready, owner->window);
+    conn->Send(NET_READY, 0, ready, 4);
+    return true;
+}
+
+void NetServer::Reader::Run() {
+    if (Handshake()) {
+        // блок вместе с CRC не длиннее блока bzip2
+        uint32_t limit = 100000 * conn->blockSize100k;
+        uint32_t type, slot, len;
+        while (NetReceiveHeader(conn->fd, &type, &slot, &len)) {
+            if (type != NET_WORK || slot >= (uint32_t)owner->window || len < 4 || len > limit) {
+                fprintf(stderr, "Invalid message from master\n");
+                break;
+            }
+            // мастер не посылает блок в занятую ячейку
+            if (!NetReadAll(conn->fd, conn->bufs[slot], len)) break;
+            conn->AddRef();
+            Task t = { conn, slot, len };
+            owner->tasks.Push(t);
+        }
+    } else {
+        fprintf(stderr, "Invalid connection request\n");
+    }
+    conn->Release();
+    delete this;
+}
+
+void NetServer::Compressor::Run() {
+    Task t;
+    while (owner->tasks.Pop(&t)) {
+        Connection *c = t.conn;
+        int k = c->blockSize100k;
+        if (compressors[k] == NULL) compressors[k] = new BzipBlockCompressor(k);
+        BzipBlockCompressor *compressor = compressors[k];
+
+        // блок сжимается в буфере ячейки, и результат отправляется из него
+        // же: следующий блок в эту ячейку придёт только после результата
+        unsigned char *buf = c->bufs[t.slot];
+        unsigned char *own = compressor->SwapInputBuffer(buf);
+        compressor->Compress(t.len - 4, unpack32(buf + t.len - 4));
+        uint32_t bits = compressor->OutputBits(), n = (bits + 7) / 8;
+        unsigned char *out = (unsigned char *)compressor->OutputBuffer();
+        pack32(out + n, bits);
+        c->Send(NET_RESULT, t.slot, out, n + 4);
+        compressor->SwapInputBuffer(own);
+        c->Release();
+    }
+}
+
+// Класс RemoteMaster
+// Раздача блоков процессам, запущенным с --serve (параметр --workers).
+// Как и MpiMaster, объект один на всю программу и забирает блоки из
+// очереди конвейера наравне с локальными потоками сжатия; свободные ячейки
+// заполняются по порядку номеров, сначала первые ячейки всех процессов.
+class RemoteMaster {
+  public:
+    // Соединяется с процессами по адресам addrs; процессы, с которыми
+    // соединиться не удалось, пропускаются
+    RemoteMaster(const vector<string> &addrs, int blockSize100k);
+
+    // Закрывает соединения: процессы узнают, что блоков больше не будет
+    ~RemoteMaster();
+
+    // Сколько блоков могут одновременно сжиматься удалённо
+    int Blocks() const;
+
+    // Главный цикл: сжимает блоки конвейера вместе с удалёнными
+    // процессами, пока не кончатся входные данные
+    void Run(BlockReader *ithread, OutputThread *othread);
+
+  private:
+    struct Slot {
+        InputBlock *block;
+        double sent;  // время отправки блока (StatsNow)
+    };
+    struct Worker {
+        string addr;
+        int fd;               // -1, если соединение потеряно
+        vector<Slot> slots;   // окно процесса
+    };
+
+    int blockSize100k;
+    vector<Worker> workers;
+    set<pair<int, int> > idle;  // свободные ячейки: (номер ячейки, процесс)
+    deque<InputBlock *> retry;  // блоки потерянных процессов
+    int in_flight;              // число блоков в окнах процессов
+    BzipBlockCompressor *local; // сжатие, когда процессов не осталось
+
+    void Send(int w, int slot, InputBlock *b);
+    bool Receive(int w, BlockReader *ithread, OutputThread *othread);
+    void Drop(int w);
+    double DropExpired();
+    void CompressLocally(InputBlock *b, BlockReader *ithread, OutputThread *othread);
+
+    RemoteMaster(const RemoteMaster &);
+    void operator =(const RemoteMaster &);
+};
+
+RemoteMaster::RemoteMaster(const vector<string> &addrs, int blockSize100k)
+    : blockSize100k(blockSize100k), in_flight(0), local(NULL) {
+    for (size_t i = 0; i < addrs.size(); i++) {
+        const char *addr = addrs[i].c_str();
+        int fd = NetConnect(addr);
+        if (fd < 0) continue;
+        NetSetTimeout(fd, true);
+        unsigned char hello[8], ready[4];
+        uint32_t type, slot, len;
+        pack32(hello, kNetMagic);
+        pack32(hello + 4, blockSize100k);
+        if (!NetSend(fd, NET_HELLO, kNetVersion, hello, 8) ||
+            !NetReceiveHeader(fd, &type, &slot, &len) || type != NET_READY || len != 4 ||
+            !NetReadAll(fd, ready, 4) || unpack32(ready) == 0 ||
+            unpack32(ready) > kNetMaxWindow) {
+            fprintf(stderr, "%s: not an mtbzip2 worker\n", addr);
+            close(fd);
+            continue;
+        }
+        Worker w;
+        w.addr = addrs[i];
+        w.fd = fd;
+        Slot empty = { NULL, 0 };
+        w.slots.assign(unpack32(ready), empty);
+        for (size_t j = 0; j < w.slots.size(); j++)
+            idle.insert(make_pair((int)j, (int)workers.size()));
+        workers.push_back(w);
+    }
+    if (workers.empty()) die("No workers available\n");
+}
+
+RemoteMaster::~RemoteMaster() {
+    for (size_t i = 0; i < workers.size(); i++)
+        if (workers[i].fd >= 0) close(workers[i].fd);
+    delete local;
+}
+
+int RemoteMaster::Blocks() const {
+    int n = 0;
+    for (size_t i = 0; i < workers.size(); i++)
+        if (workers[i].fd >= 0) n += (int)workers[i].slots.size();
+    return n;
+}
+
+// Отправляет блок в ячейку slot процесса w. Блок считается принадлежащим
+// ячейке и при ошибке отправки: тогда его вернёт в очередь Drop.
+void RemoteMaster::Send(int w, int slot, InputBlock *b) {
+    Worker &wk = workers[w];
+    Slot &s = wk.slots[slot];
+    s.block = b;
+    s.sent = StatsNow();
+    in_flight++;
+    pack32(b->data + b->size, b->crc);
+    bool ok;
+    {
+        StatsWait wait(STAT_WAIT_NET);
+        ok = NetSend(wk.fd, NET_WORK, slot, b->data, b->size + 4);
+    }
+    if (!ok) Drop(w);
+}
+
+// Принимает результат от процесса w прямо в буфер результата блока и
+// передаёт его в OutputThread. false - соединение потеряно или процесс
+// прислал что-то не то.
+bool RemoteMaster::Receive(int w, BlockReader *ithread, OutputThread *othread) {
+    Worker &wk = workers[w];
+    uint32_t type, slot, len;
+    if (!NetReceiveHeader(wk.fd, &type, &slot, &len)) return false;
+    if (type != NET_RESULT || slot >= wk.slots.size() || wk.slots[slot].block == NULL ||
+        len < 4 || len > BzipBlockCompressor::BufferSize(blockSize100k)) {
+        fprintf(stderr, "%s: invalid message from worker\n", wk.addr.c_str());
+        return false;
+    }
+    Slot &s = wk.slots[slot];
+    InputBlock *b = s.block;
+    OutputBuffer *buf = b->out;
+    {
+        StatsWait wait(STAT_WAIT_NET);
+        if (!NetReadAll(wk.fd, buf->Reserve(len), len)) return false;
+    }
+    uint32_t bits = unpack32(buf->data + len - 4);
+    if (bits > (len - 4) * 8) {
+        fprintf(stderr, "%s: invalid message from worker\n", wk.addr.c_str());
+        return false;
+    }
+    ThreadStats *stats = CurrentStats();
+    if (stats != NULL) {
+        stats->latency.Add((StatsNow() - s.sent) * 1000);
+        stats->blocks++;
+        stats->bytes_in += b->size;
+        stats->bytes_out += len - 4;
+    }
+    s.block = NULL;
+    othread->Add(b->id, buf, bits, b->crc, OutputThread::REC_BLOCK, b->offset);
+    ithread->Put(b);
+    in_flight--;
+    idle.insert(make_pair((int)slot, w));
+    return true;
+}
+
+// Закрывает соединение с процессом w; его блоки будут отправлены заново
+// в порядке номеров, раньше новых блоков
+void RemoteMaster::Drop(int w) {
+    Worker &wk = workers[w];
+    if (wk.fd < 0) return;
+    fprintf(stderr, "Lost connection to worker %s, its blocks will be resent\n",
+            wk.addr.c_str());
+    close(wk.fd);
+    wk.fd = -1;
+    vector<InputBlock *> lost;
+    for (size_t i = 0; i < wk.slots.size(); i++) {
+        idle.erase(make_pair((int)i, w));
+        if (wk.slots[i].block == NULL) continue;
+        lost.push_back(wk.slots[i].block);
+        wk.slots[i].block = NULL;
+        in_flight--;
+    }
+    for (size_t i = 0; i < lost.size(); i++) {
+        deque<InputBlock *>::iterator pos = retry.begin();
+        while (pos != retry.end() && (*pos)->id < lost[i]->id) ++pos;
+        retry.insert(pos, lost[i]);
+    }
+}
+
+// Закрывает соединения с процессами, не вернувшими блок за
+// kNetBlockTimeout. Возвращает время до ближайшего срока оставшихся
+// блоков, с (kNetBlockTimeout, если блоков в обработке нет).
+double RemoteMaster::DropExpired() {
+    double now = StatsNow(), wait = kNetBlockTimeout;
+    for (size_t w = 0; w < workers.size(); w++) {
+        Worker &wk = workers[w];
+        if (wk.fd < 0) continue;
+        double oldest = now;
+        for (size_t i = 0; i < wk.slots.size(); i++)
+            if (wk.slots[i].block != NULL) oldest = min(oldest, wk.slots[i].sent);
+        if (now - oldest >= kNetBlockTimeout) {
+            fprintf(stderr, "%s: worker does not respond\n", wk.addr.c_str());
+            Drop((int)w);
+        } else {
+            wait = min(wait, oldest + kNetBlockTimeout - now);
+        }
+    }
+    return wait;
+}
+
+// Сжимает блок в потоке мастера, как ThreadPool::Worker::Compress
+void RemoteMaster::CompressLocally(InputBlock *b, BlockReader *ithread,
+                                   OutputThread *othread) {
+    if (local == NULL) local = new BzipBlockCompressor(blockSize100k);
+    uint32_t size = b->size, crc = b->crc;
+    b->data = local->SwapInputBuffer(b->data);
+    local->Compress(size, crc);
+    uint32_t bits = local->OutputBits();
+    ThreadStats *stats = CurrentStats();
+    if (stats != NULL) {
+        stats->blocks++;
+        stats->bytes_in += size;
+        stats->bytes_out += (bits + 7) / 8;
+    }
+    memcpy(b->out->Reserve((bits + 7) / 8), local->OutputBuffer(), (bits + 7) / 8);
+    othread->Add(b->id, b->out, bits, crc, OutputThread::REC_BLOCK, b->offset);
+    ithread->Put(b);
+}
+
+void RemoteMaster::Run(BlockReader *ithread, OutputThread *othread) {
+    StatsThread stats_thread("net-master");
+    InputBlock *next_block = NULL;
+    bool eof = false;
+    vector<struct pollfd> fds;
+    vector<int> polled;
+
+    while (true) {
+        // сначала отправляются заново блоки потерянных процессов; пока
+        // есть блоки в обработке, ждать следующего блока нельзя
+        if (next_block == NULL && !retry.empty()) {
+            next_block = retry.front();
+            retry.pop_front();
+        }
+        if (next_block == NULL && !eof) {
+            if (in_flight == 0) {
+                StatsWait wait(STAT_WAIT_WORK);
+                next_block = ithread->Get();
+                if (next_block == NULL) eof = true;
+            } else {
+                next_block = ithread->TryGet();
+            }
+        }
+        if (next_block == NULL && eof && in_flight == 0) break;
+
+        if (next_block != NULL && !idle.empty()) {
+            int slot = idle.begin()->first, w = idle.begin()->second;
+            idle.erase(idle.begin());
+            Send(w, slot, next_block);
+            next_block = NULL;
+            continue;
+        }
+        if (next_block != NULL && in_flight == 0) {
+            // ни одного процесса не осталось
+            CompressLocally(next_block, ithread, othread);
+            next_block = NULL;
+            continue;
+        }
+
+        // ожидание результатов; если есть свободные ячейки, но нет блока,
+        // очередь конвейера снова проверяется через kNetPollInterval.
+        // Ожидание ограничено и сроком самого старого блока в обработке;
+        // блоки процессов, у которых срок истёк, снова в очереди.
+        int sent = in_flight;
+        int timeout = (int)(DropExpired() * 1000) + 1;
+        if (in_flight != sent) continue;
+        if (next_block == NULL && !eof) timeout = min(timeout, kNetPollInterval);
+        fds.clear();
+        polled.clear();
+        for (size_t i = 0; i < workers.size(); i++) {
+            if (workers[i].fd < 0) continue;
+            struct pollfd p = { workers[i].fd, POLLIN, 0 };
+            fds.push_back(p);
+            polled.push_back((int)i);
+        }
+        int n;
+        {
+            StatsWait wait(STAT_WAIT_NET);
+            n = poll(&fds[0], fds.size(), timeout);
+        }
+        if (n < 0 && errno != EINTR) { perror("poll"); die("Can't wait for workers\n"); }
+        for (size_t i = 0; n > 0 && i < fds.size(); i++) {
+            if (fds[i].revents != 0 && !Receive(polled[i], ithread, othread))
+                Drop(polled[i]);
+        }
+    }
+}
+
+// Раздача блоков процессам --serve при сжатии (NULL, если их нет)
+static RemoteMaster *remoteMaster = NULL;
+
+// Параметры конвейера: число потоков, размеры очередей и буферов
+struct PipelineConfig {
+    int numWorkers;      // число локальных потоков сжатия (распаковки)
+    int numRleThreads;   // число потоков RLE-сжатия входных данных
+    int queueSize;       // число буферов для входных блоков
+    int numBuffers;      // число буферов для готовых блоков
+    int inBufferSize;    // размер буфера чтения
+    int outBufferSize;   // размер буфера записи
+    int numJobs;         // число файлов, обрабатываемых одновременно
+};
+
+// Оценка памяти, занимаемой конвейером с параметрами cfg на этой машине.
+// Удалённые MPI-процессы не учитываются, но их результаты принимаются в
+// буферы из общего пула, так что они учитываются в numBuffers. Рабочие
+// потоки общие для всех файлов, а очереди и буферы - у каждого свои.
+uint64_t PipelineMemory(const PipelineConfig &cfg, int blockSize100k, bool decompress) {
+    // код программы и библиотек, стеки потоков и прочие мелочи
+    const uint64_t kFixedMemory = 4 << 20, kThreadMemory = 256 << 10;
+    uint64_t total = kFixedMemory + cfg.numWorkers * kThreadMemory;
+    uint64_t job = cfg.outBufferSize + (cfg.numRleThreads + 2) * kThreadMemory +
+                   UringMemoryUsage();
+    if (decompress) {
+        job += ScanThread::MemoryUsage(cfg.inBufferSize, cfg.queueSize);
+        job += OutputThread::MemoryUsage(cfg.numBuffers, 0);
+        total += cfg.numWorkers * BzipBlockDecompressor::MemoryUsage();
+    } else {
+        if (cfg.numRleThreads > 1)
+            job += ParallelInputThread::MemoryUsage(blockSize100k, cfg.numRleThreads,
+                                                    cfg.queueSize);
+        else
+            job += InputThread::MemoryUsage(blockSize100k, cfg.inBufferSize, cfg.queueSize);
+        job += OutputThread::MemoryUsage(cfg.numBuffers, blockSize100k);
+        total += cfg.numWorkers * BzipBlockCompressor::MemoryUsage(blockSize100k);
+        if (BzipBlockCompressor::verify)
+            total += cfg.numWorkers * BzipBlockDecompressor::MemoryUsage();
+    }
+    return total + cfg.numJobs * job;
+}
+
+// Уменьшает один из параметров конвейера, чтобы сократить расход памяти.
+// Сначала уменьшаются число одновременно обрабатываемых файлов и запасы,
+// нужные только для сглаживания неравномерной скорости стадий, затем
+// число потоков, затем всё до минимума.
+// Возвращает false, если уменьшать больше нечего.
+static bool ShrinkPipeline(PipelineConfig *cfg, int remoteBlocks) {
+    const int kMinIoBuffer = 65536;
+    int busy = cfg->numWorkers + remoteBlocks;  // число одновременно сжимаемых блоков
+
+    if (cfg->numJobs > 1) { cfg->numJobs--; return true; }
+    if (cfg->outBufferSize > 262144) { cfg->outBufferSize /= 2; return true; }
+    if (cfg->inBufferSize > 262144) { cfg->inBufferSize /= 2; return true; }
+    if (cfg->numBuffers > busy + 1) { cfg->numBuffers--; return true; }
+    if (cfg->queueSize > 2) { cfg->queueSize--; return true; }
+    if (cfg->numRleThreads > 1) { cfg->numRleThreads--; return true; }
+    if (cfg->numWorkers > 1) { cfg->numWorkers--; return true; }
+    if (cfg->numBuffers > 1) { cfg->numBuffers--; return true; }
+    if (cfg->queueSize > 1) { cfg->queueSize--; return true; }
+    if (cfg->outBufferSize > kMinIoBuffer) { cfg->outBufferSize /= 2; return true; }
+    if (cfg->inBufferSize > kMinIoBuffer) { cfg->inBufferSize /= 2; return true; }
+    return false;
+}
+
+// Выбирает параметры конвейера. Без ограничения памяти (memLimit = 0)
+// очереди и пул буферов рассчитаны на все потоки с запасом; иначе
+// параметры уменьшаются, пока оценка памяти не уложится в memLimit.
+// Все очереди ограничены, так что при их заполнении производители
+// останавливаются, и больше памяти конвейеру не требуется.
+// numJobs - сколько файлов может обрабатываться одновременно; у каждого
+// свой конвейер с очередями такого же размера. remoteBlocks - сколько
+// блоков могут одновременно сжиматься в удалённых MPI-процессах.
+PipelineConfig PlanPipeline(int blockSize100k, bool decompress, int numWorkers,
+                            int numRleThreads, int remoteBlocks, int numJobs,
+                            uint64_t memLimit) {
+    PipelineConfig cfg;
+    cfg.numJobs = numJobs;
+    cfg.numWorkers = numWorkers;
+    cfg.numRleThreads = decompress ? 1 : numRleThreads;
+    cfg.queueSize = numWorkers + remoteBlocks + 2;
+    // по буферу на каждый обрабатываемый блок и столько же для готовых
+    // блоков, ожидающих записи, пока не готов предшествующий им блок
+    cfg.numBuffers = 2 * (numWorkers + remoteBlocks) + 2;
+    cfg.inBufferSize = 1048576;
+    cfg.outBufferSize = 4194304;
+
+    if (memLimit != 0) {
+        while (PipelineMemory(cfg, blockSize100k, decompress) > memLimit) {
+            if (!ShrinkPipeline(&cfg, remoteBlocks)) {
+                fprintf(stderr, "At least %lluM of memory is needed\n",
+                        (unsigned long long)(PipelineMemory(cfg, blockSize100k,
+                                                            decompress) >> 20) + 1);
+                die("Memory limit is too low\n");
+            }
+        }
+    }
+    return cfg;
+}
+
+// Разбор размера памяти вида 512M: суффиксы K, M, G, без суффикса - байты
+uint64_t ParseSize(const char *s) {
+    char *end;
+    double x = strtod(s, &end);
+    uint64_t mult = 1;
+    switch (toupper(*end)) {
+        case 'K': mult = 1ULL << 10; end++; break;
+        case 'M': mult = 1ULL << 20; end++; break;
+        case 'G': mult = 1ULL << 30; end++; break;
+    }
+    if (toupper(*end) == 'B') end++;
+    if (end == s || *end != 0 || x <= 0) die("Invalid memory size\n");
+    return (uint64_t)(x * mult);
+}
+
+class ThreadPool;
+
+// Класс Pipeline
+// Конвейер сжатия или распаковки одного потока данных: поток чтения,
+// нарезающий данные на блоки, и поток вывода, записывающий готовые блоки
+// в приёмник. Блоки обрабатывают потоки пула ThreadPool, общего для
+// нескольких конвейеров: о каждом прочитанном блоке пулу передаётся
+// задание, и поток пула берёт очередной блок из этого конвейера.
+class Pipeline : public BlockListener {
+  public:
+    // blockSize100k = 0 для распаковки. pool может быть NULL или пустым,
+    // если блоки забирает кто-то другой (MpiMaster). tail: при сжатии -
+    // конец потока, который продолжается новыми блоками (NULL - новый поток).
+    Pipeline(ThreadPool *pool, ByteSource *src, MtSink *sink, int blockSize100k,
+             const PipelineConfig &cfg, const StreamTail *tail = NULL);
+    ~Pipeline();
+
+    void Start();
+    // Ожидает, пока все данные не будут прочитаны и записаны в приёмник
+    void Wait();
+
+    BlockReader *Reader() { return reader; }
+    OutputThread *Output() { return othread; }
+    int BlockSize() const { return blockSize100k; }
+
+    virtual void BlockReady();
+    // Вызывается потоком пула по окончании задания
+    void TaskDone();
+
+  private:
+    ThreadPool *pool;
+    int blockSize100k;
+    BlockReader *reader;
+    OutputThread *othread;
+    pthread_t reader_handle, othread_handle;
+
+    // число заданий, переданных пулу и ещё не выполненных
+    int tasks;
+    pthread_mutex_t mutex;
+    pthread_cond_t done;
+
+    Pipeline(const Pipeline &) : BlockListener() {}
+    void operator =(const Pipeline &) {}
+};
+
+// Класс ThreadPool
+// Рабочие потоки, в цикле получающие задания от конвейеров. Каждый поток
+// сжимает блоки с использованием BzipBlockCompressor (по одному на каждый
+// встретившийся размер блока) или распаковывает их с помощью
+// BzipBlockDecompressor и передаёт результаты в OutputThread конвейера.
+// Данные блока не копируются: буферы блока и компрессора меняются местами.
+// Когда блоков меньше, чем свободных потоков, свободные потоки помогают
+// сортировать блоки тем, кто их сжимает. При размещении с учётом NUMA
+// каждый поток привязан к процессору своего узла, а память компрессоров
+// выделяется самим потоком и поэтому оказывается на том же узле.
+class ThreadPool : public SortHelpers {
+  public:
+    ThreadPool(int numThreads);
+    ~ThreadPool();
+    int NumThreads() const { return (int)workers.size(); }
+    void Submit(Pipeline *p) {
+        Task t = { p, NULL };
+        tasks.Push(t);
+    }
+
+    virtual int Available();
+    virtual void Post(ParallelSort *job, int count);
+
+  private:
+    class Worker : public Runnable {
+      public:
+        Worker(ThreadPool *owner, int index)
+            : owner(owner), index(index), node(NumaWorkerNode(index)), decompressor(NULL) {
+            for (int i = 0; i < 10; i++) {
+                compressors[i] = NULL;
+                buffer_node[i] = node;
+            }
+        }
+        ~Worker() {
+            for (int i = 0; i < 10; i++) delete compressors[i];
+            delete decompressor;
+        }
+        virtual void Run();
+
+      private:
+        ThreadPool *owner;
+        int index, node;
+        BzipBlockCompressor *compressors[10];
+        int buffer_node[10];  // узел входного буфера каждого компрессора
+        BzipBlockDecompressor *decompressor;
+
+        void Compress(Pipeline *p, InputBlock *blk);
+        void Decompress(Pipeline *p, InputBlock *blk);
+    };
+
+    // Задание: очередной блок конвейера или помощь в сортировке блока
+    struct Task {
+        Pipeline *pipeline;
+        ParallelSort *sort;
+    };
+
+    BoundedQueue<Task> tasks;
+    vector<Worker *> workers;
+    vector<pthread_t> handles;
+    int idle;  // число потоков, ожидающих задание
+
+    ThreadPool(const ThreadPool &) : SortHelpers(), tasks(0) {}
+    void operator =(const ThreadPool &) {}
+};
+
+Pipeline::Pipeline(ThreadPool *pool, ByteSource *src, MtSink *sink, int blockSize100k,
+                   const PipelineConfig &cfg, const StreamTail *tail) {
+    this->pool = pool;
+    this->blockSize100k = blockSize100k;
+    tasks = 0;
+    pthread_mutex_init(&mutex, NULL);
+    pthread_cond_init(&done, NULL);
+
+    BitStreamWriter *writer = new BitStreamWriter(sink, cfg.outBufferSize);
+    if (blockSize100k == 0) {
+        othread = new OutputThread(writer, cfg.numBuffers);
+        reader = new ScanThread(src, othread, cfg.inBufferSize, cfg.queueSize);
+    } else {
+        if (tail != NULL)
+            othread = new OutputThread(writer, *tail, cfg.numBuffers);
+        else
+            othread = new OutputThread(writer, blockSize100k, cfg.numBuffers);
+        if (cfg.numRleThreads > 1)
+            reader = new ParallelInputThread(src, blockSize100k, cfg.numRleThreads,
+                                             cfg.queueSize);
+        else
+            reader = new InputThread(src, blockSize100k, cfg.inBufferSize, cfg.queueSize);
+    }
+    bool usePool = pool != NULL && pool->NumThreads() > 0;
+    reader->Connect(othread->Pool(), usePool ? this : NULL);
+}
+
+Pipeline::~Pipeline() {
+    delete reader;
+    delete othread;
+    pthread_cond_destroy(&done);
+    pthread_mutex_destroy(&mutex);
+}
+
+void Pipeline::Start() {
+    reader_handle = StartThread(reader);
+    othread_handle = StartThread(othread);
+}
+
+void Pipeline::Wait() {
+    // ожидаем, пока входные данные не будут полностью прочтены
+    pthread_join(reader_handle, NULL);
+
+    // передача общего числа блоков в объект OutputThread, чтобы он
+    // знал когда нужно остановиться, и ожидаем завершения его работы
+    othread->SetLastBlock(reader->GetBlocksCount(), reader->GetInputSize());
+    pthread_join(othread_handle, NULL);
 
+    // потоки пула обращаются к конвейеру и после записи последнего
+    // блока, поэтому нужно дождаться завершения их заданий
     pthread_mutex_lock(&mutex);
-    pthread_cond_broadcast(&busy_cv);
+    while (tasks != 0) pthread_cond_wait(&done, &mutex);
     pthread_mutex_unlock(&mutex);
 }
 
-void InputThread::PrepareBlock() {
+void Pipeline::BlockReady() {
     pthread_mutex_lock(&mutex);
-    while (free_queue.size() == 0)
-        pthread_cond_wait(&free_cv, &mutex);
-    blk = free_queue.back();
-    free_queue.pop_back();
+    tasks++;
     pthread_mutex_unlock(&mutex);
-
-    block = blk->data;
-    block_id++;
+    pool->Submit(this);
 }
 
-void InputThread::DispatchBlock() {
-    blk->size = nblock;
-    blk->crc = crc;
-    blk->id = block_id;
+void Pipeline::TaskDone() {
     pthread_mutex_lock(&mutex);
-    busy_queue.push(blk);
-    pthread_cond_signal(&busy_cv);
+    if (--tasks == 0) pthread_cond_broadcast(&done);
     pthread_mutex_unlock(&mutex);
 }
 
-// Эта процедура вызывается рабочими потоками для получения очередного блока
-// для сжатия. Если требуется, процедура блокирует выполнения потока пока
-// очередной блок не будет прочтён. При достижении конца файла возвращает NULL.
-InputBlock *InputThread::Get() {
-    InputBlock *b = NULL;
-    pthread_mutex_lock(&mutex);
-    while (busy_queue.size() == 0 && fp != NULL)
-        pthread_cond_wait(&busy_cv, &mutex);
-    if (busy_queue.size() != 0) {
-        b = busy_queue.front();
-        busy_queue.pop();
+ThreadPool::ThreadPool(int numThreads) : tasks(4096), idle(0) {
+    for (int i = 0; i < numThreads; i++) {
+        workers.push_back(new Worker(this, i));
+        handles.push_back(StartThread(workers.back()));
     }
-    pthread_mutex_unlock(&mutex);
-    return b;
 }
 
-// Вызывается рабочими потоками, чтобы "вернуть" блок, ранее
-// полученный ими от процедуры Get()
-void InputThread::Put(InputBlock *b) {
-    pthread_mutex_lock(&mutex);
-    free_queue.push_back(b);
-    pthread_cond_signal(&free_cv);
-    pthread_mutex_unlock(&mutex);
+ThreadPool::~ThreadPool() {
+    tasks.Close();
+    for (size_t i = 0; i < workers.size(); i++) {
+        pthread_join(handles[i], NULL);
+        delete workers[i];
+    }
+    // буферы конвейеров, работавших на этом пуле, больше не понадобятся
+    ArenaTrim();
 }
 
-// Класс WorkerThread
-// Представляет собой рабочий поток, в цикле получающий блоки для сжатия от
-// InputThread, сжимающий их с использованием BzipBlockCompressor и передающий
-// результаты работы в OutputThread для записи в выходной файл.
-class WorkerThread : public Runnable {
-    BzipBlockCompressor *compressor;
-    InputThread *ithread;
-    OutputThread *othread;
+// Заданий столько же, сколько блоков, и каждое задание передаётся после
+// того, как его блок поставлен в очередь, так что TryGet возвращает NULL,
+// только если блок уже забрал кто-то другой (MpiMaster, RemoteMaster).
+int ThreadPool::Available() {
+    // ожидающие потоки сначала разберут уже поставленные задания
+    int n = __atomic_load_n(&idle, __ATOMIC_RELAXED) - (int)tasks.Size();
+    return max(n, 0);
+}
 
-  public:
-    WorkerThread(int blockSize100k, InputThread *ithread, OutputThread *othread) {
-        this->ithread = ithread;
-        this->othread = othread;
-        compressor = new BzipBlockCompressor(blockSize100k);
+void ThreadPool::Post(ParallelSort *job, int count) {
+    Task t = { NULL, job };
+    for (int i = 0; i < count; i++) tasks.Push(t);
+}
+
+void ThreadPool::Worker::Run() {
+    NumaBindThread(node, index);
+    StatsThread stats("worker");
+    Task task;
+    while (true) {
+        {
+            StatsWait wait(STAT_WAIT_WORK);
+            ThreadStats *st = CurrentStats();
+            if (st != NULL) st->depth.Add(owner->tasks.Size());
+            __atomic_add_fetch(&owner->idle, 1, __ATOMIC_RELAXED);
+            bool ok = owner->tasks.Pop(&task);
+            __atomic_sub_fetch(&owner->idle, 1, __ATOMIC_RELAXED);
+            if (!ok) break;
+        }
+        if (task.sort != NULL) {
+            task.sort->Work();
+            task.sort->Release();
+            continue;
+        }
+        Pipeline *p = task.pipeline;
+        InputBlock *blk = p->Reader()->TryGet(node);
+        if (blk != NULL) {
+            if (p->BlockSize() > 0)
+                Compress(p, blk);
+            else
+                Decompress(p, blk);
+        }
+        p->TaskDone();
     }
-    ~WorkerThread() { delete compressor; }
+}
 
-    virtual void Run() {
-        InputBlock *blk;
-        while ((blk = ithread->Get()) != NULL) {
-            uint32_t size = blk->size, crc = blk->crc;
-            uint64_t id = blk->id;
-            memcpy(compressor->InputBuffer(), blk->data, size);
-            ithread->Put(blk);
+void ThreadPool::Worker::Compress(Pipeline *p, InputBlock *blk) {
+    int k = p->BlockSize();
+    if (compressors[k] == NULL) compressors[k] = new BzipBlockCompressor(k, owner, node);
+    BzipBlockCompressor *compressor = compressors[k];
+
+    uint32_t size = blk->size, crc = blk->crc;
+    uint64_t id = blk->id, offset = blk->offset;
+    OutputBuffer *out = blk->out;
+    blk->data = compressor->SwapInputBuffer(blk->data);
+    swap(blk->node, buffer_node[k]);
+    p->Reader()->Put(blk);
+
+    ThreadStats *stats = CurrentStats();
+    double start = stats != NULL ? StatsNow() : 0;
+    compressor->Compress(size, crc);
+
+    uint32_t bits = compressor->OutputBits();
+    if (stats != NULL) {
+        stats->latency.Add((StatsNow() - start) * 1000);
+        stats->blocks++;
+        stats->bytes_in += size;
+        stats->bytes_out += (bits + 7) / 8;
+    }
+    memcpy(out->Reserve((bits + 7) / 8), compressor->OutputBuffer(), (bits + 7) / 8);
+    p->Output()->Add(id, out, bits, crc, OutputThread::REC_BLOCK, offset);
+}
 
-            compressor->Compress(size, crc);
+void ThreadPool::Worker::Decompress(Pipeline *p, InputBlock *blk) {
+    if (decompressor == NULL) decompressor = new BzipBlockDecompressor();
+    OutputBuffer *out = blk->out;
+    ThreadStats *stats = CurrentStats();
+    double start = stats != NULL ? StatsNow() : 0;
+    bool ok = decompressor->Decompress(blk->data, blk->size);
+    if (stats != NULL) {
+        stats->latency.Add((StatsNow() - start) * 1000);
+        stats->blocks++;
+        stats->bytes_in += (blk->size + 7) / 8;
+        if (ok) stats->bytes_out += decompressor->OutputSize();
+    }
+    if (ok) {
+        uint32_t n = decompressor->OutputSize();
+        memcpy(out->Reserve(n + 1), decompressor->OutputBuffer(), n);
+        p->Output()->Add(blk->id, out, n * 8, decompressor->BlockCRC());
+    } else {
+        // сжатые данные передаются в OutputThread, который
+        // попробует склеить их со следующим блоком
+        uint32_t n = (blk->size + 7) / 8;
+        memcpy(out->Reserve(n + 1), blk->data, n);
+        p->Output()->Add(blk->id, out, blk->size, 0,
+                         OutputThread::REC_FAILED, blk->offset);
+    }
+    p->Reader()->Put(blk);
+}
 
-            uint32_t bits = compressor->OutputBits();
-            unsigned char *p = xmalloc((bits + 7) / 8);
-            memcpy(p, compressor->OutputBuffer(), (bits + 7) / 8);
-            othread->Add(id, p, bits, crc);
+// Класс FileJob
+// Сжатие или распаковка одного файла: конвейер вместе с его источником и
+// приёмником. Конвейер запускается в конструкторе, так что несколько
+// файлов могут обрабатываться одновременно на общем пуле потоков.
+class FileJob {
+  public:
+    // fin, fout: открытый входной и выходной файлы
+    // blockSize100k: размер bzip2-блока (от 1 до 9), 0 - распаковка
+    // cfg: размеры очередей и буферов (см. PlanPipeline)
+    // indexPath: куда записать индекс блоков при сжатии (NULL - не нужен)
+    // tail: конец потока в fout, который продолжается новыми блоками (-a);
+    // fout должен быть установлен на байт, в котором начинается его маркер
+    // конца, а индекс в indexPath - описывать этот поток
+    FileJob(ThreadPool *pool, FILE *fin, FILE *fout, int blockSize100k,
+            const PipelineConfig &cfg, const char *indexPath = NULL,
+            const StreamTail *tail = NULL)
+        : source(OpenFileSource(fin)), sink(OpenFileSink(fout)),
+          pipeline(pool, source, sink, blockSize100k, cfg, tail) {
+        if (indexPath != NULL && blockSize100k > 0) {
+            this->indexPath = indexPath;
+            if (tail != NULL) {
+                if (!index.Load(indexPath) ||
+                    index[index.Blocks()].bit_offset != tail->bit_offset ||
+                    index[index.Blocks()].offset != tail->input_size ||
+                    (index.BlockSize() != 0 && index.BlockSize() != blockSize100k))
+                    die("Index doesn't match the compressed file\n");
+                index.RemoveEnd();
+            }
+            index.SetBlockSize(blockSize100k);
+            pipeline.Output()->SetIndex(&index);
         }
+        pipeline.Start();
+    }
+
+    ~FileJob() {
+        delete sink;
+        delete source;
     }
-};
 
+    // Ожидает окончания записи; выходной файл закрывается в деструкторе
+    void Wait() {
 #ifdef MPIBZIP2
-enum { TAG_INIT = 1, TAG_WORK = 2, TAG_RESULTS = 3, TAG_FINISH = 4 };
+        if (pipeline.BlockSize() > 0 && mpiMaster != NULL)
+            mpiMaster->Run(pipeline.Reader(), pipeline.Output());
+#endif
+        if (pipeline.BlockSize() > 0 && remoteMaster != NULL)
+            remoteMaster->Run(pipeline.Reader(), pipeline.Output());
+        pipeline.Wait();
+        if (!indexPath.empty() && !index.Save(indexPath.c_str())) {
+            perror(indexPath.c_str());
+            die("Can't write index file\n");
+        }
+    }
 
-// Главный цикл каждого MPI-процесса, не являющегося мастером
-// (с не-нулевым рангом)
-void mpi_slave(MPI_Comm comm, int blockSize100k)
-{
-    BzipBlockCompressor compressor(blockSize100k);
-    unsigned char *buf = NULL;
-    int err, len = 0, tag = TAG_INIT;
-    MPI_Status status;
+  private:
+    ByteSource *source;
+    MtSink *sink;
+    Pipeline pipeline;
+    BlockIndex index;
+    string indexPath;
 
-    while (true) {
-        // Отправка процессу-мастеру сообщения с результатами работы -
-        // сжатым блоком данных (или сообщения TAG_INIT в первый раз),
-        // и приём очередного сообщения в ответ.
-        err = MPI_Sendrecv(
-            buf, len, MPI_BYTE, 0, tag,
-            compressor.InputBuffer(), blockSize100k*100000,
-            MPI_BYTE, 0, MPI_ANY_TAG, comm, &status);
-        assert(err == 0);
-
-        if (status.MPI_TAG == TAG_FINISH) {
-            // получили сообщение о том, что блоков больше нет, выходим
-            break;
-        } else if (status.MPI_TAG == TAG_WORK) {
-            // сообщение содержит очередной блок, который нужно сжать
-            MPI_Get_elements(&status, MPI_BYTE, &len);
-            buf = compressor.InputBuffer();
-            compressor.Compress(len - 4, unpack32(buf + len - 4));
+    FileJob(const FileJob &);
+    void operator =(const FileJob &);
+};
+
+// Реализация интерфейса библиотеки (mtbzip2.h)
+
+// Класс BufferSink
+// Приёмник, накапливающий готовые данные до вызова MtStream::Read. Когда
+// непрочитанных данных больше MtStream::kMaxUnread, поток вывода ждёт в
+// Write, пока их не прочитают, а источник конвейера перестаёт ждать места
+// во входной очереди: вызывающий, который сам читает результат, получает
+// управление обратно.
+class BufferSink : public MtSink {
+  public:
+    BufferSink(ChannelSource *source)
+        : source(source), pos(0), stalled(false), ended(false), discard(false) {
+        pthread_mutex_init(&mutex, NULL);
+        pthread_cond_init(&cv, NULL);
+    }
+    ~BufferSink() {
+        pthread_cond_destroy(&cv);
+        pthread_mutex_destroy(&mutex);
+    }
+
+    virtual void Write(const unsigned char *data, size_t n) {
+        pthread_mutex_lock(&mutex);
+        while (data_.size() - pos > MtStream::kMaxUnread && !discard) {
+            if (!stalled) source->Stall(true);
+            stalled = true;
+            pthread_cond_wait(&cv, &mutex);
+        }
+        if (!discard) {
+            // прочитанное начало буфера удаляется, когда оно становится
+            // больше непрочитанного остатка
+            if (pos > data_.size() - pos) {
+                data_.erase(data_.begin(), data_.begin() + pos);
+                pos = 0;
+            }
+            data_.insert(data_.end(), data, data + n);
+        }
+        pthread_cond_broadcast(&cv);
+        pthread_mutex_unlock(&mutex);
+    }
 
-            // подготовка сообщения-ответа
-            buf = (unsigned char *)compressor.OutputBuffer();
-            len = (compressor.OutputBits() + 7) / 8 + 4;
-            pack32(buf + len - 4, compressor.OutputBits());
-            tag = TAG_RESULTS;
+    // Забирает до n байтов; если wait, ждёт данных, пока не вызван End
+    size_t Read(unsigned char *buf, size_t n, bool wait) {
+        pthread_mutex_lock(&mutex);
+        while (wait && data_.size() == pos && !ended) pthread_cond_wait(&cv, &mutex);
+        n = min(n, data_.size() - pos);
+        if (n != 0) memcpy(buf, &data_[pos], n);
+        pos += n;
+        if (stalled && data_.size() - pos <= MtStream::kMaxUnread) {
+            stalled = false;
+            source->Stall(false);
+            pthread_cond_broadcast(&cv);
         }
+        pthread_mutex_unlock(&mutex);
+        return n;
+    }
+
+    // Все данные записаны
+    void End() {
+        pthread_mutex_lock(&mutex);
+        ended = true;
+        pthread_cond_broadcast(&cv);
+        pthread_mutex_unlock(&mutex);
+    }
+
+    // Результат больше не нужен: дальнейшие данные отбрасываются
+    void Discard() {
+        pthread_mutex_lock(&mutex);
+        discard = true;
+        pthread_cond_broadcast(&cv);
+        pthread_mutex_unlock(&mutex);
+    }
+
+  private:
+    ChannelSource *source;
+    vector<unsigned char> data_;
+    size_t pos;
+    bool stalled;  // поток вывода ждёт, пока данные прочитают
+    bool ended, discard;
+    pthread_mutex_t mutex;
+    pthread_cond_t cv;
+
+    BufferSink(const BufferSink &) : MtSink() {}
+    void operator =(const BufferSink &) {}
+};
+
+// Класс PipelineWaiter
+// Дожидается окончания работы конвейера после MtStream::Finish, когда
+// приёмник не задан: сам MtStream ждать не может, потому что результат
+// в это время забирается вызовами Read.
+class PipelineWaiter : public Runnable {
+  public:
+    PipelineWaiter(Pipeline *pipeline, BufferSink *buffer)
+        : pipeline(pipeline), buffer(buffer) {
+        handle = StartThread(this);
+    }
+    virtual void Run() {
+        pipeline->Wait();
+        buffer->End();
     }
+    void Join() { pthread_join(handle, NULL); }
+
+  private:
+    Pipeline *pipeline;
+    BufferSink *buffer;
+    pthread_t handle;
+
+    PipelineWaiter(const PipelineWaiter &) : Runnable() {}
+    void operator =(const PipelineWaiter &) {}
+};
+
+MtThreadPool::MtThreadPool(int numThreads) {
+    pool = new ThreadPool(numThreads > 0 ? numThreads : DetectCPUs());
 }
 
-// Главный цикл MPI программы-мастера (ранга 0), общающегося c удалёнными
-// процессами.
-void mpi_master(MPI_Comm comm, InputThread *ithread, OutputThread *othread) {
-    InputBlock *b, *next_block = NULL;
-    unsigned char *buffer, small_buf[10];
-    int from, len, mpisize;
-    MPI_Status status;
-    MPI_Comm_size(comm, &mpisize);
-    if (mpisize == 1) return;
+MtThreadPool::~MtThreadPool() {
+    delete pool;
+}
 
-    // slaves[i] = текущий блок, обрабатываемый процессом ранга i
-    vector<InputBlock *> slaves(mpisize);
-    int in_flight = 0;  // общее число блоков, обрабатываемых сейчас удаленно
-    vector<MPI_Request> req(mpisize);
+int MtThreadPool::NumThreads() const {
+    return pool->NumThreads();
+}
 
-    while (true) {
-        // получение очередного входного блока, если нужно, и
-        // проверка условия остановки.
-        if (next_block == NULL) {
-            next_block = ithread->Get();
-            if (next_block == NULL && in_flight == 0) break;
-        }
+const size_t MtStream::kMaxUnread;
 
-        // получение длины очередного сообщения
-        MPI_Probe(MPI_ANY_SOURCE, MPI_ANY_TAG, comm, &status);
-        MPI_Get_elements(&status, MPI_BYTE, &len);
+MtStream::MtStream(MtThreadPool *pool, int blockSize100k, MtSink *sink) {
+    pipeline = NULL;
+    source = NULL;
+    buffer = NULL;
+    waiter = NULL;
+    finished = false;
+    error = NULL;
+    if (blockSize100k < 0 || blockSize100k > 9) {
+        error = "Invalid block size";
+        return;
+    }
+    bool decompress = blockSize100k == 0;
+    PipelineConfig cfg = PlanPipeline(blockSize100k, decompress, pool->NumThreads(),
+                                      1, 0, 1, 0);
+    source = new ChannelSource(1048576);
+    buffer = sink == NULL ? new BufferSink(source) : NULL;
+    pipeline = new Pipeline(pool->pool, source, sink != NULL ? sink : buffer,
+                            blockSize100k, cfg);
+    pipeline->Output()->KeepErrors();
+    pipeline->Start();
+}
 
-        // приём сообщения от удаленного процесса
-        buffer = (status.MPI_TAG == TAG_RESULTS ? xmalloc(len) : small_buf);
-        MPI_Recv(buffer, len, MPI_BYTE, MPI_ANY_SOURCE, MPI_ANY_TAG,
-                comm, &status);
-        from = status.MPI_SOURCE;
-        MPI_Get_elements(&status, MPI_BYTE, &len);
+MtStream::~MtStream() {
+    // непрочитанный результат не нужен, и поток вывода не должен его ждать
+    if (buffer != NULL) buffer->Discard();
+    Finish();
+    if (waiter != NULL) waiter->Join();
+    delete waiter;
+    delete pipeline;
+    delete source;
+    delete buffer;
+}
 
-        // если в сообщении содержится готовый сжатый блок,
-        // передаём его в поток OutputThread
-        if (status.MPI_TAG == TAG_RESULTS) {
-            MPI_Wait(&req[from], &status);
-            b = slaves[from];  slaves[from] = NULL;
-            assert(b != NULL && len >= 4);
-            othread->Add(b->id, buffer, unpack32(buffer + len - 4), b->crc);
-            ithread->Put(b);
-            in_flight--;
-        }
+size_t MtStream::Write(const void *data, size_t n) {
+    if (finished && error == NULL) error = "MtStream::Write called after Finish";
+    if (Error() != NULL) return 0;
+    return source->Write((const unsigned char *)data, n);
+}
 
-        // отправляем сообщение с очередным блоком, который нужно сжать
-        if (next_block != NULL) {
-            b = next_block;  next_block = NULL;  slaves[from] = b;
-            pack32(b->data + b->size, b->crc);
-            in_flight++;
-            MPI_Isend(b->data,b->size+4,MPI_BYTE,from,TAG_WORK,comm,&req[from]);
+bool MtStream::Finish() {
+    if (!finished && pipeline != NULL) {
+        source->CloseInput();
+        if (buffer != NULL)
+            waiter = new PipelineWaiter(pipeline, buffer);
+        else
+            pipeline->Wait();
+    }
+    finished = true;
+    return Error() == NULL;
+}
+
+size_t MtStream::Read(void *buf, size_t n) {
+    return buffer != NULL ? buffer->Read((unsigned char *)buf, n, finished) : 0;
+}
+
+const char *MtStream::Error() const {
+    if (error != NULL || pipeline == NULL) return error;
+    return pipeline->Output()->FirstError();
+}
+
+#ifndef MTBZIP2_LIBRARY
+
+// Имя распакованного файла: file.bz2 -> file, file.tbz2 -> file.tar
+string DecompressedName(const string &s) {
+    const char *suffixes[][2] = {
+        { ".bz2", "" }, { ".bz", "" }, { ".tbz2", ".tar" }, { ".tbz", ".tar" }
+    };
+    for (int i = 0; i < 4; i++) {
+        string suf = suffixes[i][0];
+        if (s.size() > suf.size() &&
+            s.compare(s.size() - suf.size(), suf.size(), suf) == 0)
+            return s.substr(0, s.size() - suf.size()) + suffixes[i][1];
+    }
+    return s + ".out";
+}
+
+// Число файлов, которые обрабатываются одновременно
+const int kMaxJobs = 4;
+
+// Добавляет в files обычные файлы из каталога dir и его подкаталогов:
+// при сжатии - ещё не сжатые, при распаковке - только сжатые (.bz2 и т.п.).
+// Символические ссылки пропускаются.
+void ListFiles(const string &dir, bool decompress, vector<string> &files) {
+    DIR *d = opendir(dir.c_str());
+    if (d == NULL) { perror(dir.c_str()); return; }
+    vector<string> names;
+    struct dirent *e;
+    while ((e = readdir(d)) != NULL) {
+        if (strcmp(e->d_name, ".") != 0 && strcmp(e->d_name, "..") != 0)
+            names.push_back(e->d_name);
+    }
+    closedir(d);
+    sort(names.begin(), names.end());
+
+    string prefix = dir[dir.size() - 1] == '/' ? dir : dir + "/";
+    for (size_t i = 0; i < names.size(); i++) {
+        string path = prefix + names[i];
+        struct stat st;
+        if (lstat(path.c_str(), &st) != 0) continue;
+        bool compressed = DecompressedName(path) != path + ".out";
+        if (S_ISDIR(st.st_mode))
+            ListFiles(path, decompress, files);
+        else if (S_ISREG(st.st_mode) && compressed == decompress)
+            files.push_back(path);
+    }
+}
+
+// Сжатие (blockSize100k > 0) или распаковка списка файлов. До cfg.numJobs
+// файлов обрабатываются одновременно; следующий файл открывается, когда
+// закончена запись самого раннего из них. Входной файл удаляется после
+// того, как записан результат. writeIndex: при сжатии записать индекс
+// блоков каждого файла в file.bz2.idx.
+void ProcessFiles(ThreadPool *pool, const vector<string> &files, int blockSize100k,
+                  const PipelineConfig &cfg, bool keep, bool writeIndex) {
+    vector<FileJob *> jobs(files.size(), (FileJob *)NULL);
+    size_t done = 0;
+    for (size_t i = 0; i <= files.size(); i++) {
+        // ожидание файлов, запущенных раньше, если мест больше нет
+        // или новых файлов не осталось
+        while (done < i && (i == files.size() || i - done >= (size_t)cfg.numJobs)) {
+            jobs[done]->Wait();
+            delete jobs[done];
+            if (!keep) unlink(files[done].c_str());
+            done++;
         }
+        if (i == files.size()) break;
+
+        string s = files[i];
+        string t = blockSize100k == 0 ? DecompressedName(s) : s + ".bz2";
+        FILE *f = fopen(s.c_str(), "rb");
+        if (f == NULL) { perror("fopen"); die("Can't open input file\n"); }
+        FILE *g = fopen(t.c_str(), "wb");
+        if (g == NULL) {perror("fopen");die("Can't create output file\n");}
+        string idx = t + ".idx";
+        jobs[i] = new FileJob(pool, f, g, blockSize100k, cfg,
+                              writeIndex ? idx.c_str() : NULL);
     }
+}
 
-    // сообщаем всем удаленным процессам, что блоков больше не будет
-    for (int i = 1; i < mpisize; i++)
-        MPI_Send(small_buf, 0, MPI_BYTE, i, TAG_FINISH, comm);
+// Класс SpliceSource
+// Источник для распаковки участка bzip2-файла: поток из заголовка файла
+// header, битов [from, to) файла fp (идущих подряд целых блоков) и маркера
+// конца потока с CRC crc. Биты блоков сдвигаются к границе байта по мере
+// чтения. Файл закрывается в деструкторе.
+class SpliceSource : public ByteSource, private MtSink {
+  public:
+    SpliceSource(FILE *fp, const unsigned char *header, uint64_t from, uint64_t to,
+                 uint32_t crc);
+    ~SpliceSource();
+    virtual uint32_t Read(unsigned char *buf, uint32_t n);
+
+  private:
+    static const uint32_t kChunk = 1 << 20;
+
+    FILE *fp;
+    BitStreamWriter *writer;  // NULL, когда весь поток записан в ready
+    unsigned char *chunk;
+    uint64_t pos, to;
+    uint32_t crc;
+    vector<unsigned char> ready;  // готовые байты потока
+    size_t ready_pos;
+
+    // сюда BitStreamWriter передаёт выровненные байты
+    virtual void Write(const unsigned char *data, size_t n) {
+        ready.insert(ready.end(), data, data + n);
+    }
+    void Refill();
+
+    SpliceSource(const SpliceSource &);
+    void operator =(const SpliceSource &);
+};
+
+SpliceSource::SpliceSource(FILE *fp, const unsigned char *header, uint64_t from,
+                           uint64_t to, uint32_t crc)
+    : fp(fp), pos(from), to(to), crc(crc), ready_pos(0) {
+    chunk = xmalloc(kChunk);
+    if (fseeko(fp, from / 8, SEEK_SET) != 0) {
+        perror("fseek");
+        die("Failed to read data from input file\n");
+    }
+    writer = new BitStreamWriter(this, 65536);
+    writer->Write(header, 32);
 }
-#endif
 
-// Процедура для сжатия отдельного файла.
-// fin, fout: открытый входной и выходной файлы
-// blockSize100k: размер bzip2-блока (от 1 до 9)
-// numLocalWorkers: число локальных параллельных потоков для сжатия
-void Compress(FILE *fin, FILE *fout, int blockSize100k, int numLocalWorkers) {
-    const int kInBuf = 1048576, kOutBuf = 1048576;
-    int mpisize = 0;
-#ifdef MPIBZIP2
-    MPI_Comm_size(MPI_COMM_WORLD, &mpisize);
-#endif
+SpliceSource::~SpliceSource() {
+    delete writer;
+    free(chunk);
+    fclose(fp);
+}
+
+// Дописывает в ready очередной кусок потока
+void SpliceSource::Refill() {
+    if (pos == to) {
+        unsigned char a[10] = {
+            0x17, 0x72, 0x45, 0x38, 0x50, 0x90,
+            (unsigned char)(crc >> 24), (unsigned char)(crc >> 16),
+            (unsigned char)(crc >> 8), (unsigned char)crc
+        };
+        writer->Write(a, 80);
+        // последний неполный байт записывается при удалении
+        delete writer;
+        writer = NULL;
+        return;
+    }
+    // все куски, кроме первого, начинаются на границе байта
+    uint32_t n = (uint32_t)min((uint64_t)kChunk, (to + 7) / 8 - pos / 8);
+    if (fread(chunk, 1, n, fp) != n) {
+        if (ferror(fp)) perror("fread");
+        die("Failed to read data from input file\n");
+    }
+    uint32_t skip = pos % 8;
+    uint64_t bits = min((uint64_t)n * 8 - skip, to - pos);
+    pos += bits;
+    if (skip != 0) {
+        unsigned char b = chunk[0] << skip;
+        uint32_t k = (uint32_t)min((uint64_t)(8 - skip), bits);
+        writer->Write(&b, k);
+        if (bits > k) writer->Write(chunk + 1, bits - k);
+    } else {
+        writer->Write(chunk, bits);
+    }
+}
+
+uint32_t SpliceSource::Read(unsigned char *buf, uint32_t n) {
+    while (ready_pos == ready.size() && writer != NULL) {
+        ready.clear();
+        ready_pos = 0;
+        Refill();
+    }
+    n = (uint32_t)min((size_t)n, ready.size() - ready_pos);
+    memcpy(buf, &ready[0] + ready_pos, n);
+    ready_pos += n;
+    return n;
+}
+
+// Приёмник, передающий дальше только байты [skip, skip + length)
+class RangeSink : public MtSink {
+  public:
+    RangeSink(MtSink *out, uint64_t skip, uint64_t length)
+        : out(out), skip(skip), length(length) {}
 
-    InputThread ithread(fin, blockSize100k, kInBuf, numLocalWorkers+mpisize+2);
-    OutputThread othread(new BitStreamWriter(fout, kOutBuf), blockSize100k);
+    virtual void Write(const unsigned char *data, size_t n) {
+        size_t k = (size_t)min((uint64_t)n, skip);
+        data += k;
+        n -= k;
+        skip -= k;
+        n = (size_t)min((uint64_t)n, length);
+        if (n != 0) out->Write(data, n);
+        length -= n;
+    }
+
+  private:
+    MtSink *out;
+    uint64_t skip, length;
+};
 
-    // запуск потоков ввода/вывода на выполнение
-    pthread_t ithread_handle = StartThread(&ithread);
-    pthread_t othread_handle = StartThread(&othread);
+// Чтение 80 битов файла (сигнатура и CRC), начиная с бита bit
+static bool ReadBitsAt(FILE *f, uint64_t bit, unsigned char *buf) {
+    memset(buf, 0, 16);
+    size_t need = (bit % 8 + 80 + 7) / 8;
+    return fseeko(f, bit / 8, SEEK_SET) == 0 && fread(buf, 1, need, f) == need;
+}
 
-    // запуск локальных потоков
-    vector<WorkerThread *> workers;
-    for (int i = 0; i < numLocalWorkers; i++) {
-        workers.push_back(new WorkerThread(blockSize100k, &ithread, &othread));
-        pthread_detach(StartThread(workers.back()));
+// Распаковка байтов [from, to) исходных данных сжатого файла path по его
+// индексу path.idx (параметр --range). Читаются и распаковываются только
+// блоки, которые содержат эти байты: они вырезаются из файла в отдельный
+// bzip2-поток, который распаковывается обычным конвейером. Результат
+// пишется на стандартный выход.
+void ExtractRange(ThreadPool *pool, const string &path, uint64_t from, uint64_t to,
+                  const PipelineConfig &cfg) {
+    BlockIndex index;
+    string idx = path + ".idx";
+    if (!index.Load(idx.c_str())) {
+        fprintf(stderr, "%s: missing or invalid index\n", idx.c_str());
+        die("Can't read index file\n");
     }
+    FILE *f = fopen(path.c_str(), "rb");
+    if (f == NULL) { perror("fopen"); die("Can't open input file\n"); }
 
-#ifdef MPIBZIP2
-    mpi_master(MPI_COMM_WORLD, &ithread, &othread);
-#endif
+    // индекс должен описывать именно этот файл: один поток, который
+    // кончается маркером конца по смещению из индекса
+    size_t n = index.Blocks();
+    unsigned char header[4], buf[16];
+    struct stat st;
+    if (fstat(fileno(f), &st) != 0 ||
+        (uint64_t)st.st_size != (index[n].bit_offset + 80 + 7) / 8 ||
+        fread(header, 1, 4, f) != 4 || memcmp(header, "BZh", 3) != 0 ||
+        !ReadBitsAt(f, index[n].bit_offset, buf) ||
+        GetBits(buf, index[n].bit_offset % 8, 48) != kEndMagic)
+        die("Index doesn't match the compressed file\n");
 
-    // ожидаем, пока входной файл не будет полностью прочтён
-    pthread_join(ithread_handle, NULL);
+    to = min(to, index[n].offset);
+    if (from >= to) {
+        fclose(f);
+        return;
+    }
+    size_t first = index.Find(from), last = index.Find(to - 1);
 
-    // передача общего числа блоков в объект OutputThread, чтобы он
-    // знал когда нужно остановиться, и ожидаем завершения его работы
-    othread.SetLastBlock(ithread.GetBlocksCount());
-    pthread_join(othread_handle, NULL);
+    // CRC потока из выбранных блоков; заодно проверяются их сигнатуры
+    uint32_t crc = 0;
+    for (size_t i = first; i <= last; i++) {
+        uint64_t bit = index[i].bit_offset;
+        if (!ReadBitsAt(f, bit, buf) || GetBits(buf, bit % 8, 48) != kBlockMagic)
+            die("Index doesn't match the compressed file\n");
+        crc = ((crc << 1) | (crc >> 31)) ^ (uint32_t)GetBits(buf, bit % 8 + 48, 32);
+    }
+
+    SpliceSource source(f, header, index[first].bit_offset, index[last + 1].bit_offset, crc);
+    FileSink out(stdout);
+    RangeSink sink(&out, from - index[first].offset, to - from);
+    Pipeline pipeline(pool, &source, &sink, 0, cfg);
+    pipeline.Start();
+    pipeline.Wait();
+}
+
+// Разбор диапазона вида <from>-<to> или <from>- (до конца данных)
+static bool ParseRange(const char *s, uint64_t *from, uint64_t *to) {
+    char *end;
+    if (!isdigit(*s)) return false;
+    *from = strtoull(s, &end, 10);
+    if (*end++ != '-') return false;
+    if (*end == 0) {
+        *to = (uint64_t)(-1);
+        return true;
+    }
+    if (!isdigit(*end)) return false;
+    *to = strtoull(end, &end, 10);
+    return *end == 0 && *to >= *from;
+}
+
+// Приёмник, выбрасывающий данные
+class NullSink : public MtSink {
+  public:
+    virtual void Write(const unsigned char *, size_t) {}
+};
+
+// Проверка целостности сжатого файла fin (параметр -t). Блоки, как при
+// распаковке, распаковываются потоками пула, но данные никуда не пишутся.
+// Проверяются CRC каждого блока и CRC каждого потока; об ошибках
+// сообщается со смещением блока в битах, и проверка продолжается.
+// Возвращает false, если найдены ошибки.
+bool TestFile(ThreadPool *pool, const char *name, FILE *fin, const PipelineConfig &cfg) {
+    ByteSource *source = OpenFileSource(fin);
+    NullSink sink;
+    Pipeline pipeline(pool, source, &sink, 0, cfg);
+    pipeline.Output()->SetTest(name);
+    pipeline.Start();
+    pipeline.Wait();
+    uint64_t errors = pipeline.Output()->Errors();
+    delete source;
+    if (errors != 0)
+        fprintf(stderr, "%s: %llu error(s) found\n", name, (unsigned long long)errors);
+    return errors == 0;
+}
+
+// Поиск заголовка "BZh1".."BZh9" последнего потока файла f, маркер конца
+// которого начинается с бита end. Потоки начинаются с границы байта, и за
+// заголовком идёт сигнатура блока или, если блоков нет, сразу маркер конца
+// (с бита end). Файл просматривается от end назад до первого такого места,
+// так что читается только последний поток. Возвращает размер блока потока
+// или 0, если заголовок не найден.
+static int FindLastHeader(FILE *f, uint64_t end) {
+    const uint64_t kChunk = 1 << 20;
+    // заголовок с сигнатурой - 10 байтов, и ещё 8 для GetBits
+    vector<unsigned char> buf(kChunk + 18);
+    if (end < 32) return 0;
+    // начала заголовков-кандидатов - [0, hi); за каждым в файле есть ещё
+    // не меньше 10 байтов (сигнатура или маркер конца)
+    uint64_t hi = (end - 32) / 8 + 1;
+    while (hi > 0) {
+        uint64_t lo = hi > kChunk ? hi - kChunk : 0;
+        size_t n = hi - lo + 9;
+        memset(&buf[0], 0, buf.size());
+        if (fseeko(f, lo, SEEK_SET) != 0 || fread(&buf[0], 1, n, f) != n) return 0;
+        for (uint64_t p = hi; p-- > lo;) {
+            const unsigned char *h = &buf[p - lo];
+            if (h[0] != 'B' || h[1] != 'Z' || h[2] != 'h' || h[3] < '1' || h[3] > '9')
+                continue;
+            if (GetBits(h, 32, 48) == kBlockMagic || p * 8 + 32 == end) return h[3] - '0';
+        }
+        hi = lo;
+    }
+    return 0;
+}
 
-    for (size_t i = 0; i < workers.size(); i++) delete workers[i];
+// Поиск конца bzip2-потока в конце файла f: маркер конца потока, CRC
+// и нулевое дополнение до байта. Если файл состоит из нескольких потоков,
+// находится последний. Читаются только заголовок файла и последние 11
+// байтов; размер блока потока не заполняется (см. ArchiveBlockSize).
+// false - файл не оканчивается bzip2-потоком.
+static bool FindStreamTail(FILE *f, StreamTail *tail) {
+    unsigned char header[4], buf[24];
+    struct stat st;
+    if (fstat(fileno(f), &st) != 0 || st.st_size < 14 ||
+        fseeko(f, 0, SEEK_SET) != 0 || fread(header, 1, 4, f) != 4 ||
+        memcmp(header, "BZh", 3) != 0 || header[3] < '1' || header[3] > '9')
+        return false;
+    // последние 11 байтов: маркер и CRC (80 битов) и до 7 битов дополнения
+    memset(buf, 0, sizeof(buf));
+    if (fseeko(f, st.st_size - 11, SEEK_SET) != 0 || fread(buf, 1, 11, f) != 11)
+        return false;
+    for (int pad = 0; pad < 8; pad++) {
+        uint64_t pos = 8 - pad;  // начало маркера в buf
+        if (GetBits(buf, pos, 48) != kEndMagic || (buf[10] & ((1 << pad) - 1)) != 0)
+            continue;
+        tail->bit_offset = (uint64_t)st.st_size * 8 - pad - 80;
+        tail->last = buf[pos / 8];
+        tail->crc = (uint32_t)GetBits(buf, pos + 48, 32);
+        tail->input_size = 0;
+        tail->blockSize100k = 0;
+        return tail->bit_offset >= 32;
+    }
+    return false;
+}
+
+// Размер блока последнего потока сжатого файла path для -a: 0, если файла
+// нет или он пуст (тогда он будет создан заново). Если рядом есть индекс
+// path.idx, описывающий этот поток, размер блока берётся из него, и файл
+// не читается. Иначе заголовок потока ищется просмотром потока от конца
+// (FindLastHeader): размер блока из заголовка первого потока не годится,
+// если у последнего он меньше. Вызывается один раз за запуск.
+static int ArchiveBlockSize(const char *path) {
+    FILE *f = fopen(path, "rb");
+    if (f == NULL) {
+        if (errno == ENOENT) return 0;
+        perror("fopen");
+        die("Can't open archive\n");
+    }
+    struct stat st;
+    StreamTail tail;
+    int level = 0;
+    if (fstat(fileno(f), &st) == 0 && st.st_size != 0) {
+        if (!FindStreamTail(f, &tail)) {
+            fprintf(stderr, "%s: not a bzip2 file\n", path);
+            die("Can't append to archive\n");
+        }
+        BlockIndex index;
+        string idx = string(path) + ".idx";
+        if (index.Load(idx.c_str()) && index[index.Blocks()].bit_offset == tail.bit_offset)
+            level = index.BlockSize();
+        if (level == 0) level = FindLastHeader(f, tail.bit_offset);
+        if (level == 0) {
+            fprintf(stderr, "%s: header of the last bzip2 stream not found\n", path);
+            die("Can't append to archive\n");
+        }
+    }
+    fclose(f);
+    return level;
+}
+
+// Сжатие fin и дописывание блоков в конец последнего bzip2-потока файла
+// archive (параметр -a). Сжатые блоки не перечитываются: новые блоки
+// пишутся с бита, где начинался маркер конца потока, а CRC потока
+// продолжается с записанной в нём (она - свёртка CRC всех его блоков).
+// Поэтому время зависит только от объёма новых данных. blockSize100k -
+// размер блока последнего потока archive (ArchiveBlockSize); если archive
+// нет или он пуст, он создаётся с этим размером блока. writeIndex:
+// продолжить индекс archive.idx (он должен описывать archive).
+void AppendFile(ThreadPool *pool, const char *archive, FILE *fin, int blockSize100k,
+                const PipelineConfig &cfg, bool writeIndex) {
+    string idx = string(archive) + ".idx";
+    const char *indexPath = writeIndex ? idx.c_str() : NULL;
+    FILE *g = fopen(archive, "r+b");
+    if (g == NULL && errno == ENOENT) g = fopen(archive, "wb");
+    if (g == NULL) { perror("fopen"); die("Can't open archive\n"); }
+
+    struct stat st;
+    if (fstat(fileno(g), &st) != 0) { perror("fstat"); die("Can't open archive\n"); }
+    if (st.st_size == 0) {
+        FileJob job(pool, fin, g, blockSize100k, cfg, indexPath);
+        job.Wait();
+        return;
+    }
+
+    StreamTail tail;
+    if (!FindStreamTail(g, &tail)) {
+        fprintf(stderr, "%s: not a bzip2 file\n", archive);
+        die("Can't append to archive\n");
+    }
+    if (writeIndex) {
+        BlockIndex index;
+        if (!index.Load(indexPath)) {
+            fprintf(stderr, "%s: missing or invalid index\n", indexPath);
+            die("Can't read index file\n");
+        }
+        tail.input_size = index[index.Blocks()].offset;
+    }
+    // FileSink пишет прямо в дескриптор файла
+    fflush(g);
+    if (lseek(fileno(g), tail.bit_offset / 8, SEEK_SET) < 0) {
+        perror("lseek");
+        die("Can't append to archive\n");
+    }
+    tail.blockSize100k = blockSize100k;
+    FileJob job(pool, fin, g, blockSize100k, cfg, indexPath, &tail);
+    job.Wait();
 }
 
 // Точка входа в программу
 int main(int argc, char **argv) {
     int blockSize100k = 9, numLocalWorkers = DetectCPUs(), keepFlag = 0;
-    vector<string> files;
+    int decompressFlag = 0, recursiveFlag = 0, numRleThreads = 0, mpisize = 0;
+    int statsFlag = 0, progressFlag = 0, indexFlag = 0, rangeFlag = 0;
+    int testFlag = 0, numaFlag = 0, uringFlag = 0, directFlag = 0, status = 0;
+    uint64_t rangeFrom = 0, rangeTo = 0;
+    const char *statsJson = NULL, *serveAddr = NULL, *archive = NULL;
+    uint64_t memLimit = 0;
+    vector<string> args, files, workerAddrs;
 
 #ifdef MPIBZIP2
     // Инициализация MPI, получение ранга текущего процесса
-    int rank = 0;
-    MPI_Init(&argc, &argv);
+    int rank = 0, mpiIoFlag = 0;
+    // MPI вызывает только главный поток процесса
+    int provided;
+    MPI_Init_thread(&argc, &argv, MPI_THREAD_FUNNELED, &provided);
     MPI_Comm_rank(MPI_COMM_WORLD, &rank);
-    numLocalWorkers = 1;
+    MPI_Comm_size(MPI_COMM_WORLD, &mpisize);
 #endif
 
     // разбор параметров командной строки
     for (int i = 1; i < argc; i++) {
         if (argv[i][0] != '-') {
-            files.push_back(string(argv[i]));
+            args.push_back(string(argv[i]));
         } else if (strlen(argv[i]) == 2 && isdigit(argv[i][1])) {
             blockSize100k = argv[i][1] - '0';
         } else if (strcmp(argv[i], "-p") == 0 && i + 1 < argc) {
             numLocalWorkers = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-R") == 0 && i + 1 < argc) {
+            numRleThreads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-m") == 0 && i + 1 < argc) {
+            memLimit = ParseSize(argv[++i]);
         } else if (strcmp(argv[i], "-k") == 0) {
             keepFlag = 1;
+        } else if (strcmp(argv[i], "-d") == 0) {
+            decompressFlag = 1;
+        } else if (strcmp(argv[i], "-t") == 0) {
+            testFlag = decompressFlag = 1;
+        } else if (strcmp(argv[i], "--verify") == 0) {
+            BzipBlockCompressor::verify = true;
+        } else if (strcmp(argv[i], "-r") == 0) {
+            recursiveFlag = 1;
+        } else if (strcmp(argv[i], "-a") == 0 && i + 1 < argc) {
+            archive = argv[++i];
+        } else if (strcmp(argv[i], "--stats") == 0) {
+            statsFlag = 1;
+        } else if (strcmp(argv[i], "--stats-json") == 0 && i + 1 < argc) {
+            statsJson = argv[++i];
+        } else if (strcmp(argv[i], "--progress") == 0) {
+            progressFlag = 1;
+        } else if (strcmp(argv[i], "--numa") == 0) {
+            numaFlag = 1;
+        } else if (strcmp(argv[i], "--io-uring") == 0) {
+            uringFlag = 1;
+        } else if (strcmp(argv[i], "--direct") == 0) {
+            uringFlag = directFlag = 1;
+        } else if (strcmp(argv[i], "--index") == 0) {
+            indexFlag = 1;
+        } else if (strcmp(argv[i], "--range") == 0 && i + 1 < argc) {
+            if (!ParseRange(argv[++i], &rangeFrom, &rangeTo)) die("Invalid range\n");
+            rangeFlag = decompressFlag = 1;
+        } else if (strcmp(argv[i], "--serve") == 0 && i + 1 < argc) {
+            serveAddr = argv[++i];
+        } else if (strcmp(argv[i], "--workers") == 0 && i + 1 < argc) {
+            // список адресов через запятую
+            string list = argv[++i];
+            for (size_t pos = 0; pos <= list.size();) {
+                size_t end = min(list.find(',', pos), list.size());
+                if (end > pos) workerAddrs.push_back(list.substr(pos, end - pos));
+                pos = end + 1;
+            }
+#ifdef MPIBZIP2
+        } else if (strcmp(argv[i], "--mpi-io") == 0) {
+            mpiIoFlag = 1;
+#endif
+        } else if (strcmp(argv[i], "--sort") == 0 && i + 1 < argc &&
+                   (strcmp(argv[i + 1], "auto") == 0 || strcmp(argv[i + 1], "bzip2") == 0 ||
+                    strcmp(argv[i + 1], "sais") == 0)) {
+            i++;
+            BzipBlockCompressor::sorter = strcmp(argv[i], "auto") == 0 ? SORT_AUTO :
+                                          strcmp(argv[i], "bzip2") == 0 ? SORT_BZIP2 : SORT_SAIS;
         } else {
             // вывод справки о параметрах командной строки
             fprintf(stderr, "Usage: %s [flags] [input files]\n"
               "  -1 .. -9     set block size to 100k .. 900k\n"
-              "  -p <n>       use n parallel threads on local machine\n"
+              "  -p <n>       use n parallel threads on local machine (per MPI process)\n"
+              "  -R <n>       use n threads for RLE encoding of input\n"
+              "  -m <size>    limit memory usage, e.g. 512M\n"
               "  -k           keep (don't delete) input files\n"
-              "If no files are given, compression is from stdin to stdout\n",
+              "  -d           decompress\n"
+              "  -t           test integrity of compressed files\n"
+              "  -r           process files in directories recursively\n"
+              "  -a <file>    compress input files (or stdin) and append the blocks\n"
+              "               to the bzip2 file, keeping input files\n"
+              "  --stats      print per-stage time and queue statistics\n"
+              "  --stats-json <file>  write the statistics as JSON\n"
+              "  --progress   print progress to stderr every second\n"
+              "  --numa       pin worker threads to cores and keep block buffers\n"
+              "               on the NUMA node of the worker that uses them\n"
+              "  --io-uring   read ahead and write files asynchronously with io_uring\n"
+              "               (ordinary I/O is used where it is not available)\n"
+              "  --direct     same, with O_DIRECT for large files to bypass the page cache\n"
+              "  --sort <alg> block sorting: auto, bzip2 or sais\n"
+              "  --verify     check every compressed block by decompressing it\n"
+              "  --index      write a block index file.bz2.idx for --range\n"
+              "  --range <from>-[<to>]  decompress only bytes [from, to) of a\n"
+              "               compressed file that has an index\n"
+              "  --serve <addr>  run as a worker for --workers, listening on\n"
+              "               unix:/path or [host]:port (no authentication:\n"
+              "               use TCP on trusted networks only)\n"
+              "  --workers <addr,...>  also compress on workers started with --serve\n",
               argv[0]);
+#ifdef MPIBZIP2
+            fprintf(stderr,
+              "  --mpi-io     every MPI process reads and compresses its own parts\n"
+              "               of the input files (output may differ from bzip2)\n");
+#endif
+            fprintf(stderr, "If no files are given, compression is from stdin to stdout\n");
             die();
         }
     }
 
+    // до создания потоков и буферов
+    if (numaFlag) NumaEnable();
+    if (uringFlag) UringEnable(directFlag);
+
+    for (size_t i = 0; i < args.size(); i++) {
+        struct stat st;
+        if (stat(args[i].c_str(), &st) == 0 && S_ISDIR(st.st_mode)) {
+            if (recursiveFlag)
+                ListFiles(args[i], decompressFlag, files);
+            else
+                fprintf(stderr, "%s is a directory -- ignored\n", args[i].c_str());
+        } else {
+            files.push_back(args[i]);
+        }
+    }
+
+    if (serveAddr != NULL) {
+        if (mpisize > 1) die("--serve can't be used with several MPI processes\n");
+        NetServer server(max(1, numLocalWorkers));
+        server.Serve(serveAddr);
+    }
+
+    if (rangeFlag && files.size() != 1) die("--range needs one compressed file\n");
+    if (archive != NULL && decompressFlag) die("-a can't be used with -d or -t\n");
+    if (testFlag && rangeFlag) die("--range can't be used with -t\n");
+    if (indexFlag && !decompressFlag && args.size() == 0 && archive == NULL)
+        die("--index needs input files\n");
+
+#ifdef MPIBZIP2
+    if (mpiIoFlag) {
+        if (decompressFlag || files.empty()) die("--mpi-io needs input files to compress\n");
+        if (indexFlag) die("--index can't be used with --mpi-io\n");
+        if (archive != NULL) die("-a can't be used with --mpi-io\n");
+        MpiIoNode node(blockSize100k, max(1, numLocalWorkers));
+        for (size_t i = 0; i < files.size(); i++) {
+            if (rank != 0) {
+                MpiIoServe(&node, files[i].c_str());
+                continue;
+            }
+            string t = files[i] + ".bz2";
+            FILE *g = fopen(t.c_str(), "wb");
+            if (g == NULL) { perror("fopen"); die("Can't create output file\n"); }
+            MpiIoCompress(&node, files[i].c_str(), g, blockSize100k);
+            if (!keepFlag) unlink(files[i].c_str());
+        }
+        MPI_Finalize();
+        return 0;
+    }
+#endif
+
+    // MpiMaster обслуживает конвейеры по одному, поэтому при сжатии
+    // на нескольких MPI-процессах файлы обрабатываются по одному
+    if (decompressFlag) mpisize = 0;
+    int numJobs = max(1, min(kMaxJobs, (int)files.size()));
+    if (mpisize > 1) numJobs = 1;
+
+    // при дописывании файлы сжимаются по одному, размер блока - как в архиве
+    if (archive != NULL) {
+        numJobs = 1;
+#ifdef MPIBZIP2
+        if (rank == 0)
+#endif
+        {
+            int level = ArchiveBlockSize(archive);
+            if (level != 0) blockSize100k = level;
+        }
+#ifdef MPIBZIP2
+        if (mpisize > 1) MPI_Bcast(&blockSize100k, 1, MPI_INT, 0, MPI_COMM_WORLD);
+#endif
+    }
+
+    // В каждом MPI-процессе столько же потоков сжатия, сколько в мастере
+    // (если -p не задан, это может быть не так - тогда очереди мастера
+    // рассчитаны на другое число удалённых блоков)
+    int remoteBlocks = 0;
+#ifdef MPIBZIP2
+    if (mpisize > 1) remoteBlocks = (mpisize - 1) * (max(1, numLocalWorkers) + kMpiSpareBlocks);
+#endif
+
+    // процессы --serve, как и MPI-процессы, обслуживают конвейеры по одному
+    if (!workerAddrs.empty() && !decompressFlag) {
+        if (mpisize > 1) die("--workers can't be used with several MPI processes\n");
+        remoteMaster = new RemoteMaster(workerAddrs, blockSize100k);
+        remoteBlocks = remoteMaster->Blocks();
+        numJobs = 1;
+    }
+
+    if (numRleThreads <= 0) numRleThreads = max(1, numLocalWorkers / 8);
+    PipelineConfig cfg = PlanPipeline(blockSize100k, decompressFlag, numLocalWorkers,
+                                      numRleThreads, remoteBlocks, numJobs, memLimit);
+
 #ifdef MPIBZIP2
-    if (rank != 0)
-        mpi_slave(MPI_COMM_WORLD, blockSize100k);
-    else
+    // распаковка выполняется только процессом-мастером
+    if (rank != 0) {
+        if (!decompressFlag) mpi_slave(MPI_COMM_WORLD, blockSize100k, max(1, numLocalWorkers));
+    } else
 #endif
     {
-        if (files.size() == 0) {
-            Compress(stdin, stdout, blockSize100k, numLocalWorkers);
-        } else {
-            for (size_t i = 0; i < files.size(); i++) {
-                string s = files[i], t = s + ".bz2";
-                FILE *f = fopen(s.c_str(), "rb");
-                if (f == NULL) { perror("fopen"); die("Can't open input file\n"); }
-                FILE *g = fopen(t.c_str(), "wb");
-                if (g == NULL) {perror("fopen");die("Can't create output file\n");}
-                Compress(f, g, blockSize100k, numLocalWorkers);
-                if (!keepFlag) unlink(s.c_str());
+        if (statsFlag || statsJson != NULL) StatsEnable();
+        if (progressFlag) {
+            // общий объём входных данных, если он известен заранее
+            uint64_t total = 0;
+            struct stat st;
+            if (args.size() == 0) {
+                if (fstat(0, &st) == 0 && S_ISREG(st.st_mode)) total = st.st_size;
+            } else {
+                for (size_t i = 0; i < files.size(); i++)
+                    if (stat(files[i].c_str(), &st) == 0) total += st.st_size;
+            }
+            StatsStartProgress(total);
+        }
+
+#ifdef MPIBZIP2
+        if (mpisize > 1) mpiMaster = new MpiMaster(MPI_COMM_WORLD);
+#endif
+        {
+            ThreadPool pool(cfg.numWorkers);
+            int level = decompressFlag ? 0 : blockSize100k;
+            if (rangeFlag) {
+                ExtractRange(&pool, files[0], rangeFrom, rangeTo, cfg);
+            } else if (testFlag && args.size() == 0) {
+                if (!TestFile(&pool, "(stdin)", stdin, cfg)) status = 2;
+            } else if (testFlag) {
+                for (size_t i = 0; i < files.size(); i++) {
+                    FILE *f = fopen(files[i].c_str(), "rb");
+                    if (f == NULL) {
+                        perror(files[i].c_str());
+                        status = 2;
+                    } else if (!TestFile(&pool, files[i].c_str(), f, cfg)) {
+                        status = 2;
+                    }
+                }
+            } else if (archive != NULL && args.size() == 0) {
+                AppendFile(&pool, archive, stdin, level, cfg, indexFlag);
+            } else if (archive != NULL) {
+                for (size_t i = 0; i < files.size(); i++) {
+                    FILE *f = fopen(files[i].c_str(), "rb");
+                    if (f == NULL) { perror("fopen"); die("Can't open input file\n"); }
+                    AppendFile(&pool, archive, f, level, cfg, indexFlag);
+                }
+            } else if (args.size() == 0) {
+                FileJob job(&pool, stdin, stdout, level, cfg);
+                job.Wait();
+            } else {
+                ProcessFiles(&pool, files, level, cfg, keepFlag, indexFlag);
             }
         }
+#ifdef MPIBZIP2
+        if (mpiMaster != NULL) {
+            mpiMaster->Finish();
+            delete mpiMaster;
+        }
+#endif
+        delete remoteMaster;
+
+        if (progressFlag) StatsStopProgress();
+        if (statsFlag) StatsPrintSummary(stderr);
+        if (statsJson != NULL) {
+            bool toStderr = strcmp(statsJson, "-") == 0;
+            FILE *f = toStderr ? stderr : fopen(statsJson, "w");
+            if (f == NULL) { perror("fopen"); die("Can't create statistics file\n"); }
+            StatsPrintJson(f);
+            if (!toStderr) fclose(f);
+        }
     }
 
 #ifdef MPIBZIP2
     MPI_Finalize();
 #endif
-    return 0;
+    return status;
 }
+#endif
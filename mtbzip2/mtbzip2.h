@@ -0,0 +1,129 @@
+// libmtbzip2: параллельное сжатие и распаковка в формате bzip2 внутри
+// процесса, без запуска программы mtbzip2.
+//
+// Данные передаются потоку сжатия (MtCompressor) или распаковки
+// (MtDecompressor) кусками произвольного размера через Write(). Результат
+// либо передаётся объекту-приёмнику MtSink по мере готовности, либо
+// накапливается внутри (не больше kMaxUnread байтов с небольшим) и
+// забирается вызовами Read(). Сжатие блоков
+// выполняют потоки общего пула MtThreadPool, который может одновременно
+// обслуживать несколько потоков данных и переиспользоваться между ними.
+//
+// Пример:
+//   MtThreadPool pool;                  // по потоку на каждое ядро
+//   MtCompressor z(&pool, 9, &sink);
+//   while (...) z.Write(data, size);
+//   if (!z.Finish())                    // все данные переданы в sink
+//       fprintf(stderr, "%s\n", z.Error());
+//
+// Ошибки (повреждённые сжатые данные, неверный размер блока, Write после
+// Finish) процесс не завершают: Write принимает меньше данных, чем ему
+// передано, Finish возвращает false, а Error() - текст первой ошибки.
+// Процесс завершается только при нехватке памяти.
+//
+#ifndef MTBZIP2_H
+#define MTBZIP2_H
+
+#include <stddef.h>
+#include <sys/uio.h>
+
+class ThreadPool;
+class Pipeline;
+class ChannelSource;
+class BufferSink;
+class PipelineWaiter;
+
+// Приёмник готовых данных. Методы вызываются из внутреннего потока вывода,
+// по одному вызову за раз.
+class MtSink {
+  public:
+    virtual ~MtSink() {}
+    virtual void Write(const unsigned char *data, size_t n) = 0;
+
+    // Запись нескольких кусков подряд; можно переопределить, чтобы
+    // записывать их одним системным вызовом
+    virtual void WriteV(const struct iovec *iov, int count) {
+        for (int i = 0; i < count; i++)
+            Write((const unsigned char *)iov[i].iov_base, iov[i].iov_len);
+    }
+};
+
+// Пул потоков, выполняющих сжатие и распаковку блоков
+class MtThreadPool {
+  public:
+    // numThreads = 0: по потоку на каждое процессорное ядро
+    explicit MtThreadPool(int numThreads = 0);
+    ~MtThreadPool();
+    int NumThreads() const;
+
+  private:
+    ThreadPool *pool;
+    friend class MtStream;
+
+    MtThreadPool(const MtThreadPool &) {}
+    void operator =(const MtThreadPool &) {}
+};
+
+// Общая часть MtCompressor и MtDecompressor
+class MtStream {
+  public:
+    virtual ~MtStream();
+
+    // Сколько готовых данных может накопиться внутри, если приёмник не
+    // задан: дальше конвейер останавливается, пока их не прочитают
+    static const size_t kMaxUnread = 16 << 20;
+
+    // Передаёт очередную порцию входных данных и возвращает, сколько байтов
+    // из n принято. Может ожидать, пока потоки пула не освободят место во
+    // входной очереди. Меньше n принимается после ошибки и, если приёмник
+    // не задан, когда конвейер остановлен из-за непрочитанных данных:
+    // остаток нужно передать снова после Read. Ожидание здесь остановило
+    // бы вызывающего, который сам же и читает результат.
+    size_t Write(const void *data, size_t n);
+
+    // Сообщает о конце входных данных. С приёмником ждёт, пока весь
+    // результат не будет ему передан; без приёмника не ждёт, а остаток
+    // результата забирается через Read. false - была ошибка (см. Error;
+    // без приёмника ошибка может обнаружиться и позже, до конца Read).
+    bool Finish();
+
+    // Если приёмник не задан: забирает до n байтов готовых данных. До
+    // Finish не ожидает и возвращает 0, если готовых данных пока нет;
+    // после Finish ждёт их и возвращает 0 только в конце результата.
+    size_t Read(void *buf, size_t n);
+
+    // Текст первой ошибки или NULL, если ошибок не было. Данные после
+    // ошибки распаковки приёмнику не передаются.
+    const char *Error() const;
+
+  protected:
+    // blockSize100k = 0 для распаковки
+    MtStream(MtThreadPool *pool, int blockSize100k, MtSink *sink);
+
+  private:
+    Pipeline *pipeline;  // NULL, если параметры неверны
+    ChannelSource *source;
+    BufferSink *buffer;
+    PipelineWaiter *waiter;  // ожидание конвейера после Finish без приёмника
+    bool finished;
+    const char *error;   // ошибка вызова (ошибки в данных - у конвейера)
+
+    MtStream(const MtStream &) {}
+    void operator =(const MtStream &) {}
+};
+
+// Сжатие с размером блока blockSize100k * 100Кб (1..9)
+class MtCompressor : public MtStream {
+  public:
+    MtCompressor(MtThreadPool *pool, int blockSize100k = 9, MtSink *sink = NULL)
+        : MtStream(pool, blockSize100k, sink) {}
+};
+
+// Распаковка; несколько bzip2-потоков подряд распаковываются в один
+class MtDecompressor : public MtStream {
+  public:
+    MtDecompressor(MtThreadPool *pool, MtSink *sink = NULL)
+        : MtStream(pool, 0, sink) {}
+};
+
+#endif
@@ -0,0 +1,183 @@
+// Сокеты для распределённого сжатия без MPI (см. net.h).
+//
+#include "net.h"
+#include "util.h"
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <errno.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+using namespace std;
+
+// Путь Unix-сокета, если addr задаёт его, иначе пустая строка
+static string UnixPath(const char *addr) {
+    if (strncmp(addr, "unix:", 5) == 0) return addr + 5;
+    if (strchr(addr, '/') != NULL) return addr;
+    return "";
+}
+
+static bool UnixAddress(const string &path, struct sockaddr_un *sa) {
+    memset(sa, 0, sizeof(*sa));
+    sa->sun_family = AF_UNIX;
+    if (path.empty() || path.size() >= sizeof(sa->sun_path)) return false;
+    strcpy(sa->sun_path, path.c_str());
+    return true;
+}
+
+// Разбирает "host:port" (host может быть в квадратных скобках) и
+// возвращает список адресов getaddrinfo или NULL
+static struct addrinfo *TcpAddresses(const char *addr, bool passive) {
+    const char *colon = strrchr(addr, ':');
+    if (colon == NULL || colon[1] == 0) return NULL;
+    string host(addr, colon - addr), port(colon + 1);
+    if (host.size() >= 2 && host[0] == '[' && host[host.size() - 1] == ']')
+        host = host.substr(1, host.size() - 2);
+    struct addrinfo hints, *res = NULL;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (passive) hints.ai_flags = AI_PASSIVE;
+    int err = getaddrinfo(host.empty() ? NULL : host.c_str(), port.c_str(), &hints, &res);
+    if (err != 0) {
+        fprintf(stderr, "%s: %s\n", addr, gai_strerror(err));
+        return NULL;
+    }
+    return res;
+}
+
+// Параметры TCP-соединения: без задержки мелких сообщений и с проверкой,
+// что другая сторона жива. Без keepalive соединение с выключенной машиной
+// ждало бы данных вечно. Для Unix-сокетов параметры TCP не действуют.
+static void TcpOptions(int fd) {
+    const int kKeepIdle = 10, kKeepInterval = 5, kKeepCount = 4;
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &one, sizeof(one));
+#ifdef TCP_KEEPIDLE
+    int idle = kKeepIdle, interval = kKeepInterval, count = kKeepCount;
+    setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle));
+    setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &interval, sizeof(interval));
+    setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &count, sizeof(count));
+#endif
+#ifdef TCP_USER_TIMEOUT
+    // неподтверждённые данные дольше kNetTimeout - соединение потеряно
+    unsigned int timeout = kNetTimeout * 1000;
+    setsockopt(fd, IPPROTO_TCP, TCP_USER_TIMEOUT, &timeout, sizeof(timeout));
+#endif
+}
+
+void NetSetTimeout(int fd, bool receive) {
+    struct timeval tv;
+    tv.tv_sec = kNetTimeout;
+    tv.tv_usec = 0;
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    if (receive) setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+}
+
+int NetListen(const char *addr) {
+    string path = UnixPath(addr);
+    int fd = -1;
+    if (!path.empty() || strchr(addr, ':') == NULL) {
+        struct sockaddr_un sa;
+        if (!UnixAddress(path, &sa)) die("Invalid socket address\n");
+        // сокет, оставшийся от предыдущего запуска
+        unlink(path.c_str());
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0 || bind(fd, (struct sockaddr *)&sa, sizeof(sa)) != 0) {
+            perror(path.c_str());
+            die("Can't listen on socket\n");
+        }
+    } else {
+        struct addrinfo *res = TcpAddresses(addr, true);
+        if (res == NULL) die("Invalid socket address\n");
+        for (struct addrinfo *ai = res; ai != NULL; ai = ai->ai_next) {
+            fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+            if (fd < 0) continue;
+            int one = 1;
+            setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+            if (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0) break;
+            close(fd);
+            fd = -1;
+        }
+        freeaddrinfo(res);
+        if (fd < 0) { perror(addr); die("Can't listen on socket\n"); }
+    }
+    if (listen(fd, 16) != 0) { perror("listen"); die("Can't listen on socket\n"); }
+    return fd;
+}
+
+int NetAccept(int fd) {
+    int c;
+    do {
+        c = accept(fd, NULL, NULL);
+    } while (c < 0 && errno == EINTR);
+    if (c >= 0) TcpOptions(c);
+    return c;
+}
+
+int NetConnect(const char *addr) {
+    string path = UnixPath(addr);
+    if (!path.empty()) {
+        struct sockaddr_un sa;
+        if (!UnixAddress(path, &sa)) {
+            fprintf(stderr, "%s: invalid socket path\n", addr);
+            return -1;
+        }
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd >= 0 && connect(fd, (struct sockaddr *)&sa, sizeof(sa)) == 0) return fd;
+        perror(addr);
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+
+    struct addrinfo *res = TcpAddresses(addr, false);
+    if (res == NULL) {
+        if (strchr(addr, ':') == NULL) fprintf(stderr, "%s: port is not given\n", addr);
+        return -1;
+    }
+    int fd = -1;
+    for (struct addrinfo *ai = res; ai != NULL; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (fd < 0) continue;
+        if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) break;
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    if (fd < 0)
+        perror(addr);
+    else
+        TcpOptions(fd);
+    return fd;
+}
+
+bool NetReadAll(int fd, void *buf, size_t n) {
+    char *p = (char *)buf;
+    while (n > 0) {
+        ssize_t r = read(fd, p, n);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) return false;
+        p += r;
+        n -= r;
+    }
+    return true;
+}
+
+bool NetWriteAll(int fd, const void *buf, size_t n) {
+    const char *p = (const char *)buf;
+    while (n > 0) {
+        ssize_t r = send(fd, p, n, MSG_NOSIGNAL);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) return false;
+        p += r;
+        n -= r;
+    }
+    return true;
+}
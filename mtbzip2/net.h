@@ -0,0 +1,43 @@
+// Сокеты для распределённого сжатия без MPI (--serve, --workers).
+//
+// Адрес задаётся строкой: "unix:/path" или путь, содержащий '/', -
+// Unix-сокет; "host:port" - TCP-соединение (пустой host при ожидании
+// соединений - все адреса машины).
+//
+// Проверки подлинности нет: процесс --serve сжимает блоки любого, кто
+// может с ним соединиться, поэтому TCP-адрес годится только для доверенной
+// сети (или адреса 127.0.0.1 с туннелем). Unix-сокет защищают права на
+// его каталог.
+//
+#ifndef MTBZIP2_NET_H
+#define MTBZIP2_NET_H
+
+#include <stddef.h>
+
+// Время, после которого молчащая сторона соединения считается потерянной, с
+const int kNetTimeout = 60;
+
+// Открывает сокет, ожидающий соединений по адресу addr; при ошибке
+// завершает программу
+int NetListen(const char *addr);
+
+// Принимает очередное соединение; -1 при ошибке. Здесь и в NetConnect
+// у TCP-соединений включается keepalive.
+int NetAccept(int fd);
+
+// Соединяется с addr; при ошибке печатает её и возвращает -1
+int NetConnect(const char *addr);
+
+// Ограничивает ожидание при записи в сокет (и при чтении, если receive)
+// временем kNetTimeout: по его истечении NetWriteAll и NetReadAll
+// возвращают false
+void NetSetTimeout(int fd, bool receive);
+
+// Читает ровно n байтов; false - ошибка или соединение закрыто
+bool NetReadAll(int fd, void *buf, size_t n);
+
+// Записывает ровно n байтов; false - ошибка (в том числе закрытое
+// соединение: SIGPIPE не посылается)
+bool NetWriteAll(int fd, const void *buf, size_t n);
+
+#endif
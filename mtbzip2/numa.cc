@@ -0,0 +1,112 @@
+// Размещение с учётом NUMA (см. numa.h).
+//
+#include "numa.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cctype>
+#include <vector>
+#include <algorithm>
+using namespace std;
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#endif
+
+// Используемые узлы: номер узла в системе и его разрешённые процессоры
+struct NumaNode {
+    int id;
+    vector<int> cpus;
+};
+
+static vector<NumaNode> nodes;
+
+#ifdef __linux__
+static bool NodeLess(const NumaNode &a, const NumaNode &b) { return a.id < b.id; }
+
+// Разбор списка процессоров вида "0-3,8,10-11"
+static void ParseCpuList(const char *s, vector<int> &cpus) {
+    while (*s != 0 && *s != '\n') {
+        char *end;
+        long a = strtol(s, &end, 10), b = a;
+        if (end == s) return;
+        if (*end == '-') b = strtol(end + 1, &end, 10);
+        for (long c = a; c <= b; c++) cpus.push_back((int)c);
+        s = *end == ',' ? end + 1 : end;
+    }
+}
+
+int NumaEnable() {
+    nodes.clear();
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) return 1;
+
+    DIR *d = opendir("/sys/devices/system/node");
+    struct dirent *e;
+    while (d != NULL && (e = readdir(d)) != NULL) {
+        if (strncmp(e->d_name, "node", 4) != 0 || !isdigit(e->d_name[4])) continue;
+        char path[300], buf[4096];
+        snprintf(path, sizeof(path), "/sys/devices/system/node/%s/cpulist", e->d_name);
+        FILE *f = fopen(path, "r");
+        if (f == NULL) continue;
+        bool ok = fgets(buf, sizeof(buf), f) != NULL;
+        fclose(f);
+        if (!ok) continue;
+
+        NumaNode node;
+        node.id = atoi(e->d_name + 4);
+        vector<int> cpus;
+        ParseCpuList(buf, cpus);
+        for (size_t i = 0; i < cpus.size(); i++)
+            if (cpus[i] < CPU_SETSIZE && CPU_ISSET(cpus[i], &allowed))
+                node.cpus.push_back(cpus[i]);
+        // узлы без разрешённых процессоров (в том числе узлы только
+        // с памятью) не используются
+        if (!node.cpus.empty()) nodes.push_back(node);
+    }
+    if (d != NULL) closedir(d);
+
+    // порядок readdir произвольный
+    sort(nodes.begin(), nodes.end(), NodeLess);
+    return NumaNodes();
+}
+
+void NumaBindThread(int node, int i) {
+    if (nodes.empty()) return;
+    const vector<int> &cpus = nodes[node % nodes.size()].cpus;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpus[(i / nodes.size()) % cpus.size()], &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
+void NumaBindMemory(void *p, size_t len, int node) {
+    if (nodes.size() < 2 || node < 0) return;
+    // политика MPOL_PREFERRED размещает страницу на узле при первом
+    // обращении к ней, а если там нет места - на любом другом. Ошибка mbind
+    // не страшна: тогда страницы окажутся там, где к ним обратятся первым.
+    unsigned long mask[16] = { 0 };
+    int id = nodes[node % nodes.size()].id;
+    if (id >= (int)(sizeof(mask) * 8)) return;
+    mask[id / (8 * sizeof(long))] |= 1UL << (id % (8 * sizeof(long)));
+    syscall(SYS_mbind, p, len, MPOL_PREFERRED, mask, sizeof(mask) * 8, 0);
+}
+#else
+int NumaEnable() { return 1; }
+void NumaBindThread(int, int) {}
+void NumaBindMemory(void *, size_t, int) {}
+#endif
+
+int NumaNodes() {
+    return nodes.size() < 2 ? 1 : (int)nodes.size();
+}
+
+int NumaWorkerNode(int i) {
+    return i % NumaNodes();
+}
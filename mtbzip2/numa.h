@@ -0,0 +1,35 @@
+// Размещение потоков и памяти с учётом NUMA (параметр --numa).
+//
+// Топология читается из /sys/devices/system/node без libnuma; учитываются
+// только процессоры, на которых процессу разрешено выполняться. Пока
+// размещение не включено NumaEnable(), а также на машинах с одним узлом
+// и в системах без NUMA узел считается один, потоки не привязываются,
+// а память выделяется обычным образом.
+//
+#ifndef MTBZIP2_NUMA_H
+#define MTBZIP2_NUMA_H
+
+#include <stddef.h>
+
+// Включает размещение с учётом NUMA; вызывается до создания потоков.
+// Возвращает число используемых узлов.
+int NumaEnable();
+
+// Число используемых узлов (узлы нумеруются от 0 до NumaNodes() - 1)
+int NumaNodes();
+
+// Узел для рабочего потока с номером i: потоки распределяются по узлам
+// поровну
+int NumaWorkerNode(int i);
+
+// Привязывает текущий поток к одному из процессоров узла node, выбранному
+// по номеру потока i. Память, которой поток коснётся первым, будет
+// выделена на его узле.
+void NumaBindThread(int node, int i);
+
+// Просит размещать ещё не выделенные страницы отображения [p, p + len)
+// (p и len кратны размеру страницы) на узле node; если там нет места,
+// NUMA не включена или node < 0, страницы размещаются как обычно
+void NumaBindMemory(void *p, size_t len, int node);
+
+#endif
@@ -0,0 +1,150 @@
+// Многопоточная сортировка циклических сдвигов блока (см. psort.h).
+//
+#include "psort.h"
+#include <cstring>
+#include <algorithm>
+using namespace std;
+
+// Группы меньше этого размера сортируются вставками
+static const int32_t kInsertionSort = 16;
+
+// Допустимая работа на один сдвиг части (число просмотренных символов)
+static const int64_t kBudgetPerSymbol = 128;
+
+ParallelSort::ParallelSort(unsigned char *block, int32_t n, uint32_t *ptr, int numParts)
+    : text(block), n(n), ptr(ptr), bucket(65537, 0) {
+    // за блоком - его копия, так что сдвиг i - это block[i..i+n)
+    memcpy(block + n, block, n);
+
+    for (int32_t i = 0; i < n; i++) bucket[(block[i] << 8) | block[i + 1]]++;
+    int32_t sum = 0;
+    for (int b = 0; b <= 65536; b++) {
+        int32_t c = bucket[b];
+        bucket[b] = sum;
+        sum += c;
+    }
+    vector<int32_t> pos(bucket.begin(), bucket.end() - 1);
+    for (int32_t i = 0; i < n; i++) ptr[pos[(block[i] << 8) | block[i + 1]]++] = i;
+
+    // части - последовательные корзины, примерно по n / numParts сдвигов
+    int32_t part_size = n / numParts + 1;
+    part_first.push_back(0);
+    for (int b = 1; b < 65536; b++)
+        if (bucket[b] - bucket[part_first.back()] >= part_size) part_first.push_back(b);
+    part_first.push_back(65536);
+
+    next_part = done_parts = 0;
+    refs = 1;
+    aborted = false;
+    pthread_mutex_init(&mutex, NULL);
+    pthread_cond_init(&done, NULL);
+}
+
+ParallelSort::~ParallelSort() {
+    pthread_cond_destroy(&done);
+    pthread_mutex_destroy(&mutex);
+}
+
+void ParallelSort::AddRef(int count) {
+    __atomic_add_fetch(&refs, count, __ATOMIC_RELAXED);
+}
+
+void ParallelSort::Release() {
+    if (__atomic_sub_fetch(&refs, 1, __ATOMIC_ACQ_REL) == 0) delete this;
+}
+
+void ParallelSort::Work() {
+    int num_parts = (int)part_first.size() - 1;
+    int part;
+    while ((part = __atomic_fetch_add(&next_part, 1, __ATOMIC_RELAXED)) < num_parts) {
+        bool ok = __atomic_load_n(&aborted, __ATOMIC_RELAXED) || SortPart(part);
+        pthread_mutex_lock(&mutex);
+        if (!ok) aborted = true;
+        if (++done_parts == num_parts) pthread_cond_broadcast(&done);
+        pthread_mutex_unlock(&mutex);
+    }
+}
+
+bool ParallelSort::Wait(int32_t *origPtr) {
+    int num_parts = (int)part_first.size() - 1;
+    pthread_mutex_lock(&mutex);
+    while (done_parts != num_parts) pthread_cond_wait(&done, &mutex);
+    bool ok = !aborted;
+    pthread_mutex_unlock(&mutex);
+    if (!ok) return false;
+    for (int32_t i = 0; i < n; i++)
+        if (ptr[i] == 0) { *origPtr = i; break; }
+    return true;
+}
+
+bool ParallelSort::SortPart(int part) {
+    int32_t lo = bucket[part_first[part]], hi = bucket[part_first[part + 1]];
+    int64_t budget = (hi - lo) * kBudgetPerSymbol + 65536;
+    vector<Range> stack;
+    for (int b = part_first[part]; b < part_first[part + 1]; b++) {
+        if (bucket[b + 1] - bucket[b] > 1 &&
+            !SortGroup(bucket[b], bucket[b + 1], &budget, stack))
+            return false;
+        if (__atomic_load_n(&aborted, __ATOMIC_RELAXED)) return false;
+    }
+    return true;
+}
+
+// Сортирует сдвиги ptr[lo..hi) с общими первыми двумя символами
+bool ParallelSort::SortGroup(int32_t lo, int32_t hi, int64_t *budget, vector<Range> &stack) {
+    stack.clear();
+    stack.push_back(Range(lo, hi, 2));
+    while (!stack.empty()) {
+        Range r = stack.back();
+        stack.pop_back();
+        // все сдвиги группы совпадают: блок периодичен
+        if (r.depth >= n) return false;
+        if (r.hi - r.lo < kInsertionSort) {
+            if (!InsertionSort(r.lo, r.hi, r.depth, budget)) return false;
+            continue;
+        }
+        *budget -= r.hi - r.lo;
+        if (*budget < 0) return false;
+
+        // разбиение по символу на глубине depth: [lo, lt) - меньше опорного,
+        // [lt, gt) - равные ему, [gt, hi) - больше
+        const unsigned char *t = text + r.depth;
+        uint32_t *a = ptr;
+        int x = t[a[r.lo]], y = t[a[r.lo + (r.hi - r.lo) / 2]], z = t[a[r.hi - 1]];
+        int v = max(min(x, y), min(max(x, y), z));
+        int32_t lt = r.lo, i = r.lo, gt = r.hi;
+        while (i < gt) {
+            int c = t[a[i]];
+            if (c < v)
+                swap(a[lt++], a[i++]);
+            else if (c > v)
+                swap(a[i], a[--gt]);
+            else
+                i++;
+        }
+        if (lt - r.lo > 1) stack.push_back(Range(r.lo, lt, r.depth));
+        if (r.hi - gt > 1) stack.push_back(Range(gt, r.hi, r.depth));
+        if (gt - lt > 1) stack.push_back(Range(lt, gt, r.depth + 1));
+    }
+    return true;
+}
+
+bool ParallelSort::InsertionSort(int32_t lo, int32_t hi, int32_t depth, int64_t *budget) {
+    for (int32_t i = lo + 1; i < hi; i++) {
+        uint32_t v = ptr[i];
+        const unsigned char *tv = text + v + depth;
+        int32_t j = i;
+        while (j > lo) {
+            const unsigned char *tu = text + ptr[j - 1] + depth;
+            int32_t k = 0, limit = n - depth;
+            while (k < limit && tu[k] == tv[k]) k++;
+            *budget -= k + 1;
+            if (k == limit || *budget < 0) return false;
+            if (tu[k] < tv[k]) break;
+            ptr[j] = ptr[j - 1];
+            j--;
+        }
+        ptr[j] = v;
+    }
+    return true;
+}
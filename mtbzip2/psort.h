@@ -0,0 +1,71 @@
+// Сортировка циклических сдвигов блока несколькими потоками.
+//
+// Сдвиги раскладываются по корзинам по первым двум байтам (как в
+// сортировке libbz2), и корзины сортируются независимо трёхпутевой
+// поразрядной быстрой сортировкой (J. Bentley, R. Sedgewick, 1997).
+// Корзины объединены в части примерно равного размера, которые разбирают
+// все участвующие в сортировке потоки.
+//
+// Время такой сортировки пропорционально суммарной длине общих префиксов
+// соседних сдвигов, поэтому она годится только для разнородных данных.
+// Если работы оказывается слишком много (длинные повторы или
+// периодический блок), сортировка прерывается, и блок нужно сортировать
+// другим способом.
+//
+#ifndef MTBZIP2_PSORT_H
+#define MTBZIP2_PSORT_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include <vector>
+
+// Класс ParallelSort
+// Задание на сортировку одного блока. Создаётся потоком, сжимающим блок, с
+// одной ссылкой; каждый поток-помощник получает свою ссылку (AddRef) и,
+// выполнив Work, освобождает её. Объект удаляется с последней ссылкой,
+// так что помощник может взяться за задание и после того, как сортировка
+// закончилась: тогда ему уже нечего делать.
+class ParallelSort {
+  public:
+    // block должен вмещать 2n байтов: во вторую половину записывается
+    // копия блока. ptr - массив из n элементов для результата.
+    ParallelSort(unsigned char *block, int32_t n, uint32_t *ptr, int numParts);
+
+    void AddRef(int count);
+    void Release();
+
+    // Сортирует ещё не взятые части блока
+    void Work();
+
+    // Ожидает окончания сортировки всех частей. Возвращает false, если
+    // сортировка прервана; иначе записывает в *origPtr номер сдвига,
+    // начинающегося с 0.
+    bool Wait(int32_t *origPtr);
+
+  private:
+    struct Range {
+        int32_t lo, hi, depth;
+        Range(int32_t lo, int32_t hi, int32_t depth) : lo(lo), hi(hi), depth(depth) {}
+    };
+
+    const unsigned char *text;
+    int32_t n;
+    uint32_t *ptr;
+    std::vector<int32_t> bucket;     // начала корзин в ptr, 65537 элементов
+    std::vector<int32_t> part_first; // первая корзина каждой части
+
+    int next_part, done_parts, refs;
+    bool aborted;
+    pthread_mutex_t mutex;
+    pthread_cond_t done;
+
+    ~ParallelSort();
+    bool SortPart(int part);
+    bool SortGroup(int32_t lo, int32_t hi, int64_t *budget, std::vector<Range> &stack);
+    bool InsertionSort(int32_t lo, int32_t hi, int32_t depth, int64_t *budget);
+
+    ParallelSort(const ParallelSort &) {}
+    void operator =(const ParallelSort &) {}
+};
+
+#endif
@@ -1,4 +1,5 @@
 #!/usr/bin/python2.5
+# -*- coding: utf-8 -*-
 import sys, os, random
 
 def run(cmd, input):
@@ -24,7 +25,25 @@ def test(seed):
     sys.stderr.write('\nFound different outputs with seed=%s, input written to %s\n' % (seed, s))
     return False
 
-if len(sys.argv) == 1:
+# -a в файл из двух потоков с разными размерами блока: блоки должны
+# дописываться с размером блока последнего потока
+def test_append_levels():
+    r = random.Random(1)
+    parts = [hex(r.getrandbits(8000000)) for i in range(3)]
+    ok = True
+    for first, last in ((9, 1), (1, 9)):
+        archive = run('bzip2 -%d -c' % first, parts[0]) + run('bzip2 -%d -c' % last, parts[1])
+        file('/tmp/regtest.bz2', 'wb').write(archive)
+        file('/tmp/regtest.in', 'wb').write(parts[2])
+        if os.system('./mtbzip2 -a /tmp/regtest.bz2 /tmp/regtest.in') != 0 or \
+           run('bzip2 -d -c /tmp/regtest.bz2', '') != parts[0] + parts[1] + parts[2]:
+            sys.stderr.write('-a failed for streams with -%d and -%d\n' % (first, last))
+            ok = False
+    return ok
+
+if len(sys.argv) == 2 and sys.argv[1] == 'append':
+    if not test_append_levels(): sys.exit(1)
+elif len(sys.argv) == 1:
     while True:
         test(random.randint(1, 1000000000))
 else:
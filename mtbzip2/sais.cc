@@ -0,0 +1,208 @@
+// Построение суффиксного массива алгоритмом SA-IS и сортировка циклических
+// сдвигов блока bzip2 с его помощью.
+//
+#include "sais.h"
+#include "util.h"
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+using namespace std;
+
+// Строка верхнего уровня: байты со сдвигом на 1 и завершающий символ 0
+struct ByteText {
+    const unsigned char *p;
+    int32_t last;
+    ByteText(const unsigned char *p, int32_t n) : p(p), last(n - 1) {}
+    int32_t operator [](int32_t i) const { return i < last ? p[i] + 1 : 0; }
+};
+
+// Строка имён LMS-подстрок на следующих уровнях рекурсии
+struct IntText {
+    const int32_t *p;
+    IntText(const int32_t *p) : p(p) {}
+    int32_t operator [](int32_t i) const { return p[i]; }
+};
+
+// bkt[c] - начало (end = false) или конец (end = true) корзины символа c
+template<class Text>
+static void GetBuckets(const Text &s, int32_t n, int32_t k, int32_t *bkt, bool end) {
+    memset(bkt, 0, k * sizeof(int32_t));
+    for (int32_t i = 0; i < n; i++) bkt[s[i]]++;
+    int32_t sum = 0;
+    for (int32_t c = 0; c < k; c++) {
+        sum += bkt[c];
+        bkt[c] = end ? sum : sum - bkt[c];
+    }
+}
+
+// Сортировка суффиксов L-типа по уже отсортированным
+template<class Text>
+static void InduceL(const Text &s, const unsigned char *t, int32_t *sa, int32_t n,
+                    int32_t k, int32_t *bkt) {
+    GetBuckets(s, n, k, bkt, false);
+    for (int32_t i = 0; i < n; i++) {
+        int32_t j = sa[i] - 1;
+        if (j >= 0 && !t[j]) sa[bkt[s[j]]++] = j;
+    }
+}
+
+// Сортировка суффиксов S-типа по суффиксам L-типа
+template<class Text>
+static void InduceS(const Text &s, const unsigned char *t, int32_t *sa, int32_t n,
+                    int32_t k, int32_t *bkt) {
+    GetBuckets(s, n, k, bkt, true);
+    for (int32_t i = n - 1; i >= 0; i--) {
+        int32_t j = sa[i] - 1;
+        if (j >= 0 && t[j]) sa[--bkt[s[j]]] = j;
+    }
+}
+
+// Суффиксный массив строки s[0..n) над алфавитом 0..k-1, последний символ
+// которой - единственный и наименьший. t[i] = 1 для суффиксов S-типа
+// (меньших следующего суффикса), LMS - S-суффикс после L-суффикса.
+template<class Text>
+static void Sais(const Text &s, int32_t *sa, int32_t n, int32_t k) {
+    if (n == 1) { sa[0] = 0; return; }
+
+    unsigned char *t = xmalloc(n);
+    t[n - 1] = 1;
+    t[n - 2] = 0;
+    for (int32_t i = n - 3; i >= 0; i--)
+        t[i] = s[i] < s[i + 1] || (s[i] == s[i + 1] && t[i + 1]);
+#define IS_LMS(i) ((i) > 0 && t[i] && !t[(i) - 1])
+
+    // LMS-суффиксы ставятся в концы своих корзин, по ним сортируются
+    // все суффиксы, и в результате LMS-подстроки оказываются упорядочены
+    int32_t *bkt = (int32_t *)xmalloc(k * sizeof(int32_t));
+    GetBuckets(s, n, k, bkt, true);
+    for (int32_t i = 0; i < n; i++) sa[i] = -1;
+    for (int32_t i = 1; i < n; i++)
+        if (IS_LMS(i)) sa[--bkt[s[i]]] = i;
+    InduceL(s, t, sa, n, k, bkt);
+    InduceS(s, t, sa, n, k, bkt);
+
+    // отсортированные LMS-подстроки собираются в начале sa (их не больше
+    // n / 2) и получают имена; одинаковые подстроки - одинаковые имена
+    int32_t n1 = 0;
+    for (int32_t i = 0; i < n; i++)
+        if (IS_LMS(sa[i])) sa[n1++] = sa[i];
+    for (int32_t i = n1; i < n; i++) sa[i] = -1;
+    int32_t name = 0, prev = -1;
+    for (int32_t i = 0; i < n1; i++) {
+        int32_t pos = sa[i];
+        bool diff = false;
+        for (int32_t d = 0; d < n; d++) {
+            if (prev == -1 || s[pos + d] != s[prev + d] || t[pos + d] != t[prev + d]) {
+                diff = true;
+                break;
+            }
+            if (d > 0 && (IS_LMS(pos + d) || IS_LMS(prev + d))) break;
+        }
+        if (diff) { name++; prev = pos; }
+        // LMS-позиции отстоят друг от друга хотя бы на 2
+        sa[n1 + pos / 2] = name - 1;
+    }
+    for (int32_t i = n - 1, j = n - 1; i >= n1; i--)
+        if (sa[i] >= 0) sa[j--] = sa[i];
+
+    // порядок LMS-суффиксов: рекурсивно, если не все имена различны
+    int32_t *sa1 = sa, *s1 = sa + n - n1;
+    if (name < n1) {
+        Sais(IntText(s1), sa1, n1, name);
+    } else {
+        for (int32_t i = 0; i < n1; i++) sa1[s1[i]] = i;
+    }
+
+    // по отсортированным LMS-суффиксам сортируются все остальные
+    GetBuckets(s, n, k, bkt, true);
+    for (int32_t i = 1, j = 0; i < n; i++)
+        if (IS_LMS(i)) s1[j++] = i;
+    for (int32_t i = 0; i < n1; i++) sa1[i] = s1[sa1[i]];
+    for (int32_t i = n1; i < n; i++) sa[i] = -1;
+    for (int32_t i = n1 - 1; i >= 0; i--) {
+        int32_t j = sa[i];
+        sa[i] = -1;
+        sa[--bkt[s[j]]] = j;
+    }
+    InduceL(s, t, sa, n, k, bkt);
+    InduceS(s, t, sa, n, k, bkt);
+#undef IS_LMS
+
+    free(bkt);
+    free(t);
+}
+
+void SuffixArray(const unsigned char *text, int32_t *sa, int32_t n) {
+    Sais(ByteText(text, n + 1), sa, n + 1, 257);
+}
+
+// Начало наименьшего циклического сдвига или -1, если блок периодичен.
+// Сравниваются сдвиги i и j; при расхождении на k-м символе больший из них
+// и следующие за ним k сдвигов заведомо не наименьшие.
+static int32_t MinRotation(const unsigned char *s, int32_t n) {
+    int32_t i = 0, j = 1, k = 0;
+    while (i < n && j < n && k < n) {
+        int32_t a = i + k, b = j + k;
+        if (a >= n) a -= n;
+        if (b >= n) b -= n;
+        if (s[a] == s[b]) {
+            k++;
+            continue;
+        }
+        if (s[a] > s[b])
+            i += k + 1;
+        else
+            j += k + 1;
+        if (i == j) j++;
+        k = 0;
+    }
+    // сдвиги i и j совпали целиком
+    if (k >= n) return -1;
+    return i < j ? i : j;
+}
+
+bool SortRotations(unsigned char *block, int32_t n, uint32_t *ptr, int32_t *origPtr) {
+    int32_t r = n > 1 ? MinRotation(block, n) : 0;
+    if (r < 0) return false;
+
+    unsigned char *w = block + n;
+    memcpy(w, block + r, n - r);
+    memcpy(w + n - r, block, r);
+    int32_t *sa = (int32_t *)ptr;
+    SuffixArray(w, sa, n);
+
+    // sa[0] - завершающий символ; остальные номера переводятся
+    // из позиций в w в позиции в исходном блоке
+    for (int32_t i = 0; i < n; i++) {
+        int32_t p = sa[i + 1] + r;
+        if (p >= n) p -= n;
+        ptr[i] = p;
+        if (p == 0) *origPtr = i;
+    }
+    return true;
+}
+
+double RepeatFraction(const unsigned char *block, int32_t n) {
+    static const int kHashBits = 16, kMinMatch = 32;
+    vector<int32_t> head(1 << kHashBits, -1);
+    int64_t covered = 0;
+    int32_t i = 0, misses = 0;
+    while (i + kMinMatch <= n) {
+        uint32_t v;
+        memcpy(&v, block + i, 4);
+        uint32_t h = (v * 2654435761U) >> (32 - kHashBits);
+        int32_t cand = head[h];
+        head[h] = i;
+        if (cand >= 0 && memcmp(block + cand, block + i, kMinMatch) == 0) {
+            int32_t len = kMinMatch;
+            while (i + len < n && block[cand + len] == block[i + len]) len++;
+            covered += len;
+            i += len;
+            misses = 0;
+        } else {
+            // на данных без повторов шаг постепенно растёт (как в LZ4)
+            i += 1 + (misses++ >> 5);
+        }
+    }
+    return n > 0 ? (double)covered / n : 0;
+}
@@ -0,0 +1,33 @@
+// Сортировка циклических сдвигов блока для преобразования Барроуза-Уилера
+// за линейное время (построение суффиксного массива алгоритмом SA-IS,
+// G. Nong, S. Zhang, W. H. Chan, 2009).
+//
+// Блок поворачивается к своему наименьшему циклическому сдвигу. Получается
+// слово Линдона, а у него порядок циклических сдвигов совпадает с порядком
+// суффиксов, так что достаточно суффиксного массива строки длины n.
+//
+#ifndef MTBZIP2_SAIS_H
+#define MTBZIP2_SAIS_H
+
+#include <stdint.h>
+
+// Строит суффиксный массив строки text[0..n), дополненной завершающим
+// символом, меньшим всех остальных: sa[0] = n, sa[1..n] - суффиксы в
+// порядке возрастания. Массив sa должен вмещать n + 1 элементов.
+void SuffixArray(const unsigned char *text, int32_t *sa, int32_t n);
+
+// Сортирует циклические сдвиги block[0..n): ptr[i] - начало i-го по
+// порядку сдвига, *origPtr - номер сдвига, начинающегося с 0. Буфер блока
+// должен вмещать 2n байтов, ptr - n + 1 элементов; содержимое block[n..2n)
+// портится. Если блок периодичен (некоторые сдвиги совпадают), ничего не
+// делает и возвращает false: порядок равных сдвигов у разных алгоритмов
+// сортировки разный.
+bool SortRotations(unsigned char *block, int32_t n, uint32_t *ptr, int32_t *origPtr);
+
+// Доля блока, покрытая повторами длиной от 32 байтов, которые находит
+// быстрый хэш-поиск (как в LZ77 с одним кандидатом на позицию). Сортировка
+// libbz2 тратит время на сравнение длинных общих префиксов, поэтому на
+// таких блоках она заметно медленнее SA-IS.
+double RepeatFraction(const unsigned char *block, int32_t n);
+
+#endif
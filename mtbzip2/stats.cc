@@ -0,0 +1,258 @@
+#include "stats.h"
+#include <cstring>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+#include <string>
+using namespace std;
+
+static const char *kWaitNames[STAT_NUM_WAITS] = {
+    "free", "buffer", "work", "team", "window", "next", "mpi", "net", "read", "write"
+};
+
+static bool enabled = false;
+static double enable_time;
+static __thread ThreadStats *current = NULL;
+
+// все записи живут до конца программы: сводка печатается после
+// завершения потоков
+static pthread_mutex_t registry_mutex = PTHREAD_MUTEX_INITIALIZER;
+static vector<ThreadStats *> registry;
+
+static uint64_t total_in, total_out;
+
+double StatsNow() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+void StatsHistogram::Add(double value) {
+    int b = 0;
+    while (b < kBuckets - 1 && value >= (double)(1ULL << b)) b++;
+    count[b]++;
+    n++;
+    sum += value;
+    if (value > max) max = value;
+}
+
+void StatsEnable() {
+    enabled = true;
+    enable_time = StatsNow();
+}
+
+ThreadStats *CurrentStats() {
+    return current;
+}
+
+StatsThread::StatsThread(const char *role) {
+    stats = NULL;
+    if (!enabled) return;
+    stats = new ThreadStats();
+    memset(stats, 0, sizeof(*stats));
+    stats->role = role;
+    stats->start = StatsNow();
+    pthread_mutex_lock(&registry_mutex);
+    registry.push_back(stats);
+    pthread_mutex_unlock(&registry_mutex);
+    current = stats;
+}
+
+StatsThread::~StatsThread() {
+    if (stats == NULL) return;
+    stats->end = StatsNow();
+    current = NULL;
+}
+
+void StatsInput(uint64_t n) {
+    __atomic_add_fetch(&total_in, n, __ATOMIC_RELAXED);
+    if (current != NULL) current->bytes_in += n;
+}
+
+void StatsOutput(uint64_t n) {
+    __atomic_add_fetch(&total_out, n, __ATOMIC_RELAXED);
+    if (current != NULL) current->bytes_out += n;
+}
+
+// Суммарные счётчики потоков одной роли
+struct RoleStats {
+    const char *role;
+    int threads;
+    double time;  // суммарное время жизни потоков
+    ThreadStats sum;
+};
+
+static void AddHistogram(StatsHistogram &to, const StatsHistogram &from) {
+    for (int i = 0; i < StatsHistogram::kBuckets; i++) to.count[i] += from.count[i];
+    to.n += from.n;
+    to.sum += from.sum;
+    if (from.max > to.max) to.max = from.max;
+}
+
+static vector<RoleStats> Aggregate() {
+    vector<RoleStats> roles;
+    double now = StatsNow();
+    pthread_mutex_lock(&registry_mutex);
+    for (size_t i = 0; i < registry.size(); i++) {
+        const ThreadStats &t = *registry[i];
+        size_t r = 0;
+        while (r < roles.size() && strcmp(roles[r].role, t.role) != 0) r++;
+        if (r == roles.size()) {
+            RoleStats rs;
+            memset(&rs, 0, sizeof(rs));
+            rs.role = t.role;
+            roles.push_back(rs);
+        }
+        RoleStats &rs = roles[r];
+        double end = t.end;
+        rs.threads++;
+        rs.time += (end != 0 ? end : now) - t.start;
+        for (int k = 0; k < STAT_NUM_WAITS; k++) {
+            rs.sum.wait[k] += t.wait[k];
+            rs.sum.waits[k] += t.waits[k];
+        }
+        rs.sum.blocks += t.blocks;
+        rs.sum.bytes_in += t.bytes_in;
+        rs.sum.bytes_out += t.bytes_out;
+        AddHistogram(rs.sum.latency, t.latency);
+        AddHistogram(rs.sum.depth, t.depth);
+    }
+    pthread_mutex_unlock(&registry_mutex);
+    return roles;
+}
+
+static double Busy(const RoleStats &rs) {
+    double busy = rs.time;
+    for (int k = 0; k < STAT_NUM_WAITS; k++) busy -= rs.sum.wait[k];
+    return busy > 0 ? busy : 0;
+}
+
+static double Percent(double part, double whole) {
+    return whole > 0 ? 100 * part / whole : 0;
+}
+
+static void PrintHistogram(FILE *fp, const char *title, const char *role,
+                           const StatsHistogram &h) {
+    if (h.n == 0) return;
+    fprintf(fp, "%s (%s): n=%llu mean=%.1f max=%.1f\n ", title, role,
+            (unsigned long long)h.n, h.sum / h.n, h.max);
+    for (int i = 0; i < StatsHistogram::kBuckets; i++) {
+        if (h.count[i] == 0) continue;
+        if (i == 0)
+            fprintf(fp, " <1:%llu", (unsigned long long)h.count[i]);
+        else if (i == StatsHistogram::kBuckets - 1)
+            fprintf(fp, " >=%llu:%llu", 1ULL << (i - 1), (unsigned long long)h.count[i]);
+        else
+            fprintf(fp, " %llu-%llu:%llu", 1ULL << (i - 1), (1ULL << i) - 1,
+                    (unsigned long long)h.count[i]);
+    }
+    fprintf(fp, "\n");
+}
+
+void StatsPrintSummary(FILE *fp) {
+    vector<RoleStats> roles = Aggregate();
+    double elapsed = StatsNow() - enable_time;
+    uint64_t in = __atomic_load_n(&total_in, __ATOMIC_RELAXED);
+    uint64_t out = __atomic_load_n(&total_out, __ATOMIC_RELAXED);
+
+    fprintf(fp, "Stats: %.2f s, %.1f MB in, %.1f MB out (%.1f%%), %.1f MB/s\n",
+            elapsed, in / 1e6, out / 1e6, Percent(out, in),
+            in / 1e6 / (elapsed > 0 ? elapsed : 1e-9));
+    fprintf(fp, "%-12s %7s %6s", "role", "threads", "busy");
+    for (int k = 0; k < STAT_NUM_WAITS; k++) fprintf(fp, " %6s", kWaitNames[k]);
+    fprintf(fp, " %8s\n", "blocks");
+    for (size_t r = 0; r < roles.size(); r++) {
+        const RoleStats &rs = roles[r];
+        fprintf(fp, "%-12s %7d %5.1f%%", rs.role, rs.threads, Percent(Busy(rs), rs.time));
+        for (int k = 0; k < STAT_NUM_WAITS; k++)
+            fprintf(fp, " %5.1f%%", Percent(rs.sum.wait[k], rs.time));
+        fprintf(fp, " %8llu\n", (unsigned long long)rs.sum.blocks);
+    }
+    for (size_t r = 0; r < roles.size(); r++) {
+        PrintHistogram(fp, "block latency, ms", roles[r].role, roles[r].sum.latency);
+        PrintHistogram(fp, "queue depth", roles[r].role, roles[r].sum.depth);
+    }
+}
+
+static void PrintJsonHistogram(FILE *fp, const char *name, const StatsHistogram &h) {
+    fprintf(fp, "\"%s\": {\"count\": %llu, \"sum\": %.6f, \"max\": %.6f, \"buckets\": [",
+            name, (unsigned long long)h.n, h.sum, h.max);
+    for (int i = 0; i < StatsHistogram::kBuckets; i++)
+        fprintf(fp, "%s%llu", i ? ", " : "", (unsigned long long)h.count[i]);
+    fprintf(fp, "]}");
+}
+
+void StatsPrintJson(FILE *fp) {
+    vector<RoleStats> roles = Aggregate();
+    fprintf(fp, "{\n  \"elapsed\": %.6f,\n  \"bytes_in\": %llu,\n  \"bytes_out\": %llu,\n"
+            "  \"roles\": [", StatsNow() - enable_time,
+            (unsigned long long)__atomic_load_n(&total_in, __ATOMIC_RELAXED),
+            (unsigned long long)__atomic_load_n(&total_out, __ATOMIC_RELAXED));
+    for (size_t r = 0; r < roles.size(); r++) {
+        const RoleStats &rs = roles[r];
+        fprintf(fp, "%s\n    {\"role\": \"%s\", \"threads\": %d, \"time\": %.6f, "
+                "\"busy\": %.6f,\n     \"waits\": {", r ? "," : "", rs.role, rs.threads,
+                rs.time, Busy(rs));
+        for (int k = 0; k < STAT_NUM_WAITS; k++)
+            fprintf(fp, "%s\"%s\": {\"time\": %.6f, \"count\": %llu}", k ? ", " : "",
+                    kWaitNames[k], rs.sum.wait[k], (unsigned long long)rs.sum.waits[k]);
+        fprintf(fp, "},\n     \"blocks\": %llu, \"bytes_in\": %llu, \"bytes_out\": %llu,\n     ",
+                (unsigned long long)rs.sum.blocks, (unsigned long long)rs.sum.bytes_in,
+                (unsigned long long)rs.sum.bytes_out);
+        PrintJsonHistogram(fp, "latency_ms", rs.sum.latency);
+        fprintf(fp, ",\n     ");
+        PrintJsonHistogram(fp, "queue_depth", rs.sum.depth);
+        fprintf(fp, "}");
+    }
+    fprintf(fp, "\n  ]\n}\n");
+}
+
+// Поток, печатающий строку прогресса раз в секунду
+static pthread_t progress_thread;
+static pthread_mutex_t progress_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t progress_cv = PTHREAD_COND_INITIALIZER;
+static bool progress_running = false;
+static uint64_t progress_total;
+static double progress_start;
+
+static void PrintProgress(bool tty) {
+    uint64_t in = __atomic_load_n(&total_in, __ATOMIC_RELAXED);
+    uint64_t out = __atomic_load_n(&total_out, __ATOMIC_RELAXED);
+    double t = StatsNow() - progress_start;
+    char done[32] = "";
+    if (progress_total != 0) snprintf(done, sizeof(done), " (%.0f%%)", Percent(in, progress_total));
+    fprintf(stderr, "%.1f MB in%s, %.1f MB out, %.1f MB/s, %.0f s%s",
+            in / 1e6, done, out / 1e6, in / 1e6 / (t > 0 ? t : 1e-9), t, tty ? "  \r" : "\n");
+}
+
+static void *ProgressLoop(void *) {
+    bool tty = isatty(2);
+    pthread_mutex_lock(&progress_mutex);
+    while (progress_running) {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += 1;
+        pthread_cond_timedwait(&progress_cv, &progress_mutex, &ts);
+        if (progress_running) PrintProgress(tty);
+    }
+    pthread_mutex_unlock(&progress_mutex);
+    PrintProgress(tty);
+    if (tty) fprintf(stderr, "\n");
+    return NULL;
+}
+
+void StatsStartProgress(uint64_t total) {
+    progress_total = total;
+    progress_start = StatsNow();
+    progress_running = true;
+    pthread_create(&progress_thread, NULL, ProgressLoop, NULL);
+}
+
+void StatsStopProgress() {
+    pthread_mutex_lock(&progress_mutex);
+    progress_running = false;
+    pthread_cond_signal(&progress_cv);
+    pthread_mutex_unlock(&progress_mutex);
+    pthread_join(progress_thread, NULL);
+}
@@ -0,0 +1,104 @@
+// Счётчики работы потоков mtbzip2 (--stats, --progress).
+//
+// Каждый поток, запущенный при включённой статистике, заводит себе запись
+// ThreadStats и обновляет её без синхронизации: время ожидания в каждом
+// из мест, где поток может простаивать, число обработанных блоков, байты
+// на входе и выходе, гистограммы задержки обработки блока и глубины
+// очереди. Когда статистика выключена, записи не создаются, и счётчики
+// стоят одного чтения thread-local указателя.
+//
+// Общие счётчики прочитанных и записанных байтов ведутся всегда: по ним
+// печатается строка прогресса.
+//
+#ifndef MTBZIP2_STATS_H
+#define MTBZIP2_STATS_H
+
+#include <cstdio>
+#include <stdint.h>
+
+// Места, где поток простаивает или выполняет ввод-вывод
+enum {
+    STAT_WAIT_FREE,    // поток чтения ждёт свободный входной блок
+    STAT_WAIT_BUFFER,  // поток чтения ждёт буфер для результата блока
+    STAT_WAIT_WORK,    // рабочий поток ждёт задание
+    STAT_WAIT_TEAM,    // потоки RLE-сжатия ждут друг друга
+    STAT_WAIT_WINDOW,  // готовый блок ждёт места в окне упорядочивания
+    STAT_WAIT_NEXT,    // поток вывода ждёт следующий по порядку блок
+    STAT_WAIT_MPI,     // обмен сообщениями с MPI-процессами
+    STAT_WAIT_NET,     // обмен блоками с удалёнными процессами по сокетам
+    STAT_IO_READ,      // чтение входных данных
+    STAT_IO_WRITE,     // запись результата
+    STAT_NUM_WAITS
+};
+
+// Гистограмма по степеням двойки: ячейка i - значения от 2^(i-1) до 2^i
+struct StatsHistogram {
+    static const int kBuckets = 16;
+    uint64_t count[kBuckets];
+    uint64_t n;
+    double sum, max;
+
+    void Add(double value);
+};
+
+struct ThreadStats {
+    const char *role;
+    double start, end;
+    double wait[STAT_NUM_WAITS];
+    uint64_t waits[STAT_NUM_WAITS];
+    uint64_t blocks, bytes_in, bytes_out;
+    StatsHistogram latency;  // время обработки блока, мс
+    StatsHistogram depth;    // глубина очереди при постановке/взятии блока
+};
+
+double StatsNow();
+
+// Включает сбор статистики; вызывается до запуска потоков
+void StatsEnable();
+
+// Запись текущего потока или NULL, если статистика выключена
+ThreadStats *CurrentStats();
+
+// Регистрирует текущий поток на время жизни объекта
+class StatsThread {
+  public:
+    explicit StatsThread(const char *role);
+    ~StatsThread();
+
+  private:
+    ThreadStats *stats;
+};
+
+// Учитывает время жизни объекта как ожидание вида kind
+class StatsWait {
+  public:
+    explicit StatsWait(int kind) : kind(kind), stats(CurrentStats()) {
+        if (stats != NULL) start = StatsNow();
+    }
+    ~StatsWait() {
+        if (stats != NULL) {
+            stats->wait[kind] += StatsNow() - start;
+            stats->waits[kind]++;
+        }
+    }
+
+  private:
+    int kind;
+    ThreadStats *stats;
+    double start;
+};
+
+// Прочитано (записано) n байтов входных (выходных) данных
+void StatsInput(uint64_t n);
+void StatsOutput(uint64_t n);
+
+// Сводка по ролям потоков в читаемом виде и в формате JSON
+void StatsPrintSummary(FILE *fp);
+void StatsPrintJson(FILE *fp);
+
+// Периодически печатает строку прогресса в stderr. total - общий объём
+// входных данных или 0, если он неизвестен.
+void StatsStartProgress(uint64_t total);
+void StatsStopProgress();
+
+#endif
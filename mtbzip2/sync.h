@@ -0,0 +1,218 @@
+// Примитивы синхронизации между стадиями конвейера mtbzip2:
+// ограниченная неблокирующая очередь со многими писателями и читателями
+// и "счётчик событий" для засыпания потока, которому нечего делать.
+//
+// Ожидающий поток сначала недолго крутится в цикле, проверяя условие, и
+// только потом засыпает на условной переменной. Пока никто не спит,
+// уведомление стоит одного барьера и чтения счётчика ожидающих.
+//
+#ifndef MTBZIP2_SYNC_H
+#define MTBZIP2_SYNC_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+// Число проверок условия перед тем, как поток заснёт
+static const int kSpinCount = 256;
+
+static inline void CpuRelax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+}
+
+// Класс EventCount
+// Позволяет потоку заснуть до изменения некоторого условия, не теряя
+// уведомлений. Порядок использования ожидающей стороной:
+//   key = ec.PrepareWait();
+//   if (условие выполнено) ec.CancelWait(); else ec.Wait(key);
+// Уведомляющая сторона сначала изменяет условие, затем вызывает Notify.
+class EventCount {
+  public:
+    EventCount() : epoch(0), waiters(0) {
+        pthread_mutex_init(&mutex, NULL);
+        pthread_cond_init(&cv, NULL);
+    }
+
+    ~EventCount() {
+        pthread_cond_destroy(&cv);
+        pthread_mutex_destroy(&mutex);
+    }
+
+    uint32_t PrepareWait() {
+        __atomic_add_fetch(&waiters, 1, __ATOMIC_SEQ_CST);
+        return __atomic_load_n(&epoch, __ATOMIC_SEQ_CST);
+    }
+
+    void CancelWait() {
+        __atomic_sub_fetch(&waiters, 1, __ATOMIC_SEQ_CST);
+    }
+
+    void Wait(uint32_t key) {
+        pthread_mutex_lock(&mutex);
+        while (__atomic_load_n(&epoch, __ATOMIC_RELAXED) == key)
+            pthread_cond_wait(&cv, &mutex);
+        pthread_mutex_unlock(&mutex);
+        __atomic_sub_fetch(&waiters, 1, __ATOMIC_SEQ_CST);
+    }
+
+    // Будит один ожидающий поток (all = false) или все
+    void Notify(bool all = false) {
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&waiters, __ATOMIC_SEQ_CST) == 0) return;
+        pthread_mutex_lock(&mutex);
+        __atomic_add_fetch(&epoch, 1, __ATOMIC_SEQ_CST);
+        if (all)
+            pthread_cond_broadcast(&cv);
+        else
+            pthread_cond_signal(&cv);
+        pthread_mutex_unlock(&mutex);
+    }
+
+  private:
+    uint32_t epoch;
+    int waiters;
+    pthread_mutex_t mutex;
+    pthread_cond_t cv;
+
+    EventCount(const EventCount &) {}
+    void operator =(const EventCount &) {}
+};
+
+// Класс BoundedQueue
+// Ограниченная FIFO-очередь на кольцевом буфере (алгоритм Д. Вьюкова):
+// каждая ячейка хранит порядковый номер, по которому писатель и читатель
+// узнают, свободна ли она, так что операции требуют одного CAS на позиции.
+// Кроме неблокирующих TryPush/TryPop есть ожидающие Push/Pop; после
+// Close() очередь дочитывается до конца, а затем Pop возвращает false.
+template<class T>
+class BoundedQueue {
+  public:
+    explicit BoundedQueue(size_t capacity) {
+        size_t n = 2;
+        while (n < capacity) n *= 2;
+        mask = n - 1;
+        cells = new Cell[n];
+        for (size_t i = 0; i < n; i++) cells[i].seq = i;
+        enqueue_pos = dequeue_pos = 0;
+        closed = false;
+    }
+
+    ~BoundedQueue() { delete[] cells; }
+
+    bool TryPush(const T &value) {
+        Cell *cell;
+        size_t pos = __atomic_load_n(&enqueue_pos, __ATOMIC_RELAXED);
+        while (true) {
+            cell = &cells[pos & mask];
+            size_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+            intptr_t dif = (intptr_t)seq - (intptr_t)pos;
+            if (dif == 0) {
+                if (__atomic_compare_exchange_n(&enqueue_pos, &pos, pos + 1, true,
+                                                __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                    break;
+            } else if (dif < 0) {
+                return false;  // очередь полна
+            } else {
+                pos = __atomic_load_n(&enqueue_pos, __ATOMIC_RELAXED);
+            }
+        }
+        cell->value = value;
+        __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+        not_empty.Notify();
+        return true;
+    }
+
+    bool TryPop(T *value) {
+        Cell *cell;
+        size_t pos = __atomic_load_n(&dequeue_pos, __ATOMIC_RELAXED);
+        while (true) {
+            cell = &cells[pos & mask];
+            size_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+            intptr_t dif = (intptr_t)seq - (intptr_t)(pos + 1);
+            if (dif == 0) {
+                if (__atomic_compare_exchange_n(&dequeue_pos, &pos, pos + 1, true,
+                                                __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                    break;
+            } else if (dif < 0) {
+                return false;  // очередь пуста
+            } else {
+                pos = __atomic_load_n(&dequeue_pos, __ATOMIC_RELAXED);
+            }
+        }
+        *value = cell->value;
+        __atomic_store_n(&cell->seq, pos + mask + 1, __ATOMIC_RELEASE);
+        not_full.Notify();
+        return true;
+    }
+
+    void Push(const T &value) {
+        for (int i = 0; i < kSpinCount; i++) {
+            if (TryPush(value)) return;
+            CpuRelax();
+        }
+        while (true) {
+            uint32_t key = not_full.PrepareWait();
+            if (TryPush(value)) { not_full.CancelWait(); return; }
+            not_full.Wait(key);
+        }
+    }
+
+    // Ожидает элемент; возвращает false, если очередь закрыта и пуста
+    bool Pop(T *value) {
+        for (int i = 0; i < kSpinCount; i++) {
+            if (TryPop(value)) return true;
+            if (IsClosed()) break;
+            CpuRelax();
+        }
+        while (true) {
+            uint32_t key = not_empty.PrepareWait();
+            if (TryPop(value)) { not_empty.CancelWait(); return true; }
+            if (IsClosed()) {
+                not_empty.CancelWait();
+                return TryPop(value);
+            }
+            not_empty.Wait(key);
+        }
+    }
+
+    // Сообщает читателям, что новых элементов больше не будет
+    void Close() {
+        __atomic_store_n(&closed, true, __ATOMIC_SEQ_CST);
+        not_empty.Notify(true);
+    }
+
+    bool IsClosed() const {
+        return __atomic_load_n(&closed, __ATOMIC_SEQ_CST);
+    }
+
+    // Приблизительное число элементов (для статистики)
+    size_t Size() const {
+        size_t tail = __atomic_load_n(&dequeue_pos, __ATOMIC_RELAXED);
+        size_t head = __atomic_load_n(&enqueue_pos, __ATOMIC_RELAXED);
+        return head > tail ? head - tail : 0;
+    }
+
+  private:
+    struct Cell {
+        size_t seq;
+        T value;
+    };
+
+    // позиции писателей и читателей - в разных строках кэша
+    Cell *cells;
+    size_t mask;
+    char pad0[64];
+    size_t enqueue_pos;
+    char pad1[64];
+    size_t dequeue_pos;
+    char pad2[64];
+    bool closed;
+    EventCount not_empty, not_full;
+
+    BoundedQueue(const BoundedQueue &) {}
+    void operator =(const BoundedQueue &) {}
+};
+
+#endif
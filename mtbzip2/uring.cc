@@ -0,0 +1,462 @@
+// Ввод-вывод через io_uring (см. uring.h).
+//
+#include "uring.h"
+#include "arena.h"
+#include "util.h"
+#include <cstring>
+#include <cerrno>
+#include <algorithm>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+using namespace std;
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>) && defined(__NR_io_uring_setup)
+#include <linux/io_uring.h>
+#define HAVE_IO_URING 1
+#endif
+#endif
+#endif
+
+// Размер буфера одной операции; кратен размеру блока устройства, как
+// требует O_DIRECT
+static const uint32_t kChunk = 1 << 20;
+
+// Выравнивание смещений для O_DIRECT
+static const uint64_t kDirectAlign = 4096;
+
+// Файлы меньше этого размера читаются через страничный кэш и с --direct
+static const uint64_t kDirectMin = 64 << 20;
+
+static bool enabled = false, useDirect = false;
+
+// Класс IoRing
+// Кольца io_uring одного потока: операции ставятся в очередь Prep,
+// отправляются ядру Submit, а результаты забираются Reap. Очереди не
+// переполняются, если операций в работе не больше kEntries.
+class IoRing {
+  public:
+    static const unsigned kEntries = 8;
+
+    IoRing();
+    ~IoRing();
+    bool Init();  // false - io_uring недоступен
+    bool Register(unsigned char *p, size_t len);
+    void Prep(bool write, int fd, unsigned char *p, uint32_t len, uint64_t off,
+              uint64_t tag);
+    void Submit();
+    // Результат (байты или -errno) завершённой операции и её tag; если
+    // завершённых нет, ожидает их (wait) или возвращает false
+    bool Reap(bool wait, uint64_t *tag, int *res);
+
+  private:
+    int fd;
+    unsigned pending;  // поставлено в очередь, но не отправлено ядру
+    bool fixed;        // буфер зарегистрирован
+    void *sq_map, *cq_map, *sqe_map;
+    size_t sq_len, cq_len, sqe_len;
+#ifdef HAVE_IO_URING
+    unsigned *sq_tail, *sq_mask, *sq_array, *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+
+    int Enter(unsigned submit, unsigned wait);
+#endif
+
+    IoRing(const IoRing &) {}
+    void operator =(const IoRing &) {}
+};
+
+IoRing::IoRing() {
+    fd = -1;
+    pending = 0;
+    fixed = false;
+    sq_map = cq_map = sqe_map = MAP_FAILED;
+    sq_len = cq_len = sqe_len = 0;
+}
+
+IoRing::~IoRing() {
+    if (sqe_map != MAP_FAILED) munmap(sqe_map, sqe_len);
+    if (cq_map != MAP_FAILED && cq_map != sq_map) munmap(cq_map, cq_len);
+    if (sq_map != MAP_FAILED) munmap(sq_map, sq_len);
+    if (fd >= 0) close(fd);
+}
+
+#ifdef HAVE_IO_URING
+bool IoRing::Init() {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    fd = syscall(__NR_io_uring_setup, kEntries, &p);
+    if (fd < 0) return false;
+    // IORING_OP_READ и IORING_OP_WRITE появились вместе с этим признаком
+    if ((p.features & IORING_FEAT_RW_CUR_POS) == 0) return false;
+
+    const int prot = PROT_READ | PROT_WRITE, flags = MAP_SHARED | MAP_POPULATE;
+    sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    bool single = (p.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single) sq_len = cq_len = max(sq_len, cq_len);
+    sq_map = mmap(NULL, sq_len, prot, flags, fd, IORING_OFF_SQ_RING);
+    if (sq_map == MAP_FAILED) return false;
+    cq_map = single ? sq_map : mmap(NULL, cq_len, prot, flags, fd, IORING_OFF_CQ_RING);
+    if (cq_map == MAP_FAILED) return false;
+    sqe_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    sqe_map = mmap(NULL, sqe_len, prot, flags, fd, IORING_OFF_SQES);
+    if (sqe_map == MAP_FAILED) return false;
+
+    char *sq = (char *)sq_map, *cq = (char *)cq_map;
+    sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    sq_array = (unsigned *)(sq + p.sq_off.array);
+    cq_head = (unsigned *)(cq + p.cq_off.head);
+    cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    sqes = (struct io_uring_sqe *)sqe_map;
+    cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    return true;
+}
+
+// Регистрирует буфер [p, p + len), с которым будут все операции. Если
+// ядро отказало (например, из-за RLIMIT_MEMLOCK), операции выполняются
+// с незарегистрированным буфером.
+bool IoRing::Register(unsigned char *p, size_t len) {
+    struct iovec iov;
+    iov.iov_base = p;
+    iov.iov_len = len;
+    fixed = syscall(__NR_io_uring_register, fd, IORING_REGISTER_BUFFERS, &iov, 1) == 0;
+    return fixed;
+}
+
+void IoRing::Prep(bool write, int file, unsigned char *p, uint32_t len, uint64_t off,
+                  uint64_t tag) {
+    // хвост очереди отправки меняет только этот поток
+    unsigned tail = *sq_tail, i = tail & *sq_mask;
+    struct io_uring_sqe *e = &sqes[i];
+    memset(e, 0, sizeof(*e));
+    if (fixed)
+        e->opcode = write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+    else
+        e->opcode = write ? IORING_OP_WRITE : IORING_OP_READ;
+    e->fd = file;
+    e->addr = (uintptr_t)p;
+    e->len = len;
+    e->off = off;
+    e->buf_index = 0;
+    e->user_data = tag;
+    sq_array[i] = i;
+    __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+    pending++;
+}
+
+int IoRing::Enter(unsigned submit, unsigned wait) {
+    for (;;) {
+        int r = syscall(__NR_io_uring_enter, fd, submit, wait,
+                        wait != 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        if (r >= 0) {
+            pending -= r;
+            return r;
+        }
+        if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+            perror("io_uring_enter");
+            die("Asynchronous I/O failed\n");
+        }
+        if (wait == 0) return 0;
+    }
+}
+
+void IoRing::Submit() {
+    while (pending > 0) Enter(pending, 0);
+}
+
+bool IoRing::Reap(bool wait, uint64_t *tag, int *res) {
+    for (;;) {
+        unsigned head = *cq_head;
+        if (head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+            struct io_uring_cqe *c = &cqes[head & *cq_mask];
+            *tag = c->user_data;
+            *res = c->res;
+            __atomic_store_n(cq_head, head + 1, __ATOMIC_RELEASE);
+            return true;
+        }
+        if (!wait) return false;
+        Enter(pending, 1);
+    }
+}
+#else
+bool IoRing::Init() { return false; }
+bool IoRing::Register(unsigned char *, size_t) { return false; }
+void IoRing::Prep(bool, int, unsigned char *, uint32_t, uint64_t, uint64_t) {}
+void IoRing::Submit() {}
+bool IoRing::Reap(bool, uint64_t *, int *) { return false; }
+#endif
+
+// Новое кольцо или NULL, если io_uring не включён или недоступен
+static IoRing *NewRing() {
+    if (!enabled) return NULL;
+    IoRing *ring = new IoRing();
+    if (!ring->Init()) {
+        delete ring;
+        return NULL;
+    }
+    return ring;
+}
+
+// Включает или выключает O_DIRECT у открытого файла; false - не удалось
+static bool SetDirectFlag(int fd, int flags, bool on) {
+#ifdef O_DIRECT
+    return fcntl(fd, F_SETFL, on ? flags | O_DIRECT : flags & ~O_DIRECT) == 0;
+#else
+    return !on;
+#endif
+}
+
+bool UringEnable(bool direct) {
+    enabled = true;
+    IoRing *ring = NewRing();
+    enabled = ring != NULL;
+    useDirect = enabled && direct;
+    delete ring;
+    return enabled;
+}
+
+uint64_t UringMemoryUsage() {
+    return enabled ? 2 * ArenaSize((uint64_t)kUringSlots * kChunk) : 0;
+}
+
+UringReader *UringReader::Open(FILE *fp) {
+    struct stat st;
+    int fd = fileno(fp);
+    off_t start = lseek(fd, 0, SEEK_CUR);
+    if (!enabled || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || start < 0) return NULL;
+    IoRing *ring = NewRing();
+    if (ring == NULL) return NULL;
+    bool direct = useDirect && (uint64_t)st.st_size >= kDirectMin &&
+                  start % kDirectAlign == 0;
+    return new UringReader(fp, ring, start, direct);
+}
+
+UringReader::UringReader(FILE *fp, IoRing *ring, uint64_t start, bool direct) {
+    this->fp = fp;
+    this->ring = ring;
+    fd = fileno(fp);
+    flags = fcntl(fd, F_GETFL);
+    this->direct = direct && flags >= 0 && SetDirectFlag(fd, flags, true);
+    eof = false;
+    buffers = ArenaAlloc(kUringSlots * kChunk);
+    ring->Register(buffers, kUringSlots * kChunk);
+
+    // чтение сразу всех буферов вперёд
+    next = start;
+    cur = 0;
+    for (int i = 0; i < kUringSlots; i++) {
+        slots[i].offset = next;
+        slots[i].len = slots[i].pos = 0;
+        next += kChunk;
+        Submit(i);
+    }
+    ring->Submit();
+}
+
+UringReader::~UringReader() {
+    if (fp != NULL) Close();
+    delete ring;
+    ArenaFree(buffers);
+}
+
+// Ставит в очередь чтение недостающей части буфера i
+void UringReader::Submit(int i) {
+    Slot &s = slots[i];
+    s.busy = true;
+    ring->Prep(false, fd, buffers + (size_t)i * kChunk + s.len, kChunk - s.len,
+               s.offset + s.len, i);
+}
+
+// Ожидает завершения одного из чтений
+void UringReader::Complete() {
+    uint64_t tag;
+    int res;
+    ring->Reap(true, &tag, &res);
+    Slot &s = slots[tag];
+    if (res == -EINTR || res == -EAGAIN) {
+        Submit(tag);
+    } else if (res == -EINVAL && direct) {
+        // O_DIRECT не поддерживается файловой системой или не подходит
+        // для конца файла: дальше файл читается через кэш
+        SetDirectFlag(fd, flags, false);
+        direct = false;
+        Submit(tag);
+    } else if (res < 0) {
+        errno = -res;
+        perror("read");
+        die("Failed to read data from input file\n");
+    } else if (res > 0 && s.len + res < kChunk) {
+        // короткое чтение - обычно конец файла, что и проверяется
+        // чтением остатка буфера
+        s.len += res;
+        Submit(tag);
+    } else {
+        s.len += res;
+        s.busy = false;
+        return;
+    }
+    ring->Submit();
+}
+
+uint32_t UringReader::Read(unsigned char *buf, uint32_t n) {
+    while (!eof) {
+        Slot &s = slots[cur];
+        while (s.busy) Complete();
+        if (s.pos < s.len) {
+            n = min(n, s.len - s.pos);
+            memcpy(buf, buffers + (size_t)cur * kChunk + s.pos, n);
+            s.pos += n;
+            return n;
+        }
+        // неполный буфер - последний; иначе он отдаётся под чтение
+        // следующей части файла
+        if (s.len < kChunk) {
+            eof = true;
+            break;
+        }
+        s.offset = next;
+        s.len = s.pos = 0;
+        next += kChunk;
+        Submit(cur);
+        ring->Submit();
+        cur = (cur + 1) % kUringSlots;
+    }
+    return 0;
+}
+
+void UringReader::Close() {
+    // чтения за концом файла ещё могут быть не завершены
+    for (int i = 0; i < kUringSlots; i++)
+        while (slots[i].busy) Complete();
+    if (direct) SetDirectFlag(fd, flags, false);
+    fclose(fp);
+    fp = NULL;
+}
+
+UringSink *UringSink::Open(FILE *fp) {
+    struct stat st;
+    // всё дальнейшее пишется в дескриптор напрямую
+    fflush(fp);
+    int fd = fileno(fp), flags = fcntl(fd, F_GETFL);
+    off_t start = lseek(fd, 0, SEEK_CUR);
+    // при O_APPEND смещения операций не учитываются
+    if (!enabled || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || start < 0 ||
+        flags < 0 || (flags & O_APPEND) != 0)
+        return NULL;
+    IoRing *ring = NewRing();
+    if (ring == NULL) return NULL;
+    return new UringSink(fp, ring, start);
+}
+
+UringSink::UringSink(FILE *fp, IoRing *ring, uint64_t start) {
+    this->fp = fp;
+    this->ring = ring;
+    fd = fileno(fp);
+    flags = fcntl(fd, F_GETFL);
+    buffers = ArenaAlloc(kUringSlots * kChunk);
+    ring->Register(buffers, kUringSlots * kChunk);
+    for (int i = 0; i < kUringSlots; i++) slots[i].busy = false;
+    cur = 0;
+    fill = 0;
+    this->start = next = start;
+    direct = false;
+    may_direct = useDirect && start % kDirectAlign == 0;
+}
+
+UringSink::~UringSink() {
+    if (fill > 0) {
+        // неполный последний буфер пишется через кэш: O_DIRECT требует
+        // длины, кратной блоку устройства
+        for (int i = 0; i < kUringSlots; i++)
+            while (slots[i].busy) Complete(true);
+        SetDirect(false);
+        Send(cur);
+    }
+    for (int i = 0; i < kUringSlots; i++)
+        while (slots[i].busy) Complete(true);
+    SetDirect(false);
+    lseek(fd, next, SEEK_SET);
+    fclose(fp);
+    delete ring;
+    ArenaFree(buffers);
+}
+
+void UringSink::SetDirect(bool on) {
+    if (on == direct) return;
+    if (SetDirectFlag(fd, flags, on))
+        direct = on;
+    else
+        may_direct = false;
+}
+
+// Отправляет на запись заполненную часть текущего буфера i
+void UringSink::Send(int i) {
+    Slot &s = slots[i];
+    s.offset = next;
+    s.len = fill;
+    s.done = 0;
+    next += fill;
+    fill = 0;
+    Submit(i);
+    ring->Submit();
+}
+
+// Ставит в очередь запись незаписанной части буфера i
+void UringSink::Submit(int i) {
+    Slot &s = slots[i];
+    s.busy = true;
+    ring->Prep(true, fd, buffers + (size_t)i * kChunk + s.done, s.len - s.done,
+               s.offset + s.done, i);
+}
+
+// Обрабатывает завершённые записи; wait - дождаться хотя бы одной
+void UringSink::Complete(bool wait) {
+    uint64_t tag;
+    int res;
+    while (ring->Reap(wait, &tag, &res)) {
+        wait = false;
+        Slot &s = slots[tag];
+        if (res == -EINTR || res == -EAGAIN) {
+            Submit(tag);
+        } else if (res == -EINVAL && direct) {
+            SetDirect(false);
+            may_direct = false;
+            Submit(tag);
+        } else if (res <= 0) {
+            errno = res < 0 ? -res : ENOSPC;
+            perror("write");
+            die("Failed to write data to output file\n");
+        } else if ((s.done += res) < s.len) {
+            Submit(tag);
+        } else {
+            s.busy = false;
+        }
+        ring->Submit();
+    }
+}
+
+void UringSink::Write(const unsigned char *data, size_t n) {
+    while (n > 0) {
+        uint32_t m = (uint32_t)min(n, (size_t)(kChunk - fill));
+        memcpy(buffers + (size_t)cur * kChunk + fill, data, m);
+        fill += m;
+        data += m;
+        n -= m;
+        if (fill < kChunk) break;
+
+        // начало большого файла остаётся в кэше, остальное пишется мимо него
+        if (may_direct && next - start >= kDirectMin) SetDirect(true);
+        Send(cur);
+        cur = (cur + 1) % kUringSlots;
+        Complete(false);
+        while (slots[cur].busy) Complete(true);
+    }
+}
@@ -0,0 +1,117 @@
+// Асинхронное чтение и запись файлов через io_uring (параметры --io-uring
+// и --direct).
+//
+// При обычном вводе-выводе поток чтения ждёт каждого fread, а поток записи
+// - каждого write, и на сетевых блочных устройствах задержка одного вызова
+// останавливает весь конвейер. Здесь входной файл читается на несколько
+// буферов вперёд, а запись только ставится в очередь: поток записи ждёт
+// её завершения, лишь когда заняты все буферы. Буферы регистрируются в ядре
+// (IORING_REGISTER_BUFFERS), так что их страницы не закрепляются заново
+// при каждой операции.
+//
+// С --direct обычные файлы от 64Мб читаются с O_DIRECT, а в выходной файл
+// с O_DIRECT пишется всё после первых 64Мб: сжатие больших файлов не
+// вытесняет из страничного кэша данные других процессов. Если файловая
+// система O_DIRECT не поддерживает, файл читается и пишется через кэш.
+//
+// liburing не нужен: кольца создаются системными вызовами напрямую. Если
+// ядро не поддерживает io_uring или он запрещён, а также для каналов
+// и терминалов Open возвращает NULL, и используется обычный ввод-вывод.
+//
+#ifndef MTBZIP2_URING_H
+#define MTBZIP2_URING_H
+
+#include <cstdio>
+#include <stddef.h>
+#include <stdint.h>
+#include "mtbzip2.h"
+
+class IoRing;
+
+// Число буферов по 1Мб у каждого читателя и приёмника
+static const int kUringSlots = 4;
+
+// Включает ввод-вывод через io_uring; direct - O_DIRECT для больших
+// файлов. Возвращает false, если io_uring в системе недоступен.
+bool UringEnable(bool direct);
+
+// Память буферов io_uring одного конвейера (0, если io_uring не включён)
+uint64_t UringMemoryUsage();
+
+// Класс UringReader
+// Чтение обычного файла с упреждением через io_uring. Файл читается
+// с текущей позиции до конца и закрывается по Close() или в деструкторе.
+class UringReader {
+  public:
+    // NULL, если io_uring не включён или недоступен, или fp не обычный файл
+    static UringReader *Open(FILE *fp);
+    ~UringReader();
+
+    // Читает до n байтов; 0 - конец файла
+    uint32_t Read(unsigned char *buf, uint32_t n);
+    void Close();
+
+  private:
+    struct Slot {
+        uint64_t offset;  // смещение буфера в файле
+        uint32_t len;     // прочитано байтов
+        uint32_t pos;     // из них уже отдано
+        bool busy;        // чтение не завершено
+    };
+    FILE *fp;
+    int fd, flags;  // flags - исходные флаги файла, восстанавливаются в Close
+    IoRing *ring;
+    unsigned char *buffers;
+    Slot slots[kUringSlots];
+    int cur;        // слот, из которого отдаются данные
+    uint64_t next;  // смещение следующего чтения
+    bool direct, eof;
+
+    UringReader(FILE *fp, IoRing *ring, uint64_t start, bool direct);
+    void Submit(int i);
+    void Complete();
+
+    UringReader(const UringReader &) {}
+    void operator =(const UringReader &) {}
+};
+
+// Класс UringSink
+// Приёмник, записывающий данные в обычный файл через io_uring с текущей
+// позиции. Данные копируются в буферы и отправляются на запись, когда
+// буфер заполнен; деструктор дожидается окончания записи и закрывает файл.
+class UringSink : public MtSink {
+  public:
+    // NULL, если io_uring не включён или недоступен, или fp не обычный файл
+    static UringSink *Open(FILE *fp);
+    ~UringSink();
+    virtual void Write(const unsigned char *data, size_t n);
+
+  private:
+    struct Slot {
+        uint64_t offset;  // смещение буфера в файле
+        uint32_t len;     // байтов в буфере
+        uint32_t done;    // из них уже записано
+        bool busy;        // запись не завершена
+    };
+    FILE *fp;
+    int fd, flags;
+    IoRing *ring;
+    unsigned char *buffers;
+    Slot slots[kUringSlots];
+    int cur;         // заполняемый слот
+    uint32_t fill;   // байтов в нём
+    uint64_t start, next;  // начальная позиция и смещение данных слота cur
+    bool direct;     // включён ли O_DIRECT
+    bool may_direct; // можно ли его включить
+
+    UringSink(FILE *fp, IoRing *ring, uint64_t start);
+    void Send(int i);
+    void Submit(int i);
+    void Complete(bool wait);
+    void SetDirect(bool on);
+
+    UringSink(const UringSink &) : MtSink() {}
+    void operator =(const UringSink &) {}
+};
+
+#endif
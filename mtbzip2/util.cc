@@ -0,0 +1,21 @@
+#include "util.h"
+#include <cstdio>
+#include <cstdlib>
+
+#ifdef MPIBZIP2
+#include <mpi.h>
+#endif
+
+void die(const char *msg) {
+    if (msg != NULL) fprintf(stderr, "Fatal error: %s", msg);
+#ifdef MPIBZIP2
+    MPI_Finalize();
+#endif
+    exit(1);
+}
+
+unsigned char *xmalloc(uint32_t n) {
+    void *p = malloc(n);
+    if (p == NULL) die("Out of memory\n");
+    return (unsigned char *)p;
+}
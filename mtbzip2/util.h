@@ -0,0 +1,17 @@
+// Общие вспомогательные функции mtbzip2.
+//
+#ifndef MTBZIP2_UTIL_H
+#define MTBZIP2_UTIL_H
+
+#include <stdint.h>
+
+// Печатает сообщение об ошибке и завершает программу
+#ifdef __GNUC__
+__attribute__((noreturn))
+#endif
+void die(const char *msg = 0);
+
+// malloc, завершающий программу при нехватке памяти
+unsigned char *xmalloc(uint32_t n);
+
+#endif
@@ -0,0 +1,166 @@
+// writerbench: измерение скорости выходной стадии (BitStreamWriter).
+//
+// Через BitStreamWriter записывается последовательность блоков случайных
+// данных произвольной битовой длины, как их выдают потоки сжатия, в
+// /dev/null. Для сравнения та же последовательность записывается прежним
+// побайтовым алгоритмом через fwrite с буфером 1 Мб. Перед замерами
+// выходы обоих вариантов сравниваются побитово.
+//
+// Использование: writerbench [размер блока в Кб] [число блоков]
+//
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include "bitstream.h"
+#include "util.h"
+
+static double Now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Прежняя реализация: сдвиг по одному байту через 32-битный регистр
+class ByteWriter {
+  public:
+    ByteWriter(FILE *fp) : fp(fp), tail(buffer), reg(0), live(0) {}
+    ~ByteWriter() {
+        if (live > 0) Write((const unsigned char *)"\0", 8 - live);
+        Flush();
+    }
+
+    void Write(const unsigned char *data, uint32_t bits) {
+        uint32_t r = reg;
+        for (; bits >= 8; bits -= 8) {
+            r <<= 8;
+            r |= ((uint32_t)(*data++)) << (8 - live);
+            *tail = (r >> 8) & 0xffL;
+            if (++tail == buffer + sizeof(buffer)) Flush();
+        }
+        if (bits != 0) {
+            r <<= 8;
+            r |= ((uint32_t)(*data++)) << (8 - live);
+            live += bits;
+            if (live >= 8) {
+                live -= 8;
+                *tail = (r >> 8) & 0xffL;
+                if (++tail == buffer + sizeof(buffer)) Flush();
+            } else {
+                r >>= 8;
+            }
+            r >>= 8 - live; r <<= 8 - live;
+        }
+        reg = r;
+    }
+
+    void Flush() {
+        size_t n = tail - buffer;
+        if (n != 0 && fwrite(buffer, 1, n, fp) != n) die("write error\n");
+        tail = buffer;
+    }
+
+  private:
+    FILE *fp;
+    unsigned char buffer[1048576], *tail;
+    uint32_t reg, live;
+};
+
+struct Block { unsigned char *data; uint32_t bits; };
+
+template<class Writer>
+static void WriteAll(Writer &w, const Block *blocks, int count) {
+    w.Write((const unsigned char *)"BZh9", 32);
+    for (int i = 0; i < count; i++) w.Write(blocks[i].data, blocks[i].bits);
+}
+
+// Прогоняет все блоки через writer, открытый на файле fp; время в секундах
+static double RunNew(FILE *fp, const Block *blocks, int count) {
+    double t = Now();
+    {
+        FileSink sink(fp);
+        BitStreamWriter w(&sink, 4194304);
+        WriteAll(w, blocks, count);
+    }
+    return Now() - t;
+}
+
+static double RunOld(FILE *fp, const Block *blocks, int count) {
+    double t = Now();
+    {
+        ByteWriter *w = new ByteWriter(fp);
+        WriteAll(*w, blocks, count);
+        delete w;
+    }
+    fclose(fp);
+    return Now() - t;
+}
+
+static bool SameFiles(FILE *a, FILE *b) {
+    rewind(a);
+    rewind(b);
+    int ca, cb;
+    do {
+        ca = getc(a);
+        cb = getc(b);
+        if (ca != cb) return false;
+    } while (ca != EOF);
+    return true;
+}
+
+int main(int argc, char **argv) {
+    uint32_t size = (argc > 1 ? atoi(argv[1]) : 700) * 1024;
+    int count = argc > 2 ? atoi(argv[2]) : 200;
+
+    // блоки случайной длины от size/2 до size байтов, с произвольным
+    // числом битов в последнем байте
+    uint32_t seed = 12345;
+    Block *blocks = new Block[count];
+    uint64_t total = 0;
+    for (int i = 0; i < count; i++) {
+        seed = seed * 1103515245 + 12345;
+        uint32_t n = size / 2 + (seed >> 8) % (size / 2 + 1);
+        blocks[i].data = xmalloc(n + 1);
+        for (uint32_t j = 0; j <= n; j++) {
+            seed = seed * 1103515245 + 12345;
+            blocks[i].data[j] = seed >> 24;
+        }
+        blocks[i].bits = n * 8 + (seed >> 4) % 8;
+        total += n;
+    }
+
+    // проверка корректности на временных файлах
+    FILE *a = tmpfile(), *b = tmpfile();
+    if (a == NULL || b == NULL) die("can't create temporary files\n");
+    int fa = dup(fileno(a));
+    RunNew(a, blocks, count);
+    a = fdopen(fa, "rb");
+    { ByteWriter w(b); WriteAll(w, blocks, count); }
+    if (!SameFiles(a, b)) {
+        printf("output mismatch\n");
+        return 1;
+    }
+    fclose(a);
+    fclose(b);
+
+    printf("%d blocks, %.1f Mb total\n", count, total / 1048576.0);
+    printf("%-16s %10s %10s\n", "writer", "MB/s", "speedup");
+    double best[2] = { 0, 0 };
+    for (int rep = 0; rep < 5; rep++) {
+        for (int k = 0; k < 2; k++) {
+            FILE *fp = fopen("/dev/null", "wb");
+            if (fp == NULL) die("can't open /dev/null\n");
+            double t = (k == 0 ? RunOld : RunNew)(fp, blocks, count);
+            double speed = total / 1e6 / (t > 0 ? t : 1e-9);
+            if (speed > best[k]) best[k] = speed;
+        }
+    }
+    printf("%-16s %10.1f %9.2fx\n", "bytewise+fwrite", best[0], 1.0);
+    printf("%-16s %10.1f %9.2fx\n", "BitStreamWriter", best[1], best[1] / best[0]);
+
+    for (int i = 0; i < count; i++) free(blocks[i].data);
+    delete[] blocks;
+    return 0;
+}